@@ -0,0 +1,673 @@
+
+/** Load generator for the hLink and HTTP servers, every client is a
+ *   thread that sends requests back to back for the duration of the run
+ */
+
+#include "./bench.h"
+#include "./hlink.h"
+
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <strings.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <time.h>
+
+#define HTTP_PORT "8000"
+#define MAX_ENTRIES 16
+// Clients that haven't stopped this long after the run are reported as stalled
+#define GRACE_MS 5000
+
+enum bench_kind
+{
+	BK_hlink,
+	BK_http,
+};
+
+// An action or path of the mix
+typedef struct bench_entry
+{
+	char name[128];
+	int action; // enum HAction for hLink entries
+	unsigned weight;
+} bench_entry;
+
+typedef struct bench_stats
+{
+	double *lat; // ms, successful requests only
+	size_t nlat, caplat;
+	unsigned long busy;
+	unsigned long errors;
+	unsigned long connerrors;
+} bench_stats;
+
+typedef struct bench_config
+{
+	const char *addr;
+	unsigned long clients, httpclients;
+	unsigned long duration; // s
+	unsigned long bodysize;
+	unsigned long split; // max bytes per send of an HTTP request, 0 for all at once
+	unsigned long headers; // extra headers per HTTP request
+	uint64_t id;
+	bench_entry actions[MAX_ENTRIES];
+	size_t nactions;
+	bench_entry paths[MAX_ENTRIES];
+	size_t npaths;
+	struct addrinfo *httphost;
+} bench_config;
+
+typedef struct bench_client
+{
+	const bench_config *cfg;
+	enum bench_kind kind;
+	pthread_t thread;
+	unsigned seed;
+	int version; // negotiated hLink protocol version, 0 if it never connected
+	volatile int done;
+	bench_stats stats[MAX_ENTRIES];
+} bench_client;
+
+static volatile int g_stop = 0;
+
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void record(bench_stats *stats, double lat)
+{
+	if(stats->nlat == stats->caplat)
+	{
+		size_t ncap = stats->caplat ? stats->caplat * 2 : 1024;
+		double *nlat = realloc(stats->lat, ncap * sizeof(double));
+		if(!nlat) return;
+		stats->lat = nlat;
+		stats->caplat = ncap;
+	}
+	stats->lat[stats->nlat++] = lat;
+}
+
+static size_t pick(bench_client *c, const bench_entry *entries, size_t amount)
+{
+	unsigned total = 0;
+	for(size_t i = 0; i < amount; ++i)
+		total += entries[i].weight;
+	unsigned r = rand_r(&c->seed) % total;
+	for(size_t i = 0; i < amount; ++i)
+	{
+		if(r < entries[i].weight) return i;
+		r -= entries[i].weight;
+	}
+	return 0;
+}
+
+static void ignore_jobs(hlJobStatus *jobs, size_t amount, int final, void *userdata)
+{
+	(void) jobs; (void) amount; (void) final; (void) userdata;
+}
+
+static int hlink_request(hLink *link, const bench_config *cfg, int action, const void *body)
+{
+	uint64_t id = cfg->id;
+	uint32_t job;
+	switch(action)
+	{
+	case HA_nothing: return hl_nothing_body(link, body, cfg->bodysize);
+	case HA_add_queue: return hl_addqueue(link, &id, 1);
+	case HA_install_id: return hl_installids(link, &id, 1, &job);
+	case HA_watch: return hl_watch(link, NULL, 0, ignore_jobs, NULL);
+	case HA_sleep: return hl_sleep(link);
+	}
+	return HE_unsupported;
+}
+
+// Drops the connection of link so the next request authenticates again
+static void unlink_sock(hLink *link)
+{
+	if(link->sock >= 0)
+		close(link->sock);
+	link->sock = -1;
+	link->isauthed = 0;
+}
+
+static void *hlink_client(void *arg)
+{
+	bench_client *c = arg;
+	const bench_config *cfg = c->cfg;
+	hLink link;
+	int res;
+
+	char *body = NULL;
+	if(cfg->bodysize != 0)
+		body = calloc(cfg->bodysize, 1);
+
+	if((res = hl_makelink(&link, cfg->addr)) != 0)
+	{
+		++c->stats[0].connerrors;
+		goto out;
+	}
+
+	while(!g_stop)
+	{
+		size_t i = pick(c, cfg->actions, cfg->nactions);
+		bench_stats *stats = &c->stats[i];
+
+		if(!link.isauthed)
+		{
+			if((res = hl_auth(&link)) == HE_tryagain)
+				++stats->busy;
+			else if(res != HE_success)
+				++stats->connerrors;
+			if(res != HE_success)
+			{
+				// don't hammer a server that refuses us
+				usleep(10000);
+				continue;
+			}
+			c->version = link.version;
+		}
+
+		double start = now_ms();
+		res = hlink_request(&link, cfg, cfg->actions[i].action, body);
+		if(res == HE_success)
+			record(stats, now_ms() - start);
+		else if(res == HE_tryagain)
+			++stats->busy;
+		else if(res < 0 || res == HE_protocol || res == HE_notauthed)
+		{
+			++stats->connerrors;
+			unlink_sock(&link);
+		}
+		else ++stats->errors;
+	}
+
+	hl_destroylink(&link);
+out:
+	free(body);
+	c->done = 1;
+	return NULL;
+}
+
+// Buffered reading of HTTP responses
+typedef struct reader
+{
+	int sock;
+	size_t pos, len;
+	char buf[8192];
+} reader;
+
+static int rd_fill(reader *r)
+{
+	ssize_t recvd = recv(r->sock, r->buf, sizeof(r->buf), 0);
+	if(recvd < 0) return -errno;
+	if(recvd == 0) return -ECONNRESET;
+	r->pos = 0;
+	r->len = recvd;
+	return 0;
+}
+
+// Reads a line without the line ending, longer lines are cut off
+static int rd_line(reader *r, char *line, size_t max)
+{
+	size_t len = 0;
+	int res;
+	while(1)
+	{
+		if(r->pos == r->len && (res = rd_fill(r)) != 0)
+			return res;
+		char ch = r->buf[r->pos++];
+		if(ch == '\n') break;
+		if(ch != '\r' && len + 1 < max)
+			line[len++] = ch;
+	}
+	line[len] = '\0';
+	return 0;
+}
+
+static int rd_skip(reader *r, uint64_t amount)
+{
+	int res;
+	while(amount != 0)
+	{
+		if(r->pos == r->len && (res = rd_fill(r)) != 0)
+			return res;
+		size_t avail = r->len - r->pos;
+		size_t n = avail < amount ? avail : amount;
+		r->pos += n;
+		amount -= n;
+	}
+	return 0;
+}
+
+static int http_connect(const bench_config *cfg)
+{
+	struct addrinfo *host = cfg->httphost;
+	int sock = socket(host->ai_family, host->ai_socktype, host->ai_protocol);
+	if(sock < 0) return -errno;
+
+	if(connect(sock, host->ai_addr, host->ai_addrlen) < 0)
+	{ int ret = -errno; close(sock); return ret; }
+
+	int nodelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	return sock;
+}
+
+// Sends a GET request and reads the whole response, *keepalive is
+// cleared if the server closes the connection after it
+static int http_get(reader *r, const bench_config *cfg, const char *path, int *status, int *keepalive)
+{
+	char line[1024];
+	char req[4096];
+	int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n", path, cfg->addr);
+	for(unsigned long i = 0; i < cfg->headers && len > 0 && (size_t) len < sizeof(req); ++i)
+		len += snprintf(req + len, sizeof(req) - len, "X-Bench-%lu: 0123456789abcdef0123456789abcdef\r\n", i);
+	if(len > 0 && (size_t) len < sizeof(req))
+		len += snprintf(req + len, sizeof(req) - len, "\r\n");
+	if(len < 0 || (size_t) len >= sizeof(req))
+		return -EINVAL;
+	for(int sent = 0; sent < len; )
+	{
+		size_t piece = len - sent;
+		if(cfg->split != 0 && piece > cfg->split) piece = cfg->split;
+		ssize_t n = send(r->sock, req + sent, piece, MSG_NOSIGNAL);
+		if(n < 0) return -errno;
+		sent += n;
+	}
+
+	int res;
+	if((res = rd_line(r, line, sizeof(line))) != 0)
+		return res;
+	if(sscanf(line, "HTTP/1.%*d %d", status) != 1)
+		return -EPROTO;
+
+	uint64_t length = 0;
+	int chunked = 0, haslength = 0;
+	*keepalive = 1;
+	while(1)
+	{
+		if((res = rd_line(r, line, sizeof(line))) != 0)
+			return res;
+		if(line[0] == '\0') break;
+		if(strncasecmp(line, "Content-Length:", 15) == 0)
+		{
+			length = strtoull(line + 15, NULL, 10);
+			haslength = 1;
+		}
+		else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+			chunked = strstr(line + 18, "chunked") != NULL;
+		else if(strncasecmp(line, "Connection:", 11) == 0 && strstr(line + 11, "close"))
+			*keepalive = 0;
+	}
+
+	if(chunked)
+	{
+		while(1)
+		{
+			if((res = rd_line(r, line, sizeof(line))) != 0)
+				return res;
+			uint64_t size = strtoull(line, NULL, 16);
+			if(size == 0) break;
+			if((res = rd_skip(r, size)) != 0 || (res = rd_line(r, line, sizeof(line))) != 0)
+				return res;
+		}
+		// trailers
+		do {
+			if((res = rd_line(r, line, sizeof(line))) != 0)
+				return res;
+		} while(line[0] != '\0');
+		return 0;
+	}
+	if(haslength)
+		return rd_skip(r, length);
+
+	// the body ends with the connection
+	*keepalive = 0;
+	while((res = rd_fill(r)) == 0)
+		;
+	return res == -ECONNRESET ? 0 : res;
+}
+
+static void *http_client(void *arg)
+{
+	bench_client *c = arg;
+	const bench_config *cfg = c->cfg;
+	reader *r = malloc(sizeof(reader));
+	if(!r) goto out;
+	r->sock = -1;
+
+	while(!g_stop)
+	{
+		size_t i = pick(c, cfg->paths, cfg->npaths);
+		bench_stats *stats = &c->stats[i];
+
+		if(r->sock < 0)
+		{
+			if((r->sock = http_connect(cfg)) < 0)
+			{
+				++stats->connerrors;
+				usleep(10000);
+				continue;
+			}
+			r->pos = r->len = 0;
+		}
+
+		int status, keepalive;
+		double start = now_ms();
+		int res = http_get(r, cfg, cfg->paths[i].name, &status, &keepalive);
+		double lat = now_ms() - start;
+
+		if(res != 0)
+			++stats->connerrors;
+		else if(status == 429 || status == 503)
+			++stats->busy;
+		else if(status >= 400)
+			++stats->errors;
+		else record(stats, lat);
+
+		if(res != 0 || !keepalive)
+		{
+			close(r->sock);
+			r->sock = -1;
+		}
+	}
+
+	if(r->sock >= 0) close(r->sock);
+	free(r);
+out:
+	c->done = 1;
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+// nearest-rank percentile of sorted lat
+static double percentile(const double *lat, size_t n, double p)
+{
+	if(n == 0) return 0;
+	size_t rank = (size_t) (p * n + 0.999999);
+	return lat[(rank ? rank : 1) - 1];
+}
+
+static void merge(bench_stats *into, const bench_stats *from)
+{
+	for(size_t i = 0; i < from->nlat; ++i)
+		record(into, from->lat[i]);
+	into->busy += from->busy;
+	into->errors += from->errors;
+	into->connerrors += from->connerrors;
+}
+
+static void print_row(const char *name, bench_stats *stats, double secs)
+{
+	qsort(stats->lat, stats->nlat, sizeof(double), cmp_double);
+	unsigned long attempts = stats->nlat + stats->busy + stats->errors + stats->connerrors;
+	printf("  %-20s %9zu %10.1f %9.3f %9.3f %9.3f %9.3f %7.2f%% %7lu %7lu\n", name,
+		stats->nlat, stats->nlat / secs,
+		percentile(stats->lat, stats->nlat, 0.50), percentile(stats->lat, stats->nlat, 0.95),
+		percentile(stats->lat, stats->nlat, 0.99), stats->nlat ? stats->lat[stats->nlat - 1] : 0.0,
+		attempts ? stats->busy * 100.0 / attempts : 0.0, stats->errors, stats->connerrors);
+}
+
+static void report(const char *label, bench_client *clients, size_t amount,
+	const bench_entry *entries, size_t nentries, double secs)
+{
+	if(amount == 0) return;
+
+	bench_stats total;
+	memset(&total, 0, sizeof(total));
+	size_t stalled = 0;
+	int version = 0;
+
+	printf("%s: %zu clients", label, amount);
+	for(size_t i = 0; i < amount; ++i)
+		if(clients[i].version > version) version = clients[i].version;
+	if(version != 0) printf(", protocol v%d", version);
+	printf(", %.1f s\n", secs);
+	printf("  %-20s %9s %10s %9s %9s %9s %9s %8s %7s %7s\n", "", "requests", "req/s",
+		"p50 ms", "p95 ms", "p99 ms", "max ms", "busy", "errors", "conn");
+
+	for(size_t e = 0; e < nentries; ++e)
+	{
+		bench_stats stats;
+		memset(&stats, 0, sizeof(stats));
+		for(size_t i = 0; i < amount; ++i)
+			if(clients[i].done) merge(&stats, &clients[i].stats[e]);
+		print_row(entries[e].name, &stats, secs);
+		merge(&total, &stats);
+		free(stats.lat);
+	}
+	if(nentries > 1)
+		print_row("total", &total, secs);
+	free(total.lat);
+
+	for(size_t i = 0; i < amount; ++i)
+		if(!clients[i].done) ++stalled;
+	if(stalled != 0)
+		printf("  %zu clients were stuck in a request and are left out\n", stalled);
+}
+
+static const char *action_names[] = {
+	[HA_nothing] = "nothing",
+	[HA_add_queue] = "add_queue",
+	[HA_install_id] = "install_id",
+	[HA_watch] = "watch",
+	[HA_sleep] = "sleep",
+};
+
+// Parses "NAME[:WEIGHT],..." into entries, returns 0 on failure
+static int parse_mix(const char *mix, bench_entry *entries, size_t *amount, int actions)
+{
+	*amount = 0;
+	while(*mix != '\0')
+	{
+		if(*amount == MAX_ENTRIES)
+		{
+			fprintf(stderr, "bench: at most %d entries per mix\n", MAX_ENTRIES);
+			return 0;
+		}
+		bench_entry *e = &entries[*amount];
+		size_t len = strcspn(mix, ",");
+		size_t namelen = strcspn(mix, ":,");
+		if(namelen == 0 || namelen >= sizeof(e->name))
+		{
+			fprintf(stderr, "bench: invalid mix entry '%.*s'\n", (int) len, mix);
+			return 0;
+		}
+		memcpy(e->name, mix, namelen);
+		e->name[namelen] = '\0';
+		e->weight = namelen < len ? strtoul(mix + namelen + 1, NULL, 10) : 1;
+		if(e->weight == 0)
+		{
+			fprintf(stderr, "bench: invalid weight for '%s'\n", e->name);
+			return 0;
+		}
+
+		if(actions)
+		{
+			e->action = -1;
+			for(size_t i = 0; i < sizeof(action_names) / sizeof(action_names[0]); ++i)
+				if(action_names[i] && strcmp(action_names[i], e->name) == 0)
+					e->action = i;
+			if(e->action < 0)
+			{
+				fprintf(stderr, "bench: unknown action '%s'\n", e->name);
+				return 0;
+			}
+		}
+		else if(e->name[0] != '/')
+		{
+			fprintf(stderr, "bench: path '%s' doesn't start with a /\n", e->name);
+			return 0;
+		}
+
+		++*amount;
+		mix += len;
+		if(*mix == ',') ++mix;
+	}
+	return *amount != 0;
+}
+
+static int getnum(const char *s, unsigned long *ul)
+{
+	errno = 0;
+	char *end;
+	*ul = strtoul(s, &end, 10);
+	return !(s == NULL || end == s || *end != '\0' || errno == ERANGE);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: bench [address] [options]\n\n"
+		"Options:\n"
+		"  -c, --clients N       hLink clients (default 4)\n"
+		"  -C, --http-clients N  HTTP clients (default 4)\n"
+		"  -d, --duration S      seconds to run for (default 10)\n"
+		"  -a, --actions MIX     hLink actions to send (default nothing)\n"
+		"  -p, --paths MIX       HTTP paths to request (default /)\n"
+		"  -b, --body BYTES      body size of nothing requests (default 0)\n"
+		"  -i, --id ID           hShop id for add_queue and install_id (default 1)\n"
+		"  -s, --split BYTES     send HTTP requests in pieces of at most BYTES\n"
+		"  -H, --headers N       extra headers per HTTP request (default 0)\n\n"
+		"A MIX is a comma separated list of NAME[:WEIGHT], e.g. nothing:9,add_queue:1\n"
+		"Actions: nothing, add_queue, install_id, watch and sleep\n"
+		"The 3ds serves at most 8 clients at once, more show up as busy\n");
+}
+
+int bench(int argc, char *argv[])
+{
+	if(argc < 2)
+	{
+		usage();
+		return 1;
+	}
+
+	bench_config cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.addr = argv[1];
+	cfg.clients = 4;
+	cfg.httpclients = 4;
+	cfg.duration = 10;
+	cfg.id = 1;
+	parse_mix("nothing", cfg.actions, &cfg.nactions, 1);
+	parse_mix("/", cfg.paths, &cfg.npaths, 0);
+
+	for(int i = 2; i < argc; ++i)
+	{
+		const char *opt = argv[i];
+		const char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+		unsigned long num;
+		int ok;
+		if(strcmp(opt, "-c") == 0 || strcmp(opt, "--clients") == 0)
+			ok = getnum(arg, &cfg.clients);
+		else if(strcmp(opt, "-C") == 0 || strcmp(opt, "--http-clients") == 0)
+			ok = getnum(arg, &cfg.httpclients);
+		else if(strcmp(opt, "-d") == 0 || strcmp(opt, "--duration") == 0)
+			ok = getnum(arg, &cfg.duration) && cfg.duration != 0;
+		else if(strcmp(opt, "-b") == 0 || strcmp(opt, "--body") == 0)
+			ok = getnum(arg, &cfg.bodysize) && cfg.bodysize <= 64 * 1024;
+		else if(strcmp(opt, "-s") == 0 || strcmp(opt, "--split") == 0)
+			ok = getnum(arg, &cfg.split);
+		else if(strcmp(opt, "-H") == 0 || strcmp(opt, "--headers") == 0)
+			ok = getnum(arg, &cfg.headers) && cfg.headers <= 64;
+		else if(strcmp(opt, "-i") == 0 || strcmp(opt, "--id") == 0)
+		{
+			ok = getnum(arg, &num);
+			cfg.id = num;
+		}
+		else if(strcmp(opt, "-a") == 0 || strcmp(opt, "--actions") == 0)
+			ok = arg && parse_mix(arg, cfg.actions, &cfg.nactions, 1);
+		else if(strcmp(opt, "-p") == 0 || strcmp(opt, "--paths") == 0)
+			ok = arg && parse_mix(arg, cfg.paths, &cfg.npaths, 0);
+		else
+		{
+			fprintf(stderr, "unknown option: '%s'\n", opt);
+			usage();
+			return 1;
+		}
+		if(!ok)
+		{
+			fprintf(stderr, "bench: invalid argument for %s\n", opt);
+			return 1;
+		}
+		++i;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0x0, sizeof(hints));
+	hints.ai_family = AF_INET; // 3ds only supports IPv4
+	hints.ai_socktype = SOCK_STREAM;
+	int res;
+	if(cfg.httpclients != 0 && (res = getaddrinfo(cfg.addr, HTTP_PORT, &hints, &cfg.httphost)) != 0)
+	{
+		fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(res));
+		return 1;
+	}
+
+	size_t total = cfg.clients + cfg.httpclients;
+	bench_client *clients = calloc(total, sizeof(bench_client));
+	if(!clients) return 1;
+
+	printf("running %lu hLink and %lu HTTP clients against %s for %lu s\n",
+		cfg.clients, cfg.httpclients, cfg.addr, cfg.duration);
+	fflush(stdout);
+
+	double start = now_ms();
+	size_t started = 0;
+	for(; started < total; ++started)
+	{
+		bench_client *c = &clients[started];
+		c->cfg = &cfg;
+		c->kind = started < cfg.clients ? BK_hlink : BK_http;
+		c->seed = started + 1;
+		if(pthread_create(&c->thread, NULL, c->kind == BK_hlink ? hlink_client : http_client, c) != 0)
+		{
+			fprintf(stderr, "bench: failed to start client %zu\n", started);
+			break;
+		}
+	}
+
+	usleep(cfg.duration * 1000000);
+	g_stop = 1;
+	double secs = (now_ms() - start) / 1000.0;
+
+	// blocked clients can't be interrupted, give them a bit of time
+	double deadline = now_ms() + GRACE_MS;
+	for(size_t i = 0; i < started; ++i)
+	{
+		while(!clients[i].done && now_ms() < deadline)
+			usleep(1000);
+		if(clients[i].done)
+			pthread_join(clients[i].thread, NULL);
+	}
+
+	report("hlink", clients, cfg.clients < started ? cfg.clients : started,
+		cfg.actions, cfg.nactions, secs);
+	if(started > cfg.clients)
+		report("http", clients + cfg.clients, started - cfg.clients,
+			cfg.paths, cfg.npaths, secs);
+
+	// stuck clients may still use the stats
+	for(size_t i = 0; i < started; ++i)
+		if(clients[i].done)
+			for(size_t j = 0; j < MAX_ENTRIES; ++j)
+				free(clients[i].stats[j].lat);
+	if(cfg.httphost) freeaddrinfo(cfg.httphost);
+	return 0;
+}
+
@@ -0,0 +1,9 @@
+#ifndef inc_bench_h
+#define inc_bench_h
+
+/* runs a load test against the hLink and HTTP servers of a 3ds,
+ * argv[1] is the address. Returns the exit code */
+int bench(int argc, char *argv[]);
+
+#endif
+
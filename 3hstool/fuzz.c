@@ -0,0 +1,272 @@
+/** Fuzzer for the HTTP server, it sends valid requests with random
+ *   mutations in random pieces and checks that every answer is a
+ *   proper response and that the server keeps serving valid requests
+ */
+
+#include "./fuzz.h"
+
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <time.h>
+
+#define HTTP_PORT "8000"
+#define MAX_REQUEST 8192
+// ms to wait for a response and for more of it
+#define RESPONSE_TIMEOUT 300
+#define IDLE_TIMEOUT 50
+// every this many requests the server has to answer a valid one
+#define CHECK_INTERVAL 50
+
+static const char *corpus[] = {
+	"GET / HTTP/1.1\r\nHost: 3ds\r\n\r\n",
+	"GET /index.html HTTP/1.1\r\nHost: 3ds\r\nUser-Agent: fuzz\r\nAccept-Encoding: gzip, deflate\r\n"
+		"Accept: text/html,*/*;q=0.8\r\nConnection: keep-alive\r\n\r\n",
+	"GET /doc/hlink.html?v=1&a=b HTTP/1.1\r\nIf-None-Match: \"0\", W/\"1\"\r\n\r\n",
+	"GET /index.html HTTP/1.1\r\nRange: bytes=10-99\r\nIf-Range: \"0\"\r\n\r\n",
+	"GET /index.html HTTP/1.1\r\nRange: bytes=-10\r\n\r\n",
+	"GET / HTTP/1.0\nConnection: Keep-Alive\n\n",
+	"GET / HTTP/1.1\r\n\r\nGET /index HTTP/1.1\r\nConnection: close\r\n\r\n",
+	"GET /add-queue?id=0 HTTP/1.1\r\nHost: 3ds\r\n\r\n",
+	"POST / HTTP/1.1\r\nContent-Length: 4\r\n\r\nbody",
+};
+
+typedef struct fuzz_stats
+{
+	unsigned long classes[6]; // by first digit of the status
+	unsigned long silent; // no response, i.e. the request was incomplete
+	unsigned long invalid;
+} fuzz_stats;
+
+static size_t mutate(char *req, size_t len, unsigned *seed)
+{
+	int mutations = rand_r(seed) % 5;
+	for(int i = 0; i < mutations && len != 0; ++i)
+	{
+		size_t at = rand_r(seed) % len;
+		switch(rand_r(seed) % 6)
+		{
+		case 0: // random byte
+			req[at] = rand_r(seed) % 256;
+			break;
+		case 1: // interesting byte
+			req[at] = "\r\n :\t\0\x7F"[rand_r(seed) % 7];
+			break;
+		case 2: // delete
+			memmove(req + at, req + at + 1, len - at - 1);
+			--len;
+			break;
+		case 3: // duplicate a piece
+		{
+			size_t n = rand_r(seed) % (len - at) + 1;
+			if(len + n > MAX_REQUEST) break;
+			memmove(req + at + n, req + at, len - at);
+			len += n;
+			break;
+		}
+		case 4: // long run, header fields that are too large
+		{
+			size_t n = rand_r(seed) % 5000;
+			if(len + n > MAX_REQUEST) break;
+			memmove(req + at + n, req + at, len - at);
+			memset(req + at, 'a' + rand_r(seed) % 26, n);
+			len += n;
+			break;
+		}
+		case 5: // many headers
+		{
+			int count = rand_r(seed) % 80;
+			for(int j = 0; j < count && len + 8 <= MAX_REQUEST; ++j)
+			{
+				memmove(req + at + 8, req + at, len - at);
+				memcpy(req + at, "\r\nX-F: a", 8);
+				len += 8;
+			}
+			break;
+		}
+		}
+	}
+	return len;
+}
+
+static int connect_to(struct addrinfo *host)
+{
+	int sock = socket(host->ai_family, host->ai_socktype, host->ai_protocol);
+	if(sock < 0) return -errno;
+	if(connect(sock, host->ai_addr, host->ai_addrlen) < 0)
+	{ int ret = -errno; close(sock); return ret; }
+	int nodelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	return sock;
+}
+
+// Sends req in random pieces and reads whatever comes back until the
+// server is quiet, returns the amount of bytes read or a negative errno
+static ssize_t exchange(struct addrinfo *host, const char *req, size_t len,
+	char *resp, size_t max, unsigned *seed)
+{
+	int sock = connect_to(host);
+	if(sock < 0) return sock;
+
+	for(size_t sent = 0; sent < len; )
+	{
+		size_t piece = rand_r(seed) % 4 == 0 ? len - sent : (size_t) rand_r(seed) % 64 + 1;
+		if(piece > len - sent) piece = len - sent;
+		ssize_t n = send(sock, req + sent, piece, MSG_NOSIGNAL);
+		// the server may close the connection before the rest is sent
+		if(n < 0) break;
+		sent += n;
+		if(rand_r(seed) % 8 == 0) usleep(1000);
+	}
+
+	size_t got = 0;
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	while(got < max && poll(&pfd, 1, got == 0 ? RESPONSE_TIMEOUT : IDLE_TIMEOUT) > 0)
+	{
+		ssize_t n = recv(sock, resp + got, max - got, 0);
+		if(n <= 0) break;
+		got += n;
+	}
+	close(sock);
+	return got;
+}
+
+// A response has to start with a status line, the rest isn't checked
+static int check_response(const char *resp, size_t len, fuzz_stats *stats)
+{
+	if(len == 0)
+	{
+		++stats->silent;
+		return 0;
+	}
+	int status = 0;
+	if(len < 13 || memcmp(resp, "HTTP/1.1 ", 9) != 0
+		|| sscanf(resp + 9, "%3d", &status) != 1 || status < 100 || status > 599)
+	{
+		++stats->invalid;
+		return -1;
+	}
+	++stats->classes[status / 100];
+	return status;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fuzz [address] [options]\n\n"
+		"Options:\n"
+		"  -n, --requests N  amount of requests to send (default 1000)\n"
+		"  -s, --seed SEED   seed of the mutations (default: time)\n\n"
+		"Every request is a valid request with up to 4 mutations, sent in random pieces.\n"
+		"Exits with 1 if the server sent something that isn't a response or stopped\n"
+		"answering valid requests\n");
+}
+
+int fuzz(int argc, char *argv[])
+{
+	if(argc < 2)
+	{
+		usage();
+		return 1;
+	}
+
+	unsigned long count = 1000;
+	unsigned seed = time(NULL);
+	for(int i = 2; i < argc; ++i)
+	{
+		const char *opt = argv[i];
+		char *end = NULL;
+		unsigned long num = i + 1 < argc ? strtoul(argv[i + 1], &end, 10) : 0;
+		if(end == NULL || end == argv[i + 1] || *end != '\0')
+		{
+			fprintf(stderr, "fuzz: invalid argument for %s\n", opt);
+			return 1;
+		}
+		if(strcmp(opt, "-n") == 0 || strcmp(opt, "--requests") == 0)
+			count = num;
+		else if(strcmp(opt, "-s") == 0 || strcmp(opt, "--seed") == 0)
+			seed = num;
+		else
+		{
+			fprintf(stderr, "unknown option: '%s'\n", opt);
+			usage();
+			return 1;
+		}
+		++i;
+	}
+
+	struct addrinfo hints, *host;
+	memset(&hints, 0x0, sizeof(hints));
+	hints.ai_family = AF_INET; // 3ds only supports IPv4
+	hints.ai_socktype = SOCK_STREAM;
+	int res;
+	if((res = getaddrinfo(argv[1], HTTP_PORT, &hints, &host)) != 0)
+	{
+		fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(res));
+		return 1;
+	}
+
+	char *req = malloc(MAX_REQUEST);
+	char *resp = malloc(64 * 1024);
+	if(!req || !resp) return 1;
+
+	printf("fuzzing %s with %lu requests, seed %u\n", argv[1], count, seed);
+	fflush(stdout);
+
+	fuzz_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	unsigned state = seed;
+	int ret = 0;
+	for(unsigned long i = 1; i <= count; ++i)
+	{
+		const char *base = corpus[rand_r(&state) % (sizeof(corpus) / sizeof(corpus[0]))];
+		size_t len = strlen(base);
+		memcpy(req, base, len);
+		len = mutate(req, len, &state);
+
+		ssize_t got = exchange(host, req, len, resp, 64 * 1024, &state);
+		if(got < 0)
+		{
+			fprintf(stderr, "request %lu: failed to connect: %s\n", i, strerror(-got));
+			ret = 1;
+			break;
+		}
+		if(check_response(resp, got, &stats) < 0)
+		{
+			fprintf(stderr, "request %lu: invalid response to:\n%.*s\n", i, (int) len, req);
+			ret = 1;
+		}
+
+		if(i % CHECK_INTERVAL == 0 || i == count)
+		{
+			const char *valid = corpus[0];
+			got = exchange(host, valid, strlen(valid), resp, 64 * 1024, &state);
+			fuzz_stats ignored;
+			memset(&ignored, 0, sizeof(ignored));
+			if(got <= 0 || check_response(resp, got, &ignored) != 200)
+			{
+				fprintf(stderr, "request %lu: the server stopped answering valid requests\n", i);
+				ret = 1;
+				break;
+			}
+		}
+	}
+
+	printf("2xx: %lu, 3xx: %lu, 4xx: %lu, 5xx: %lu, no response: %lu, invalid: %lu\n",
+		stats.classes[2], stats.classes[3], stats.classes[4], stats.classes[5],
+		stats.silent, stats.invalid);
+	printf("%s\n", ret == 0 ? "ok" : "FAILED");
+
+	free(req);
+	free(resp);
+	freeaddrinfo(host);
+	return ret;
+}
+
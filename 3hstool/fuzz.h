@@ -0,0 +1,9 @@
+#ifndef inc_fuzz_h
+#define inc_fuzz_h
+
+/* sends mutated HTTP requests to the HTTP server of a 3ds and checks
+ * that it keeps answering, argv[1] is the address. Returns the exit code */
+int fuzz(int argc, char *argv[]);
+
+#endif
+
@@ -7,6 +7,10 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
 #include <netdb.h>
@@ -14,19 +18,20 @@
 
 #define MAGIC_LEN 3
 #define MAGIC "HLT"
+#define FRAME_MAGIC "HL2"
 #define PORT "37283"
+#define VERSION 2
+// The largest frame the 3ds accepts
+#define MAX_FRAME_SIZE (64 * 1024)
 
-#if __BYTEORDER__ == __ORDER_LITTLE__
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 // Why do these not exist already?
 static uint64_t htonll(uint64_t n)
 { return __builtin_bswap64(n); }
-
-static uint64_t ntohll(uint64_t n)
-{ return __builtin_bswap64(n); }
 #else
 #define htonll(n) n
-#define ntohll(n) n
 #endif
+#define ntohll htonll
 
 typedef struct iTransactionHeader
 {
@@ -42,6 +47,16 @@ typedef struct iTransactionResponse
 	uint32_t size;
 } __attribute__((__packed__)) iTransactionResponse;
 
+// Used for both requests and responses in version 2
+typedef struct iFrameHeader
+{
+	char magic[MAGIC_LEN];
+	uint8_t type; // enum HAction or enum HResponse
+	uint8_t flags; // HL_FRAME_*
+	uint32_t id;
+	uint32_t size;
+} __attribute__((__packed__)) iFrameHeader;
+
 #define ERROR_MAXLEN 100
 #define ERROR_OFFSET (sizeof("3ds: ")-1)
 static char g_lasterror[ERROR_MAXLEN + 1 + 5 /* "3ds: " */] = "3ds: ";
@@ -54,47 +69,83 @@ static int makesock(hLink *link)
 	if(sock < 0) return -errno;
 
 	if(connect(sock, link->host->ai_addr, link->host->ai_addrlen) < 0)
-	{ close(sock); return -errno; }
+	{ int ret = -errno; close(sock); return ret; }
+
+	// Requests are small and we don't want them to wait for an ACK
+	int nodelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
 	return sock;
 }
 
-static int readresp(iTransactionResponse *resp, int sock)
+static int sendall(int sock, const void *buf, size_t len)
 {
-	ssize_t recvd = recv(sock, resp, sizeof(iTransactionResponse), 0);
-	if(recvd < 0) return -errno;
-	resp->size = ntohll(resp->size);
+	while(len != 0)
+	{
+		ssize_t sent = send(sock, buf, len, MSG_NOSIGNAL);
+		if(sent < 0) return -errno;
+		buf = (const char *) buf + sent;
+		len -= sent;
+	}
 	return HE_success;
 }
 
-static int readcheckresp(iTransactionResponse *resp, int sock)
+static int recvall(int sock, void *buf, size_t len)
 {
-	int ret = readresp(resp, sock);
+	while(len != 0)
+	{
+		ssize_t recvd = recv(sock, buf, len, 0);
+		if(recvd < 0) return -errno;
+		if(recvd == 0) return -ECONNRESET;
+		buf = (char *) buf + recvd;
+		len -= recvd;
+	}
+	return HE_success;
+}
+
+static int readresp(iTransactionResponse *resp, int sock)
+{
+	int ret = recvall(sock, resp, sizeof(iTransactionResponse));
 	if(ret != HE_success) return ret;
+	resp->size = ntohl(resp->size);
+	return HE_success;
+}
 
-	if(resp->resp == HR_untrusted)
+static int checkresp(int sock, uint8_t resp, uint32_t size, const char *body)
+{
+	if(resp == HR_untrusted)
 		return HE_notauthed;
-	if(resp->resp == HR_busy)
+	if(resp == HR_busy)
 		return HE_tryagain;
-	if(resp->resp == HR_error)
+	if(resp == HR_error)
 	{
-		if(resp->size > ERROR_MAXLEN)
+		if(size > ERROR_MAXLEN)
 		{
 			strcpy(g_lasterror, "INTERNAL ERROR: error message from 3ds too long.");
 			return HE_exterror;
 		}
 
-		int amount = recv(sock, g_lasterror + ERROR_OFFSET, ERROR_MAXLEN, 0);
-		g_lasterror[amount + ERROR_OFFSET] = '\0';
+		if(body != NULL)
+			memcpy(g_lasterror + ERROR_OFFSET, body, size);
+		else if(recvall(sock, g_lasterror + ERROR_OFFSET, size) != HE_success)
+			size = 0;
+		g_lasterror[size + ERROR_OFFSET] = '\0';
 
 		return HE_exterror;
 	}
-	if(resp->resp == HR_notfound)
+	if(resp == HR_notfound)
 		return HE_tidnotfound;
 
 	return HE_success;
 }
 
+static int readcheckresp(iTransactionResponse *resp, int sock)
+{
+	int ret = readresp(resp, sock);
+	if(ret != HE_success) return ret;
+	return checkresp(sock, resp->resp, resp->size, NULL);
+}
+
 static int readdiscard(int sock)
 {
 	iTransactionResponse resp;
@@ -133,6 +184,10 @@ const char *hl_geterror(int errcode)
 			return "title id not found on the host 3ds";
 		case HE_exterror:
 			return g_lasterror;
+		case HE_protocol:
+			return "protocol error";
+		case HE_unsupported:
+			return "not supported by the 3ds, try updating 3hs";
 		}
 		return "unknown";
 	}
@@ -152,27 +207,30 @@ int hl_makelink(hLink *link, const char *addr)
 	if(res < 0) { link->host = NULL; return res; }
 
 	link->isauthed = 0;
+	link->version = 1;
+	link->sock = -1;
+	link->lastid = 0;
 	return HE_success;
 }
 
 void hl_destroylink(hLink *link)
 {
+	if(link->sock >= 0)
+		close(link->sock);
 	if(link->host != NULL)
 		freeaddrinfo(link->host);
 }
 
-int hl_auth(hLink *link)
+static int auth_v1(hLink *link)
 {
-	if(link->isauthed) return HE_success;
 	int sock = makesock(link);
 	if(sock < 0) return sock;
 
 	iTransactionHeader header = makeheader(HA_nothing, 0);
-	if(send(sock, &header, sizeof(iTransactionHeader), 0) < 0)
-	{ close(sock); return -errno; }
-
+	int ret = sendall(sock, &header, sizeof(iTransactionHeader));
 	iTransactionResponse resp;
-	int ret = readresp(&resp, sock);
+	if(ret == HE_success)
+		ret = readresp(&resp, sock);
 
 	if(ret == HE_success)
 	{
@@ -180,71 +238,338 @@ int hl_auth(hLink *link)
 			ret = HE_tryagain;
 		else if(resp.resp == HR_untrusted)
 			ret = HE_notauthed;
-		else link->isauthed = 1;
+		else
+		{
+			link->isauthed = 1;
+			link->version = 1;
+		}
 	}
 
 	close(sock);
 	return ret;
 }
 
-int hl_addqueue(hLink *link, uint64_t *ids, size_t amount)
+int hl_auth(hLink *link)
+{
+	if(link->isauthed) return HE_success;
+	int sock = makesock(link);
+	if(sock < 0) return sock;
+
+	// Offer the highest version we speak, servers that
+	// don't know about versions reject the hello action
+	struct {
+		iTransactionHeader header;
+		uint8_t version;
+	} __attribute__((__packed__)) hello;
+	hello.header = makeheader(HA_hello, 1);
+	hello.version = VERSION;
+
+	iTransactionResponse resp;
+	int ret = sendall(sock, &hello, sizeof(hello));
+	if(ret == HE_success)
+		ret = readresp(&resp, sock);
+	if(ret != HE_success)
+	{ close(sock); return ret; }
+
+	if(resp.resp == HR_busy || resp.resp == HR_untrusted)
+	{
+		close(sock);
+		return resp.resp == HR_busy ? HE_tryagain : HE_notauthed;
+	}
+
+	uint8_t version;
+	if(resp.resp == HR_accept && resp.size == 1
+			&& recvall(sock, &version, 1) == HE_success && version >= 2)
+	{
+		link->isauthed = 1;
+		link->version = version;
+		link->sock = sock;
+		return HE_success;
+	}
+
+	close(sock);
+	return auth_v1(link);
+}
+
+uint32_t hl_nextid(hLink *link)
+{
+	return ++link->lastid;
+}
+
+int hl_sendframe(hLink *link, uint32_t id, enum HAction action, int flags, const void *body, uint32_t size)
+{
+	if(link->sock < 0) return HE_notauthed;
+
+	iFrameHeader header;
+	memcpy(header.magic, FRAME_MAGIC, MAGIC_LEN);
+	header.type = action;
+	header.flags = flags;
+	header.id = htonl(id);
+	header.size = htonl(size);
+
+	int ret = sendall(link->sock, &header, sizeof(iFrameHeader));
+	if(ret == HE_success && size != 0)
+		ret = sendall(link->sock, body, size);
+	return ret;
+}
+
+int hl_recvframe(hLink *link, hlFrame *frame)
+{
+	if(link->sock < 0) return HE_notauthed;
+
+	iFrameHeader header;
+	int ret = recvall(link->sock, &header, sizeof(iFrameHeader));
+	if(ret != HE_success) return ret;
+	if(memcmp(header.magic, FRAME_MAGIC, MAGIC_LEN) != 0)
+		return HE_protocol;
+
+	frame->id = ntohl(header.id);
+	frame->type = header.type;
+	frame->flags = header.flags;
+	frame->size = ntohl(header.size);
+	frame->body = NULL;
+
+	if(frame->size != 0)
+	{
+		if(!(frame->body = malloc(frame->size)))
+			return -ENOMEM;
+		if((ret = recvall(link->sock, frame->body, frame->size)) != HE_success)
+		{ hl_freeframe(frame); return ret; }
+	}
+
+	return HE_success;
+}
+
+int hl_checkframe(hlFrame *frame)
+{
+	return checkresp(-1, frame->type, frame->size, frame->body);
+}
+
+void hl_freeframe(hlFrame *frame)
+{
+	free(frame->body);
+	frame->body = NULL;
+}
+
+// If resp isn't NULL it receives the final response, free it with hl_freeframe()
+static int transact_v2(hLink *link, uint8_t action, const void *body, uint32_t size, hlFrame *resp)
+{
+	uint32_t id = hl_nextid(link);
+	int ret = hl_sendframe(link, id, action, 0, body, size);
+	if(ret != HE_success) return ret;
+
+	hlFrame frame;
+	while(1)
+	{
+		if((ret = hl_recvframe(link, &frame)) != HE_success)
+			return ret;
+		if(frame.id == id && !(frame.flags & HL_FRAME_MORE))
+			break;
+		hl_freeframe(&frame);
+	}
+
+	ret = hl_checkframe(&frame);
+	if(ret == HE_success && resp) *resp = frame;
+	else hl_freeframe(&frame);
+	return ret;
+}
+
+static int transact(hLink *link, uint8_t action, const void *body, uint32_t size, hlFrame *resp)
 {
 	if(!link->isauthed) return HE_notauthed;
+
+	if(link->version >= 2)
+	{
+		int ret = transact_v2(link, action, body, size, resp);
+		if(ret != -ECONNRESET && ret != -EPIPE)
+			return ret;
+
+		// The 3ds drops idle connections, reconnect once
+		close(link->sock);
+		link->sock = -1;
+		link->isauthed = 0;
+		if((ret = hl_auth(link)) != HE_success)
+			return ret;
+		return transact(link, action, body, size, resp);
+	}
+
 	int sock = makesock(link);
-	if(sock < 0) return -errno;
+	if(sock < 0) return sock;
+
+	iTransactionHeader header = makeheader(action, size);
+	int ret = sendall(sock, &header, sizeof(iTransactionHeader));
+	if(ret == HE_success && size != 0)
+		ret = sendall(sock, body, size);
+	if(ret == HE_success && resp)
+	{
+		iTransactionResponse tresp;
+		if((ret = readcheckresp(&tresp, sock)) == HE_success)
+		{
+			resp->id = 0;
+			resp->type = tresp.resp;
+			resp->flags = 0;
+			resp->size = tresp.size;
+			resp->body = NULL;
+			if(resp->size != 0 && !(resp->body = malloc(resp->size)))
+				ret = -ENOMEM;
+			else if(resp->size != 0 && (ret = recvall(sock, resp->body, resp->size)) != HE_success)
+				hl_freeframe(resp);
+		}
+	}
+	else if(ret == HE_success)
+		ret = readdiscard(sock);
 
-	iTransactionHeader header = makeheader(HA_add_queue, amount * sizeof(uint64_t));
-	if(send(sock, &header, sizeof(iTransactionHeader), 0) < 0)
-	{ close(sock); return -errno; }
+	close(sock);
+	return ret;
+}
 
+int hl_addqueue(hLink *link, uint64_t *ids, size_t amount)
+{
 	uint64_t *body = malloc(amount * sizeof(uint64_t));
+	if(!body) return -ENOMEM;
 	for(size_t i = 0; i < amount; ++i)
 		body[i] = htonll(ids[i]);
-	ssize_t sent = send(sock, body, amount * sizeof(uint64_t), 0);
+	int ret = transact(link, HA_add_queue, body, amount * sizeof(uint64_t), NULL);
 	free(body);
+	return ret;
+}
 
-	if(sent < 0)
-	{ close(sock); return -errno; }
+int hl_launch(hLink *link, uint64_t tid)
+{
+	uint64_t ntid = htonll(tid);
+	return transact(link, HA_launch, &ntid, sizeof(uint64_t), NULL);
+}
 
-	int ret = readdiscard(sock);
+int hl_sleep(hLink *link)
+{
+	return transact(link, HA_sleep, NULL, 0, NULL);
+}
 
-	close(sock);
-	return ret;
+int hl_nothing(hLink *link)
+{
+	return hl_nothing_body(link, NULL, 0);
 }
 
-int hl_launch(hLink *link, uint64_t tid)
+int hl_nothing_body(hLink *link, const void *body, uint32_t size)
 {
-	if(!link->isauthed) return HE_notauthed;
-	int sock = makesock(link);
-	if(sock < 0) return -errno;
+	return transact(link, HA_nothing, body, size, NULL);
+}
+
+int hl_installids(hLink *link, uint64_t *ids, size_t amount, uint32_t *jobs)
+{
+	uint64_t *body = malloc(amount * sizeof(uint64_t));
+	if(!body) return -ENOMEM;
+	for(size_t i = 0; i < amount; ++i)
+		body[i] = htonll(ids[i]);
 
-	iTransactionHeader header = makeheader(HA_launch, sizeof(uint64_t));
-	if(send(sock, &header, sizeof(iTransactionHeader), 0) < 0)
-	{ close(sock); return -errno; }
+	hlFrame resp;
+	int ret = transact(link, HA_install_id, body, amount * sizeof(uint64_t), &resp);
+	free(body);
+	if(ret != HE_success) return ret;
 
+	if(resp.size != amount * sizeof(uint32_t))
+		ret = HE_protocol;
+	else for(size_t i = 0; i < amount; ++i)
+		jobs[i] = ntohl(((uint32_t *) resp.body)[i]);
+	hl_freeframe(&resp);
+	return ret;
+}
+
+int hl_installurl(hLink *link, uint64_t tid, const char *url, uint32_t *job)
+{
+	size_t len = strlen(url);
+	char *body = malloc(sizeof(uint64_t) + len);
+	if(!body) return -ENOMEM;
 	uint64_t ntid = htonll(tid);
-	if(send(sock, &ntid, sizeof(uint64_t), 0) < 0)
-	{ close(sock); return -errno; }
+	memcpy(body, &ntid, sizeof(uint64_t));
+	memcpy(body + sizeof(uint64_t), url, len);
 
-	int ret = readdiscard(sock);
+	hlFrame resp;
+	int ret = transact(link, HA_install_url, body, sizeof(uint64_t) + len, &resp);
+	free(body);
+	if(ret != HE_success) return ret;
 
-	close(sock);
+	if(resp.size != sizeof(uint32_t))
+		ret = HE_protocol;
+	else *job = ntohl(*(uint32_t *) resp.body);
+	hl_freeframe(&resp);
 	return ret;
 }
 
-int hl_sleep(hLink *link)
+// The 3ds sends these in watch responses
+typedef struct iJobStatus
+{
+	uint32_t id;
+	uint8_t state; // enum HJobState
+	int32_t res;
+	uint64_t done;
+	uint64_t total;
+	uint32_t speed;
+} __attribute__((__packed__)) iJobStatus;
+
+int hl_watch(hLink *link, uint32_t *jobs, size_t amount, hl_watch_func cb, void *userdata)
 {
 	if(!link->isauthed) return HE_notauthed;
-	int sock = makesock(link);
-	if(sock < 0) return -errno;
+	if(link->version < 2) return HE_unsupported;
 
-	iTransactionHeader header = makeheader(HA_sleep, 0);
-	if(send(sock, &header, sizeof(iTransactionHeader), 0) < 0)
-	{ close(sock); return -errno; }
+	uint32_t *body = malloc(amount * sizeof(uint32_t));
+	if(amount != 0 && !body) return -ENOMEM;
+	for(size_t i = 0; i < amount; ++i)
+		body[i] = htonl(jobs[i]);
+
+	uint32_t id = hl_nextid(link);
+	int ret = hl_sendframe(link, id, HA_watch, 0, body, amount * sizeof(uint32_t));
+	free(body);
+	if(ret != HE_success) return ret;
 
-	int ret = readdiscard(sock);
+	hlJobStatus *statuses = NULL;
+	while(1)
+	{
+		hlFrame frame;
+		if((ret = hl_recvframe(link, &frame)) != HE_success)
+			break;
+		if(frame.id != id)
+		{
+			hl_freeframe(&frame);
+			continue;
+		}
 
-	close(sock);
+		int final = !(frame.flags & HL_FRAME_MORE);
+		if((ret = hl_checkframe(&frame)) == HE_success && frame.size % sizeof(iJobStatus) != 0)
+			ret = HE_protocol;
+		if(ret != HE_success)
+		{
+			hl_freeframe(&frame);
+			break;
+		}
+
+		size_t n = frame.size / sizeof(iJobStatus);
+		hlJobStatus *nstatuses = realloc(statuses, (n ? n : 1) * sizeof(hlJobStatus));
+		if(!nstatuses)
+		{
+			hl_freeframe(&frame);
+			ret = -ENOMEM;
+			break;
+		}
+		statuses = nstatuses;
+		for(size_t i = 0; i < n; ++i)
+		{
+			iJobStatus istatus;
+			memcpy(&istatus, frame.body + i * sizeof(iJobStatus), sizeof(iJobStatus));
+			statuses[i].id = ntohl(istatus.id);
+			statuses[i].state = istatus.state;
+			statuses[i].res = (int32_t) ntohl(istatus.res);
+			statuses[i].done = ntohll(istatus.done);
+			statuses[i].total = ntohll(istatus.total);
+			statuses[i].speed = ntohl(istatus.speed);
+		}
+		hl_freeframe(&frame);
+
+		cb(statuses, n, final, userdata);
+		if(final) break;
+	}
+
+	free(statuses);
 	return ret;
 }
 
@@ -253,3 +578,130 @@ void hl_waittimeout(void)
 	usleep(500);
 }
 
+static uint32_t le32(const uint8_t *b)
+{ return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24); }
+
+static uint64_t align64(uint64_t n)
+{ return (n + 63) & ~63ULL; }
+
+// Reads the title id from the TMD of a CIA, returns 0 if it can't be found
+static uint64_t cia_tid(FILE *f)
+{
+	uint8_t header[0x14];
+	uint8_t sigtype[4];
+	uint64_t tid = 0;
+	if(fread(header, sizeof(header), 1, f) != 1)
+		goto out;
+
+	// header size, certificate chain, ticket and then the TMD, all 64 byte aligned
+	off_t tmd = align64(align64(align64(le32(&header[0x00])) + le32(&header[0x08])) + le32(&header[0x0C]));
+	if(fseeko(f, tmd, SEEK_SET) != 0 || fread(sigtype, sizeof(sigtype), 1, f) != 1)
+		goto out;
+
+	off_t sigsize;
+	switch(sigtype[3])
+	{
+	case 0: case 3: sigsize = 0x200 + 0x3C; break; // RSA_4096
+	case 1: case 4: sigsize = 0x100 + 0x3C; break; // RSA_2048
+	case 2: case 5: sigsize = 0x3C + 0x40; break; // ECDSA
+	default: goto out;
+	}
+
+	if(fseeko(f, tmd + 4 + sigsize + 0x4C, SEEK_SET) != 0 || fread(&tid, sizeof(tid), 1, f) != 1)
+		tid = 0;
+	else tid = ntohll(tid);
+
+out:
+	rewind(f);
+	return tid;
+}
+
+// Handles responses to the install with id, returns 1 once the final
+// response arrived or receiving failed, *ret is the result then
+static int install_responses(hLink *link, uint32_t id, int block, uint64_t total,
+	hl_progress_func prog, void *userdata, int *ret)
+{
+	struct pollfd pfd;
+	pfd.fd = link->sock;
+	pfd.events = POLLIN;
+
+	while(block || poll(&pfd, 1, 0) > 0)
+	{
+		hlFrame frame;
+		if((*ret = hl_recvframe(link, &frame)) != HE_success)
+			return 1;
+		if(frame.id != id)
+		{
+			hl_freeframe(&frame);
+			continue;
+		}
+
+		int final = !(frame.flags & HL_FRAME_MORE);
+		*ret = hl_checkframe(&frame);
+		if(*ret == HE_success && prog && frame.size == sizeof(uint64_t))
+		{
+			uint64_t done;
+			memcpy(&done, frame.body, sizeof(done));
+			prog(ntohll(done), total, userdata);
+		}
+		hl_freeframe(&frame);
+		if(final || *ret != HE_success)
+			return 1;
+	}
+
+	return 0;
+}
+
+int hl_installfile(hLink *link, const char *path, hl_progress_func prog, void *userdata)
+{
+	if(!link->isauthed) return HE_notauthed;
+	if(link->version < 2) return HE_unsupported;
+
+	FILE *f = fopen(path, "rb");
+	if(!f) return -errno;
+
+	char *buf = malloc(MAX_FRAME_SIZE);
+	if(!buf) { fclose(f); return -ENOMEM; }
+
+	fseeko(f, 0, SEEK_END);
+	uint64_t size = ftello(f);
+	rewind(f);
+
+	// The first frame announces the size and title id, the data follows
+	// with the same id and the last frame doesn't have the more flag set
+	uint64_t header[2] = { htonll(size), htonll(cia_tid(f)) };
+	uint32_t id = hl_nextid(link);
+	uint64_t sent = 0;
+	int ret = hl_sendframe(link, id, HA_install_data, HL_FRAME_MORE, header, sizeof(header));
+
+	while(ret == HE_success)
+	{
+		size_t len = fread(buf, 1, MAX_FRAME_SIZE, f);
+		if(len == 0 && ferror(f)) { ret = -EIO; break; }
+		sent += len;
+		int last = len == 0 || sent == size;
+
+		if((ret = hl_sendframe(link, id, HA_install_data, last ? 0 : HL_FRAME_MORE, buf, len)) != HE_success)
+		{
+			// the 3ds may have told us why it stopped receiving
+			install_responses(link, id, 1, size, prog, userdata, &ret);
+			break;
+		}
+		if(last)
+		{
+			install_responses(link, id, 1, size, prog, userdata, &ret);
+			break;
+		}
+		if(install_responses(link, id, 0, size, prog, userdata, &ret))
+		{
+			// a final response before we're done means the install failed
+			if(ret == HE_success) ret = HE_protocol;
+			break;
+		}
+	}
+
+	free(buf);
+	fclose(f);
+	return ret;
+}
+
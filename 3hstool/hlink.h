@@ -6,6 +6,7 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <netdb.h>
 
 enum HAction
@@ -17,6 +18,8 @@ enum HAction
 	HA_nothing      = 4,
 	HA_launch       = 5,
 	HA_sleep        = 6,
+	HA_hello        = 7,
+	HA_watch        = 8,
 };
 
 enum HResponse
@@ -36,12 +39,48 @@ enum HError
 	HE_tryagain     = 2, /* try again, caused by the server being busy */
 	HE_tidnotfound  = 3, /* you tried to interact with a title that was not installed */
 	HE_exterror     = 4, /* extended error. an error message from the 3ds */
+	HE_protocol     = 5, /* the 3ds sent something we don't understand */
+	HE_unsupported  = 6, /* the 3ds doesn't support this, try updating 3hs */
 };
 
+enum HJobState
+{
+	HJ_queued       = 0,
+	HJ_running      = 1,
+	HJ_done         = 2,
+	HJ_failed       = 3,
+	HJ_cancelled    = 4,
+};
+
+/* frame flags (protocol version 2) */
+#define HL_FRAME_MORE 1 /* more frames follow for this request id */
+
+typedef struct hlFrame
+{
+	uint32_t id;
+	uint8_t type; /* enum HResponse */
+	uint8_t flags; /* HL_FRAME_* */
+	uint32_t size;
+	char *body; /* free with hl_freeframe() */
+} hlFrame;
+
+typedef struct hlJobStatus
+{
+	uint32_t id;
+	uint8_t state; /* enum HJobState */
+	int32_t res; /* result code of the 3ds if state is HJ_failed */
+	uint64_t done; /* bytes */
+	uint64_t total; /* bytes, 0 if unknown */
+	uint32_t speed; /* bytes per second */
+} hlJobStatus;
+
 typedef struct hLink
 {
 	struct addrinfo *host;
 	int isauthed;
+	int version; /* negotiated protocol version, set by hl_auth() */
+	int sock; /* the connection all version 2 requests share */
+	uint32_t lastid;
 } hLink;
 
 /* connects a link, get an error with hl_makelink_geterror */
@@ -60,9 +99,48 @@ int hl_launch(hLink *link, uint64_t tid);
 int hl_addqueue(hLink *link, uint64_t *ids, size_t amount);
 /* sleeps the 3ds for 5 seconds */
 int hl_sleep(hLink *link);
+/* does nothing, useful to measure the round trip time */
+int hl_nothing(hLink *link);
+/* like hl_nothing() but with a body the 3ds ignores (at most 64 KiB),
+ * useful to measure the throughput */
+int hl_nothing_body(hLink *link, const void *body, uint32_t size);
 /* wait on host for a bit because the 3ds is garbage */
 void hl_waittimeout(void);
 
+/* called with the amount of bytes the 3ds has written */
+typedef void (*hl_progress_func)(uint64_t done, uint64_t total, void *userdata);
+/* streams a CIA to the 3ds and installs it, requires version 2.
+ * prog may be NULL */
+int hl_installfile(hLink *link, const char *path, hl_progress_func prog, void *userdata);
+
+/* installs hshop ids in the background on the 3ds, jobs receives
+ * a job id per id, 0 if the id wasn't found */
+int hl_installids(hLink *link, uint64_t *ids, size_t amount, uint32_t *jobs);
+/* installs the CIA at url in the background on the 3ds, the url must
+ * be reachable from the 3ds */
+int hl_installurl(hLink *link, uint64_t tid, const char *url, uint32_t *job);
+
+/* called with the status of all watched jobs whenever it changes,
+ * final is set on the last call */
+typedef void (*hl_watch_func)(hlJobStatus *jobs, size_t amount, int final, void *userdata);
+/* waits for jobs to finish while reporting their progress, all jobs that
+ * haven't finished yet if amount is 0. Requires version 2 */
+int hl_watch(hLink *link, uint32_t *jobs, size_t amount, hl_watch_func cb, void *userdata);
+
+/* the following are only usable if link->version >= 2, they allow
+ * multiple requests to be in flight at once and streaming bodies */
+
+/* returns a new request id */
+uint32_t hl_nextid(hLink *link);
+/* sends a (part of a) request, set HL_FRAME_MORE in flags if more parts follow */
+int hl_sendframe(hLink *link, uint32_t id, enum HAction action, int flags, const void *body, uint32_t size);
+/* receives the next response frame of any request */
+int hl_recvframe(hLink *link, hlFrame *frame);
+/* converts the response in a frame to an error code */
+int hl_checkframe(hlFrame *frame);
+/* frees memory used by frame */
+void hl_freeframe(hlFrame *frame);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,5 +1,7 @@
 
 #include "./hlink.h"
+#include "./bench.h"
+#include "./fuzz.h"
 #include "./hstx.h"
 
 #include <stdint.h>
@@ -9,6 +11,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 typedef uint64_t u64;
 typedef uint32_t u32;
@@ -41,6 +44,151 @@ static u64 gettid(const char *s)
 		? 0 : ret;
 }
 
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* the server answers requests beyond this with "busy" */
+#define PING_WINDOW 16
+
+static void print_throughput(unsigned long count, unsigned long size, double elapsed)
+{
+	if(size != 0 && elapsed > 0)
+		printf("            %.2f MiB/s of request bodies\n", count * size / 1048576.0 / (elapsed / 1000.0));
+}
+
+static void ping(hLink *link, unsigned long count, unsigned long size)
+{
+	int res;
+	if(count == 0) return;
+
+	char *body = NULL;
+	if(size != 0 && !(body = calloc(size, 1)))
+		return;
+
+	double start = now_ms();
+	for(unsigned long i = 0; i < count; ++i)
+	{
+		if((res = hl_nothing_body(link, body, size)) != 0)
+		{
+			fprintf(stderr, "hl_nothing_body(): %s\n", hl_geterror(res));
+			goto out;
+		}
+	}
+	double elapsed = now_ms() - start;
+	printf("sequential: %lu round trips in %.1f ms, %.3f ms/request (protocol v%d)\n",
+		count, elapsed, elapsed / count, link->version);
+	print_throughput(count, size, elapsed);
+
+	/* only version 2 can have multiple requests in flight */
+	if(link->version < 2) goto out;
+
+	unsigned long sent = 0, recvd = 0;
+	start = now_ms();
+	while(recvd < count)
+	{
+		for(; sent < count && sent - recvd < PING_WINDOW; ++sent)
+		{
+			if((res = hl_sendframe(link, hl_nextid(link), HA_nothing, 0, body, size)) != 0)
+			{
+				fprintf(stderr, "hl_sendframe(): %s\n", hl_geterror(res));
+				goto out;
+			}
+		}
+
+		hlFrame frame;
+		if((res = hl_recvframe(link, &frame)) != 0)
+		{
+			fprintf(stderr, "hl_recvframe(): %s\n", hl_geterror(res));
+			goto out;
+		}
+		res = hl_checkframe(&frame);
+		hl_freeframe(&frame);
+		if(res != 0)
+		{
+			fprintf(stderr, "ping: %s\n", hl_geterror(res));
+			goto out;
+		}
+		++recvd;
+	}
+	elapsed = now_ms() - start;
+	printf("pipelined:  %lu round trips in %.1f ms, %.3f ms/request (%d in flight)\n",
+		count, elapsed, elapsed / count, PING_WINDOW);
+	print_throughput(count, size, elapsed);
+
+out:
+	free(body);
+}
+
+typedef struct install_progress
+{
+	double start;
+	uint64_t done;
+} install_progress;
+
+static void print_progress(uint64_t done, uint64_t total, void *userdata)
+{
+	install_progress *prog = userdata;
+	double secs = (now_ms() - prog->start) / 1000.0;
+	prog->done = done;
+	printf("\rinstalling: %.1f/%.1f MiB (%.2f MiB/s)   ", done / 1048576.0, total / 1048576.0,
+		secs > 0 ? done / 1048576.0 / secs : 0.0);
+	fflush(stdout);
+}
+
+static void install(hLink *link, const char *path)
+{
+	install_progress prog;
+	prog.start = now_ms();
+	prog.done = 0;
+
+	int res = hl_installfile(link, path, print_progress, &prog);
+	if(prog.done != 0) printf("\n");
+	if(res != 0)
+		fprintf(stderr, "hl_installfile(): %s: %s\n", path, hl_geterror(res));
+	else printf("installed %s in %.1f s\n", path, (now_ms() - prog.start) / 1000.0);
+}
+
+static const char *job_state(uint8_t state)
+{
+	switch(state)
+	{
+	case HJ_queued: return "queued";
+	case HJ_running: return "running";
+	case HJ_done: return "done";
+	case HJ_failed: return "failed";
+	case HJ_cancelled: return "cancelled";
+	}
+	return "unknown";
+}
+
+static void print_jobs(hlJobStatus *jobs, size_t amount, int final, void *userdata)
+{
+	(void) userdata;
+	for(size_t i = 0; i < amount; ++i)
+	{
+		// Only the final call has every job, the others only the progress
+		if(jobs[i].state == HJ_running)
+			printf("job %u: %.1f/%.1f MiB (%.2f MiB/s)\n", jobs[i].id, jobs[i].done / 1048576.0,
+				jobs[i].total / 1048576.0, jobs[i].speed / 1048576.0);
+		else if(!final) continue;
+		else if(jobs[i].state == HJ_failed)
+			printf("job %u: failed (%08X)\n", jobs[i].id, (uint32_t) jobs[i].res);
+		else printf("job %u: %s\n", jobs[i].id, job_state(jobs[i].state));
+	}
+	fflush(stdout);
+}
+
+static void watch(hLink *link, uint32_t *jobs, size_t amount)
+{
+	int res = hl_watch(link, jobs, amount, print_jobs, NULL);
+	if(res != 0)
+		fprintf(stderr, "hl_watch(): %s\n", hl_geterror(res));
+}
+
 static int hlink(int argc, char *argv[])
 {
 	if(argc < 2)
@@ -50,6 +198,12 @@ static int hlink(int argc, char *argv[])
 			"  -s, --sleep           sleep the 3ds for 5 seconds\n"
 			"  -a, --add-queue IDs   add IDs to the 3ds queue\n"
 			"  -l, --launch TID      launch TID on the 3ds\n"
+			"  -i, --install FILES   install CIA FILES on the 3ds\n"
+			"  -I, --install-id IDs  install IDs in the background and wait for them\n"
+			"  -u, --install-url TID URL\n"
+			"                        install the CIA at URL in the background and wait for it\n"
+			"  -W, --watch [JOBS]    wait for background installs to finish\n"
+			"  -p, --ping N [BYTES]  measure the latency of N requests with BYTES of body\n"
 			"  -w, --wait MS         wait MS milliseconds\n");
 		return 1;
 	}
@@ -73,15 +227,31 @@ static int hlink(int argc, char *argv[])
 #define TAKEARG() ((++i == argc) ? NULL : (argv[i][0] == '-' ? --i, NULL : argv[i]))
 	for(int i = 2; i < argc; ++i)
 	{
-		hl_waittimeout();
+		/* version 2 keeps a single connection open */
+		if(link.version < 2)
+			hl_waittimeout();
 		if(strcmp(argv[i], "--sleep") == 0)
-			goto opt_sleep;
+		{
+			/* can't jump to the 's' case, it continues the loop over the short options */
+			if((res = hl_sleep(&link)) != 0)
+				fprintf(stderr, "hl_sleep(): %s\n", hl_geterror(res));
+		}
 		else if(strcmp(argv[i], "--wait") == 0)
 			goto opt_wait;
 		else if(strcmp(argv[i], "--add-queue") == 0)
 			goto opt_add_queue;
 		else if(strcmp(argv[i], "--launch") == 0)
 			goto opt_launch;
+		else if(strcmp(argv[i], "--ping") == 0)
+			goto opt_ping;
+		else if(strcmp(argv[i], "--install") == 0)
+			goto opt_install;
+		else if(strcmp(argv[i], "--install-id") == 0)
+			goto opt_install_id;
+		else if(strcmp(argv[i], "--install-url") == 0)
+			goto opt_install_url;
+		else if(strcmp(argv[i], "--watch") == 0)
+			goto opt_watch;
 		else if(strncmp(argv[i], "--", 2) == 0)
 			fprintf(stderr, "unknown option: '%s'\n", argv[i]);
 		else if(argv[i][0] == '-')
@@ -91,7 +261,6 @@ static int hlink(int argc, char *argv[])
 				switch(argv[i][j])
 				{
 				case 's':
-opt_sleep:
 					if((res = hl_sleep(&link)) != 0)
 						fprintf(stderr, "hl_sleep(): %s\n", hl_geterror(res));
 					break;
@@ -132,6 +301,92 @@ opt_launch:
 						fprintf(stderr, "hl_launch(): %s\n", hl_geterror(res));
 					goto break_loop;
 				}
+opt_install:
+				case 'i':
+					while((arg = TAKEARG()))
+						install(&link, arg);
+					goto break_loop;
+opt_install_id:
+				case 'I':
+				{
+					const int maxids = 64;
+					size_t amount = 0;
+					u64 ids[64];
+					u32 jobs[64];
+					while(amount < maxids && (arg = TAKEARG()))
+					{
+						if(get64(arg, &ids[amount]))
+							++amount;
+					}
+					if((res = hl_installids(&link, ids, amount, jobs)) != 0)
+					{
+						fprintf(stderr, "hl_installids(): %s\n", hl_geterror(res));
+						goto break_loop;
+					}
+
+					size_t njobs = 0;
+					for(size_t k = 0; k < amount; ++k)
+					{
+						if(jobs[k] == 0)
+							fprintf(stderr, "install-id: %llu not found\n", (unsigned long long) ids[k]);
+						else
+						{
+							printf("%llu: job %u\n", (unsigned long long) ids[k], jobs[k]);
+							jobs[njobs++] = jobs[k];
+						}
+					}
+					if(njobs != 0 && link.version >= 2)
+						watch(&link, jobs, njobs);
+					goto break_loop;
+				}
+opt_install_url:
+				case 'u':
+				{
+					u64 tid;
+					u32 job;
+					const char *url;
+					if(!(arg = TAKEARG()) || !(url = TAKEARG()))
+						fprintf(stderr, "install-url: expected arguments\n");
+					else if((tid = gettid(arg)) == 0)
+						fprintf(stderr, "install-url: failed to parse title id\n");
+					else if((res = hl_installurl(&link, tid, url, &job)) != 0)
+						fprintf(stderr, "hl_installurl(): %s\n", hl_geterror(res));
+					else
+					{
+						printf("%s: job %u\n", url, job);
+						if(link.version >= 2)
+							watch(&link, &job, 1);
+					}
+					goto break_loop;
+				}
+opt_watch:
+				case 'W':
+				{
+					const int maxjobs = 64;
+					size_t amount = 0;
+					u32 jobs[64];
+					unsigned long job;
+					while(amount < maxjobs && (arg = TAKEARG()))
+					{
+						if(getulong(arg, &job, 10))
+							jobs[amount++] = job;
+					}
+					watch(&link, jobs, amount);
+					goto break_loop;
+				}
+opt_ping:
+				case 'p':
+				{
+					unsigned long count, size = 0;
+					if(!(arg = TAKEARG()))
+						fprintf(stderr, "ping: expected argument\n");
+					else if(!getulong(arg, &count, 10))
+						fprintf(stderr, "ping: failed to parse count\n");
+					else if((arg = TAKEARG()) && !getulong(arg, &size, 10))
+						fprintf(stderr, "ping: failed to parse size\n");
+					else ping(&link, count, size);
+					goto break_loop;
+				}
 				default:
 					fprintf(stderr, "unknown option: '-%c'\n", argv[i][j]);
 					break;
@@ -162,11 +417,15 @@ int main(int argc, char *argv[])
 	if(argc < 2)
 	{
 error:
-		fprintf(stderr, "Usage: %s [hlink | maketheme]\n", argv[0]);
+		fprintf(stderr, "Usage: %s [hlink | bench | fuzz | maketheme]\n", argv[0]);
 		return 1;
 	}
 	if(strcmp(argv[1], "hlink") == 0)
 		return hlink(argc - 1, &argv[1]);
+	if(strcmp(argv[1], "bench") == 0)
+		return bench(argc - 1, &argv[1]);
+	if(strcmp(argv[1], "fuzz") == 0)
+		return fuzz(argc - 1, &argv[1]);
 	if(strcmp(argv[1], "maketheme") == 0)
 		return maketheme(argc - 1, &argv[1]);
 	goto error;
@@ -2256,7 +2256,9 @@ JSON_HEDLEY_DIAGNOSTIC_POP
     #define JSON_CATCH(exception) catch(exception)
     #define JSON_INTERNAL_CATCH(exception) catch(exception)
 #else
-    #include <panic.hh>
+    #if !defined(JSON_THROW_USER)
+        #include <panic.hh>
+    #endif
 // We want to panic() instead of std::abort()
     #define JSON_THROW(exception) panic("Json failure\n" + std::string(exception.what()))
     #define JSON_TRY if(true)
@@ -0,0 +1,107 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef inc_binfile_hh
+#define inc_binfile_hh
+
+/* helpers for the small binary caches 3hs keeps on the SD card,
+ * everything is stored in native (little) endian */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+
+class BinaryReader
+{
+public:
+	BinaryReader(const uint8_t *buf, size_t len)
+		: buf(buf), len(len) { }
+
+	template <typename T>
+	bool read(T& ret)
+	{
+		return this->read(&ret, sizeof(T));
+	}
+
+	bool read(void *ret, size_t size)
+	{
+		if(this->offset + size > this->len) return false;
+		memcpy(ret, &this->buf[this->offset], size);
+		this->offset += size;
+		return true;
+	}
+
+	/* u16 length followed by the data */
+	bool read(std::string& ret)
+	{
+		uint16_t slen;
+		if(!this->read(slen) || this->offset + slen > this->len) return false;
+		ret.assign((const char *) &this->buf[this->offset], slen);
+		this->offset += slen;
+		return true;
+	}
+
+
+private:
+	const uint8_t *buf;
+	size_t len;
+	size_t offset = 0;
+
+
+};
+
+template <typename T>
+static inline void binary_write(std::string& buf, const T& val)
+{ buf.append((const char *) &val, sizeof(T)); }
+
+static inline void binary_write(std::string& buf, const std::string& str)
+{
+	uint16_t len = str.size() > 0xFFFF ? 0xFFFF : str.size();
+	binary_write(buf, len);
+	buf.append(str.data(), len);
+}
+
+/* reads an entire file, returns false if it doesn't exist or is empty */
+static inline bool binary_read_file(const char *path, std::vector<uint8_t>& ret)
+{
+	FILE *f = fopen(path, "r");
+	if(!f) return false;
+	fseek(f, 0, SEEK_END);
+	size_t size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	ret.resize(size);
+	bool ok = size != 0 && fread(ret.data(), size, 1, f) == 1;
+	fclose(f);
+	return ok;
+}
+
+/* a partially written file is removed, better no cache than a truncated one */
+static inline bool binary_write_file(const char *path, const std::string& buf)
+{
+	FILE *f = fopen(path, "w");
+	if(!f) return false;
+	bool ok = fwrite(buf.data(), buf.size(), 1, f) == 1;
+	fclose(f);
+	if(!ok) remove(path);
+	return ok;
+}
+
+#endif
+
@@ -20,6 +20,8 @@
 #include <vector>
 #include <string>
 
+#include "utf16.hh"
+
 
 namespace ctr {
 	enum Destination
@@ -100,6 +102,26 @@ namespace ctr {
 		u8 iconLarge[0x1200]; // 48x48
 	} TitleSMDH;
 
+	/* TitleSMDH with the strings already decoded, this is what the SMDH cache keeps */
+	typedef struct TitleSMDHInfo
+	{
+		typedef struct Title
+		{
+			std::string descShort; // UTF-8
+			std::string descLong; // UTF-8
+			std::string publisher; // UTF-8
+		} Title;
+
+		Title titles[0x10];
+		u32 region; // bitfield of enum RegionLockout
+		u32 flags;
+		u16 titleVersion; // version of the title the SMDH was read from
+
+		// GFX, these are already in the format the GPU wants
+		u8 iconSmall[0x0480]; // 24x24
+		u8 iconLarge[0x1200]; // 48x48
+	} TitleSMDHInfo;
+
 	u64 str_to_tid(const std::string& str);
 	std::string tid_to_str(u64 tid);
 
@@ -107,6 +129,8 @@ namespace ctr {
 	Result get_free_space(Destination media, u64 *size);
 
 	Result get_title_entry(u64 tid, AM_TitleEntry& entry);
+	/* fetches the entries of all tids on media in a single call, ret[i] belongs to tids[i] */
+	Result get_title_entries(FS_MediaType media, const std::vector<u64>& tids, std::vector<AM_TitleEntry>& ret);
 
 	Result delete_if_exist(u64 tid, FS_MediaType media = MEDIATYPE_SD);
 	Result delete_title(u64 tid, FS_MediaType media = MEDIATYPE_SD);
@@ -129,13 +153,51 @@ namespace ctr {
 	static inline FS_MediaType to_mediatype(Destination dest) { return dest == DEST_Sdmc ? MEDIATYPE_SD : MEDIATYPE_NAND; }
 	static inline FS_MediaType mediatype_of(u64 tid) { return to_mediatype(detect_dest(tid)); }
 
+	/* list_titles_on(), title_exists() and get_title_entr{y,ies}() are
+	 * served from an inventory that has to be told about changes */
+	namespace inventory
+	{
+		void installed(u64 tid, FS_MediaType media);
+		void removed(u64 tid, FS_MediaType media);
+		/* forget everything, the next lookup enumerates again */
+		void reset();
+	}
+
 	namespace smdh
 	{
+		typedef struct DecodedString
+		{
+			const char *str; /* not NUL terminated */
+			size_t len;
+		} DecodedString;
+
+		typedef struct DecodedTitle
+		{
+			DecodedString descShort;
+			DecodedString descLong;
+			DecodedString publisher;
+		} DecodedTitle;
+
+		/* size of the arena decode_titles() needs */
+		#define SMDH_DECODE_ARENA_SIZE UTF16_MAX_UTF8(0x10 * (0x40 + 0x80 + 0x40))
+
+		/* decodes the strings of all titles to UTF-8 in one pass without allocating,
+		 * the strings in ret point into arena */
+		void decode_titles(const TitleSMDH& smdh, char *arena, DecodedTitle ret[0x10]);
+		const TitleSMDHInfo::Title *get_native_title(const TitleSMDHInfo& info);
 		TitleSMDHTitle *get_native_title(TitleSMDH *smdh);
-		std::string u16conv(u16 *str, size_t size);
+		std::string u16conv(const u16 *str, size_t size);
+		TitleSMDH *get(u64 tid, FS_MediaType media);
 		TitleSMDH *get(u64 tid);
+		/* like get() but served from a cache kept in memory and on the SD card,
+		 * the filesystem is only touched the first time a title (version) is seen */
+		bool lookup(u64 tid, TitleSMDHInfo& ret);
+		/* removes the cached SMDH of tid, must be called if tid is (re)installed or deleted */
+		void invalidate(u64 tid);
 	}
 
+	/* keeps the network up during sleep and disallows sleep, reference
+	 * counted: every successful lockNDM() needs one unlockNDM() */
 	Result lockNDM();
 	void unlockNDM();
 }
@@ -0,0 +1,116 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef inc_hlink_conn_hh
+#define inc_hlink_conn_hh
+
+#include <arpa/inet.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+
+namespace hlink
+{
+	/* output that is waiting for the socket to become writable: memory,
+	 * shared buffers and files in order. Writes are collected until the
+	 * next flush so a whole response goes out in one send, shared buffers
+	 * and files are sent from where they are instead of being copied */
+	class OutputBuffer
+	{
+	public:
+		~OutputBuffer() { this->clear(); }
+
+		void append(const char *data, size_t len);
+		inline void append(const std::string& data) { this->append(data.data(), data.size()); }
+		/* data stays valid as long as owner lives, small buffers are copied anyway */
+		void append_shared(std::shared_ptr<const void> owner, const char *data, size_t len);
+		/* queues len bytes of fd from offset without reading them first, takes ownership of fd */
+		void append_file(int fd, uint64_t offset, uint64_t len);
+		/* the memory at the end of the output to write into directly, the
+		 * reference is invalidated by the next call to any other function */
+		std::string& tail();
+
+		/* sends as much as possible without blocking, returns
+		 * -1 if sock is broken and otherwise the amount of bytes sent */
+		ssize_t flush(int sock);
+		void clear();
+
+		inline bool empty() const { return this->head == this->segments.size(); }
+		/* unsent bytes */
+		uint64_t size() const;
+
+	private:
+		typedef struct Segment
+		{
+			std::string data; /* owned memory */
+			std::shared_ptr<const void> owner;
+			const char *shared = nullptr; /* shared memory of owner */
+			size_t sharedlen = 0;
+			int file = -1;
+			uint64_t fileoff = 0, fileend = 0;
+
+			inline const char *ptr() const { return this->shared ? this->shared : this->data.data(); }
+			inline size_t len() const { return this->shared ? this->sharedlen : this->data.size(); }
+		} Segment;
+
+		std::vector<Segment> segments;
+		size_t head = 0; /* first segment that isn't sent completely */
+		size_t headoff = 0; /* bytes of the head that are sent */
+		std::string spare; /* memory of a sent segment for the next one */
+
+		Segment& push();
+	};
+
+	/* a client of the hLink server, the server owns the (non-blocking)
+	 * socket and flushes the output whenever the socket is writable */
+	struct Connection
+	{
+		enum kind_type
+		{
+			transaction, http
+		};
+
+		struct sockaddr_in clientaddr;
+		OutputBuffer out; /* pending output */
+		time_t lastActive = 0;
+		kind_type kind;
+		uint32_t id = 0;
+		int fd = -1;
+		size_t inflight = 0; /* requests that haven't been answered yet */
+		bool waiting = false; /* a worker is handling the request, don't read anything */
+		bool closing = false; /* close once all output is sent */
+
+		/* sends as much output as possible without blocking,
+		 * returns false if the connection is broken */
+		bool flush();
+		inline void drop_output() { this->out.clear(); }
+		inline bool has_output() { return !this->out.empty(); }
+		/* the connection may not be closed before a response is sent */
+		inline bool busy() { return this->waiting || this->inflight != 0; }
+	};
+
+	/* makes fd non-blocking, returns false on failure */
+	bool set_nonblocking(int fd, bool nonblocking = true);
+}
+
+#endif
+
@@ -0,0 +1,99 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef inc_hlink_data_install_hh
+#define inc_hlink_data_install_hh
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "thread.hh"
+
+
+namespace hlink
+{
+	/* where streamed install data ends up, AM on the 3ds. All
+	 * functions are called from the writer thread of a DataInstall
+	 * and return a negative value on failure */
+	class InstallSink
+	{
+	public:
+		virtual ~InstallSink() = default;
+
+		virtual int32_t begin(uint64_t size) = 0;
+		virtual int32_t write(uint64_t offset, const void *data, size_t len) = 0;
+		virtual int32_t finish() = 0;
+		virtual void cancel() = 0;
+	};
+
+	/* tid is 0 if the client doesn't know the title id */
+	InstallSink *make_install_sink(uint64_t tid);
+
+	/* Pipes data received by the server into a sink through a bounded
+	 * ring. The server receives straight into the ring (reserve()
+	 * and commit()) and a writer thread drains it, so the data is
+	 * never copied and memory use doesn't depend on the size */
+	class DataInstall
+	{
+	public:
+		static constexpr int32_t err_size = -1; /* received data doesn't match the size */
+		static constexpr int32_t err_cancelled = -2;
+
+		/* takes ownership of sink */
+		DataInstall(InstallSink *sink, uint64_t size);
+		/* cancels the install if it isn't done */
+		~DataInstall();
+
+		/* returns the amount of contiguous free space at *ptr, 0 if the ring is full */
+		size_t reserve(char **ptr);
+		/* marks len bytes from reserve() as filled */
+		void commit(size_t len);
+		/* no more data will follow */
+		void finish();
+		void cancel();
+
+		/* bytes committed so far */
+		inline uint64_t received() { return this->head; }
+		uint64_t written();
+		/* returns true once the writer is done, *res is its result */
+		bool done(int32_t *res);
+
+		const uint64_t size;
+
+
+	private:
+		InstallSink *sink;
+		char *ring;
+		ctr::thread<> *writer;
+		ctr::condvar cv;
+		ctr::mutex mtx;
+
+		/* positions are absolute, the ring index is pos % ring_size */
+		uint64_t head = 0; /* written by the server */
+		uint64_t tail = 0; /* written by the writer */
+		int32_t res = 0;
+		bool finished = false;
+		bool cancelled = false;
+		bool isDone = false;
+
+		void run();
+
+
+	};
+}
+
+#endif
+
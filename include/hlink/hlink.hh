@@ -27,11 +27,36 @@
 namespace hlink
 {
 	constexpr char transaction_magic[] = "HLT";
+	constexpr char frame_magic[] = "HL2";
 	constexpr size_t transaction_magic_len = 3;
-	constexpr int poll_timeout_body = 1000;
-	constexpr int max_timeouts = 3;
+	constexpr uint8_t protocol_version = 2; /* highest version the server speaks */
+	constexpr uint8_t frame_more = 1; /* v2 frame flag: more frames follow for this request */
+	constexpr size_t max_frame_size = 64 * 1024; /* v2 frames, larger bodies are streamed */
+	constexpr size_t max_inflight = 16; /* v2 requests per connection */
+	constexpr size_t body_pool_size = 4; /* body buffers kept for new connections */
+	constexpr size_t file_chunk_size = 32 * 1024; /* per send of a static file without sendfile() */
+	constexpr size_t output_max_iov = 16; /* buffers per send */
+	constexpr size_t output_cork_size = 1024; /* smaller shared buffers are copied into the output */
+	constexpr size_t max_installs = 1; /* concurrent install_data streams */
+	constexpr size_t install_ring_size = 512 * 1024; /* buffered install_data per stream */
+	constexpr size_t install_write_size = 128 * 1024; /* max per write to AM */
+	constexpr uint64_t install_ack_interval = 256 * 1024; /* bytes between progress responses */
+	constexpr int poll_timeout_install = 5; /* ms, used while an install is running */
+	constexpr int watch_interval = 500; /* ms between progress responses of a watch and /events */
+	constexpr size_t events_backlog = 16 * 1024; /* unsent bytes before /events drops events for a client */
+	constexpr int events_heartbeat = 5; /* seconds between /events keep-alive comments */
+	constexpr int poll_timeout_idle = 1000; /* ms */
+	constexpr int poll_timeout_busy = 50; /* ms, used while workers are busy */
+	constexpr int idle_timeout = 10; /* seconds before an inactive client is dropped */
+	constexpr int launch_drain_timeout = 2000; /* ms a launch waits for its response to be sent */
+	constexpr size_t max_clients = 8;
+	constexpr size_t http_max_requests = 100; /* per keep-alive connection */
+	constexpr size_t http_max_headers = 64; /* per request, more are answered with 431 */
+	constexpr size_t http_cache_size = 256 * 1024; /* bytes of templates and status pages kept in memory */
+	constexpr bool http_cache_warmup = true; /* read them into the cache when the server starts */
+	constexpr size_t workers = 2; /* threads for slow actions */
 	constexpr int port = 37283;
-	constexpr int backlog = 2;
+	constexpr int backlog = 4;
 
 	enum class action : uint8_t
 	{
@@ -42,6 +67,8 @@ namespace hlink
 		nothing      = 4,
 		launch       = 5,
 		sleep        = 6,
+		hello        = 7, /* negotiates the protocol version */
+		watch        = 8, /* streams the progress of background installs */
 	};
 
 	enum class response : uint8_t
@@ -17,12 +17,14 @@
 #ifndef inc_hlink_http_hh
 #define inc_hlink_http_hh
 
-#include "util.hh"
+#include "hlink/conn.hh"
 
 #include <arpa/inet.h>
 
 #include <unordered_map>
+#include <memory>
 #include <string>
+#include <vector>
 
 
 namespace hlink
@@ -30,19 +32,70 @@ namespace hlink
 	using HTTPParameters = std::unordered_map<std::string, std::string>;
 	using HTTPHeaders    = std::unordered_map<std::string, std::string>;
 
+	/* a string in the receive buffer of a request, it's valid
+	 * until the next request on the connection is parsed */
+	struct HTTPView
+	{
+		const char *data = nullptr;
+		size_t len = 0;
+
+		inline std::string str() const { return std::string(this->data, this->len); }
+		bool operator == (const char *other) const;
+		/* case insensitive search */
+		bool contains(const char *needle) const;
+	};
+
+	/* the headers of a request, names are always lowercased */
+	class HTTPRequestHeaders
+	{
+	public:
+		/* returns nullptr if the header wasn't sent, the first one if it was sent more than once */
+		const HTTPView *get(const char *name) const;
+		inline bool has(const char *name) const { return this->get(name) != nullptr; }
+		inline size_t size() const { return this->headers.size(); }
+		inline void clear() { this->headers.clear(); }
+		inline void add(HTTPView name, HTTPView value) { this->headers.push_back({ name, value }); }
+
+	private:
+		typedef struct Header
+		{
+			HTTPView name;
+			HTTPView value;
+		} Header;
+		/* there are few enough headers that a linear search is faster than hashing */
+		std::vector<Header> headers;
+	};
+
+	/* a file read through the cache of HTTPServer, the contents never change
+	 * so the buffer is shared by the cache and everything that still uses it */
+	typedef struct CachedFile
+	{
+		std::string data;
+		std::string type; /* Content-Type */
+		std::string length; /* Content-Length */
+	} CachedFile;
+	using CachedFilePtr = std::shared_ptr<const CachedFile>;
+
 	class HTTPServer; /* forward decl */
-	struct HTTPRequestContext
+	struct HTTPRequestContext : public Connection
 	{
 		HTTPServer *server;
-		HTTPHeaders headers; /* headers are always lowercased */
+		HTTPRequestHeaders headers;
 		std::string method; /* method is always lowercased */
-		struct sockaddr_in clientaddr;
 		HTTPParameters params;
 		std::string path;
 		char buf[4096];
-		size_t buflen;
-		bool iseof;
-		int fd;
+		size_t buflen = 0;
+		/* state of HTTPServer::parse_request(), so a request can come in any amount of pieces */
+		int pstate = 0;
+		size_t pscan = 0; /* bytes of buf that were parsed */
+		size_t ptoken = 0; /* start of the token that is being parsed */
+		HTTPView pname; /* name of the header that is being parsed */
+		HTTPView pversion;
+		size_t requests = 0; /* requests received on this connection */
+		bool keepAlive = false; /* keep the connection open after the current response */
+		bool eventStream = false; /* the response is an endless /events stream, input is ignored */
+		bool eventsLagged = false; /* events were dropped because the client fell behind */
 
 		enum serve_type
 		{
@@ -50,21 +103,33 @@ namespace hlink
 		};
 
 		inline bool is_get() { return this->method == "get"; }
-		void serve_file(int status, const std::string& fname, HTTPHeaders headers);
+		/* responses to HEAD have the same headers as to GET, but no body */
+		inline bool is_head() { return this->method == "head"; }
+		/* serves a file with status 200, it's sent straight from the file. The header
+		 * is rendered once per file so headers must be the same every time */
+		void serve_static(const std::string& fname, const HTTPHeaders& headers);
 		void serve_path(int status, const std::string& path, HTTPHeaders headers);
+		/* whether the Range header should be honoured for a file with these validators */
+		bool range_applies(const std::string& etag, const std::string& modified);
 		void respond(int status, const std::string& data, HTTPHeaders headers);
 		void respond_chunked(int status, HTTPHeaders headers);
 		void respond(int status, const HTTPHeaders& headers);
+		/* appends the Connection headers and the end of the header */
+		void end_header(std::string& header);
 		void redirect(const std::string& location);
+		/* an empty chunk ends the response */
 		void send_chunk(const std::string& data);
 		void send(const std::string& data);
 		void serve_plain();
 		serve_type type(); /* NOTE: Sets this->path on success */
-		void close();
+		void close(); /* closes the connection once the response is sent */
+		void finish(); /* ends the current response, closes the connection or waits for the next request */
 
-		void read_path_content(std::string& buf);
+		/* returns nullptr if the file can't be read */
+		CachedFilePtr read_path_content();
 
 		void serve_400();
+		void serve_431();
 		void serve_403();
 		void serve_404(const std::string& fname);
 		void serve_404();
@@ -74,9 +139,15 @@ namespace hlink
 	class HTTPServer
 	{
 	public:
-		/* finds a new fd to make a context with */
-		int make_reqctx(HTTPRequestContext& ctx);
+		/* parses the request in ctx.buf, returns 0 if it is complete, 1 if
+		 * more data is needed, -1 if it is invalid, -2 if it doesn't fit in
+		 * ctx.buf and -3 if the path tries to leave the web root. Every byte is only looked at once, no matter in how many
+		 * pieces the request arrives. The request stays in ctx.buf until the
+		 * next one is parsed, so the headers can point into it */
+		int parse_request(HTTPRequestContext& ctx);
 		int make_fd();
+		/* reads the templates and status pages into the cache */
+		void warm_cache();
 
 		void close();
 
@@ -0,0 +1,111 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef inc_hlink_platform_hh
+#define inc_hlink_platform_hh
+
+/* Everything the hLink server needs from the rest of 3hs, the server
+ * itself only uses this, POSIX sockets and the standard library. On the
+ * 3ds source/hlink/platform.cc forwards to the queue, hShop and the
+ * background installer, off-console it has stub backends instead so
+ * `make host-hlink` can build the server as a normal program */
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+#ifdef __3DS__
+	#include "install.hh"
+#else
+	#include "install_service.hh"
+#endif
+
+#define hlink_panic(msg) hlink::platform::fatal(std::string(__func__) + "@" + std::to_string(__LINE__), msg)
+#define hlink_assert(cond, msg) if(!(cond)) hlink_panic("Assertion failed\n" #cond "\n" msg)
+
+
+namespace hlink
+{
+	namespace platform
+	{
+#ifdef __3DS__
+		using Title = hsapi::FullTitle;
+		using InstallTitle = install::BackgroundTitle;
+#else
+		/* the parts of hsapi::FullTitle the server uses */
+		typedef struct Title
+		{
+			uint64_t id = 0; /* hShop id */
+			uint64_t tid = 0;
+			std::string name;
+		} Title;
+
+		/* like install::BackgroundTitle */
+		typedef struct InstallTitle : public Title
+		{
+			InstallTitle() = default;
+			InstallTitle(const Title& meta)
+				: Title(meta) { }
+
+			std::string url;
+		} InstallTitle;
+#endif
+		using InstallService = install::Service<InstallTitle>;
+
+		/* milliseconds since some fixed point */
+		uint64_t time_ms();
+		/* the address the servers bind to, in network byte order */
+		uint32_t host_address();
+		/* the directory the http server serves from */
+		std::string web_root();
+		/* sends up to len bytes of the file fd from offset over sock, returns
+		 * like send(). Uses sendfile() where possible so nothing is copied */
+		ssize_t send_file(int sock, int fd, uint64_t offset, size_t len);
+		/* sends the buffers of iov over sock with one call, returns like send().
+		 * If more is set more data follows right away, so it may be held back */
+		ssize_t send_vec(int sock, const struct iovec *iov, int count, bool more);
+
+		/* fetches the hShop metadata of id, blocks so it should only be called from a worker */
+		bool title_meta(Title& ret, uint64_t id);
+		/* the install queue, must only be used from the server thread */
+		const std::vector<Title>& queue_get();
+		void queue_add(const Title& meta);
+		/* the background install service, if start is false nullptr
+		 * is returned if the service wasn't started yet */
+		InstallService *installer(bool start = true);
+
+		std::string tid_to_str(uint64_t tid);
+		bool title_exists(uint64_t tid);
+		/* the short name of an installed title in the system language */
+		bool title_name(uint64_t tid, std::string& ret);
+		/* the (translated) message shown if a title to launch isn't installed */
+		std::string title_missing_message(uint64_t tid);
+		/* jumps to tid, only returns if that failed */
+		void launch(uint64_t tid);
+
+		/* panic() on the 3ds, use hlink_panic() and hlink_assert() */
+		[[noreturn]] void fatal(const std::string& caller, const std::string& msg);
+
+		/* lower() from util.hh */
+		void lower(std::string& s);
+	}
+}
+
+#endif
+
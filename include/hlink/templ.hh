@@ -43,7 +43,7 @@ namespace hlink
 	public:
 		~TemplRen();
 
-		inline HTTPHeaders& headers() { return this->hctx.headers; }
+		inline HTTPRequestHeaders& headers() { return this->hctx.headers; }
 
 		void use(const std::string& sym, const std::vector<std::string>& val); /* constant array */
 		void use(const std::string& sym, const std::string& val);              /* constant string */
@@ -26,7 +26,7 @@
 enum class SMDHIconType
 { large, small };
 
-void load_smdh_icon(C2D_Image *ret, const ctr::TitleSMDH& smdh, SMDHIconType type,
+void load_smdh_icon(C2D_Image *ret, const ctr::TitleSMDHInfo& smdh, SMDHIconType type,
 	unsigned int *chosenDimensions = nullptr);
 void load_rgba8(C2D_Image *image, u32 *data, u16 w, u16 h, bool allocStructs = true);
 void rgba_to_abgr(u32 *data, u16 w, u16 h);
@@ -21,6 +21,7 @@
 #include <string>
 #include <3ds.h>
 
+#include "install_service.hh"
 #include "hsapi.hh"
 
 
@@ -60,6 +61,34 @@ namespace install
 		bool reinstallable = false);
 	Result hs_cia(const hsapi::FullTitle& meta, prog_func prog = default_prog_func,
 		bool reinstallable = false);
+	/* installs without touching the UI, prog is called on the calling thread
+	 * and the installation is cancelled once *cancel becomes true */
+	Result hs_cia_headless(const hsapi::FullTitle& meta, prog_func prog, const volatile bool *cancel);
+	/* like hs_cia_headless() but for any url, never reinstalls */
+	Result net_cia_headless(get_url_func get_url, u64 tid, prog_func prog, const volatile bool *cancel);
+
+	/* every title import holds this, including the delete before a reinstall,
+	 * so that foreground installs, background jobs and hLink never use AM at
+	 * the same time. It isn't tied to a thread */
+	void lock_am();
+	bool try_lock_am();
+	void unlock_am();
+
+	/* a title for the background service, titles
+	 * with a url are installed from there instead of hShop */
+	typedef struct BackgroundTitle : public hsapi::FullTitle
+	{
+		BackgroundTitle() = default;
+		BackgroundTitle(const hsapi::FullTitle& meta)
+			: hsapi::FullTitle(meta) { }
+
+		std::string url;
+	} BackgroundTitle;
+
+	using BackgroundService = Service<BackgroundTitle>;
+	/* the service that processes the queue in the background, started on first use,
+	 * if start is false nullptr is returned if the service wasn't started yet */
+	BackgroundService *background(bool start = true);
 }
 
 #endif
@@ -0,0 +1,268 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef inc_install_service_hh
+#define inc_install_service_hh
+
+/* A long-lived worker that installs titles in the background
+ * while the UI keeps running. The service itself is platform
+ * independent; what "installing" means is up to the backend so
+ * it can be driven by a fake backend off-console. */
+
+#include <functional>
+#include <vector>
+
+#include <stdint.h>
+
+#include "thread.hh"
+
+
+namespace install
+{
+	enum class JobState : uint8_t
+	{
+		queued    = 0,
+		running   = 1,
+		done      = 2,
+		failed    = 3,
+		cancelled = 4,
+	};
+
+	template <typename TMeta>
+	class Service
+	{
+	public:
+		typedef struct Job
+		{
+			uint32_t id; /* handle returned by enqueue() */
+			TMeta meta;
+			JobState state;
+			uint64_t done; /* bytes */
+			uint64_t total; /* bytes, 0 if unknown */
+			int32_t res; /* (3ds) Result of the backend */
+		} Job;
+
+		typedef struct Status
+		{
+			std::vector<Job> jobs; /* in order of submission */
+			uint32_t generation; /* changes every time the status changes */
+			bool paused;
+		} Status;
+
+		using prog_type = std::function<void(uint64_t, uint64_t)>;
+		/* installs a title, must return a negative value on failure
+		 * and should return early once *cancel becomes true */
+		using backend_type = std::function<int32_t(const TMeta&, prog_type, const volatile bool *)>;
+
+		Service(backend_type backend)
+			: backend(backend), worker(nullptr) { }
+		~Service() { this->stop(); }
+
+		/* starts the worker thread if it isn't running yet */
+		void start()
+		{
+			if(this->worker != nullptr) return;
+			this->shouldExit = false;
+			this->worker = new ctr::thread<>([this]() -> void { this->run(); });
+		}
+
+		/* cancels the running job and stops the worker thread,
+		 * jobs that are still queued are kept */
+		void stop()
+		{
+			if(this->worker == nullptr) return;
+			this->mtx.lock();
+			this->shouldExit = true;
+			this->cancelRunning = true;
+			this->cv.broadcast();
+			this->mtx.unlock();
+			delete this->worker; /* joins */
+			this->worker = nullptr;
+		}
+
+		/* adds a job, returns its id */
+		uint32_t enqueue(const TMeta& meta)
+		{
+			ctr::lock_guard guard(this->mtx);
+			Job job;
+			job.id = ++this->lastId;
+			job.meta = meta;
+			job.state = JobState::queued;
+			job.done = job.total = 0;
+			job.res = 0;
+			this->jobs.push_back(job);
+			++this->generation;
+			this->cv.broadcast();
+			return job.id;
+		}
+
+		/* cancels a queued or running job, returns false
+		 * if the job doesn't exist or already finished */
+		bool cancel(uint32_t id)
+		{
+			ctr::lock_guard guard(this->mtx);
+			Job *job = this->find(id);
+			if(job == nullptr) return false;
+			if(job->state == JobState::queued)
+			{
+				job->state = JobState::cancelled;
+				++this->generation;
+				return true;
+			}
+			if(job->state == JobState::running)
+			{
+				/* the worker marks it as cancelled once the backend returns */
+				this->cancelRunning = true;
+				return true;
+			}
+			return false;
+		}
+
+		/* cancels all jobs that didn't finish yet */
+		void cancel_all()
+		{
+			ctr::lock_guard guard(this->mtx);
+			for(Job& job : this->jobs)
+				if(job.state == JobState::queued)
+					job.state = JobState::cancelled;
+			this->cancelRunning = true;
+			++this->generation;
+		}
+
+		/* a paused service finishes the running job but won't start new ones */
+		void pause(bool paused)
+		{
+			ctr::lock_guard guard(this->mtx);
+			this->paused = paused;
+			++this->generation;
+			this->cv.broadcast();
+		}
+
+		/* removes all jobs that are done, failed or cancelled */
+		void clear_finished()
+		{
+			ctr::lock_guard guard(this->mtx);
+			std::vector<Job> njobs;
+			for(Job& job : this->jobs)
+				if(job.state == JobState::queued || job.state == JobState::running)
+					njobs.push_back(job);
+			this->jobs.swap(njobs);
+			++this->generation;
+		}
+
+		/* copies the current state, only copies the jobs
+		 * if the generation differs from ret.generation */
+		void snapshot(Status& ret)
+		{
+			ctr::lock_guard guard(this->mtx);
+			ret.paused = this->paused;
+			if(ret.generation == this->generation && ret.jobs.size() != 0)
+				return;
+			ret.generation = this->generation;
+			ret.jobs = this->jobs;
+		}
+
+		/* returns if there are no jobs left to process */
+		bool idle()
+		{
+			ctr::lock_guard guard(this->mtx);
+			for(Job& job : this->jobs)
+				if(job.state == JobState::queued || job.state == JobState::running)
+					return false;
+			return true;
+		}
+
+		uint32_t get_generation()
+		{
+			ctr::lock_guard guard(this->mtx);
+			return this->generation;
+		}
+
+
+	private:
+		backend_type backend;
+		ctr::thread<> *worker;
+		ctr::condvar cv;
+		ctr::mutex mtx;
+
+		std::vector<Job> jobs;
+		uint32_t generation = 1;
+		uint32_t lastId = 0;
+		volatile bool cancelRunning = false;
+		bool shouldExit = false;
+		bool paused = false;
+
+		/* mtx must be locked */
+		Job *find(uint32_t id)
+		{
+			for(Job& job : this->jobs)
+				if(job.id == id) return &job;
+			return nullptr;
+		}
+
+		/* mtx must be locked */
+		Job *next_queued()
+		{
+			for(Job& job : this->jobs)
+				if(job.state == JobState::queued) return &job;
+			return nullptr;
+		}
+
+		void run()
+		{
+			this->mtx.lock();
+			while(true)
+			{
+				Job *job = nullptr;
+				while(!this->shouldExit && (this->paused || (job = this->next_queued()) == nullptr))
+					this->cv.wait(this->mtx);
+				if(this->shouldExit) break;
+
+				/* the job may move in memory once we unlock so we
+				 * only keep the id around */
+				uint32_t id = job->id;
+				TMeta meta = job->meta;
+				job->state = JobState::running;
+				this->cancelRunning = false;
+				++this->generation;
+				this->mtx.unlock();
+
+				int32_t res = this->backend(meta, [this, id](uint64_t done, uint64_t total) -> void {
+					ctr::lock_guard guard(this->mtx);
+					Job *job = this->find(id);
+					if(job == nullptr) return;
+					job->done = done;
+					job->total = total;
+					++this->generation;
+				}, &this->cancelRunning);
+
+				this->mtx.lock();
+				if((job = this->find(id)) != nullptr)
+				{
+					job->res = res;
+					job->state = res >= 0 ? JobState::done
+						: this->cancelRunning ? JobState::cancelled : JobState::failed;
+				}
+				++this->generation;
+			}
+			this->mtx.unlock();
+		}
+
+
+	};
+}
+
+#endif
@@ -0,0 +1,63 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef inc_library_hh
+#define inc_library_hh
+
+/* A database of the installed titles with their names and icons,
+ * kept up-to-date by a low priority scanner so listings don't have
+ * to go through AM and the ExeFS of every title themselves. */
+
+#include <3ds.h>
+
+#include <string>
+#include <vector>
+
+
+namespace library
+{
+	typedef struct Title
+	{
+		std::string name; /* UTF-8, native language, "" if the title has no SMDH */
+		std::string publisher; /* UTF-8, native language */
+		u64 tid;
+		u32 region; /* bitfield of ctr::RegionLockout */
+		u16 version;
+		u8 media; /* FS_MediaType */
+		bool hasSMDH;
+		u8 icon[0x480]; /* small SMDH icon (24x24) */
+	} Title;
+
+	typedef struct Snapshot
+	{
+		std::vector<Title> titles;
+		u32 generation = 0; /* changes every time the database changes */
+		bool scanning;
+	} Snapshot;
+
+	/* loads the database from the SD card and starts the scanner */
+	void start();
+	void stop();
+	/* asks the scanner to pick up changes in the installed titles,
+	 * only new and changed titles have their SMDH read again */
+	void rescan();
+	/* copies the database, only copies the titles
+	 * if the generation differs from ret.generation */
+	void snapshot(Snapshot& ret);
+}
+
+#endif
+
@@ -0,0 +1,252 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef inc_missing_hh
+#define inc_missing_hh
+
+/* The platform independent part of find-missing: which updates and DLC of
+ * installed titles aren't installed yet or are newer than the installed
+ * version. Everything that talks to AM or hShop is passed in so the
+ * whole pass can be benchmarked off-console, see test/find_missing.cc */
+
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+
+namespace missing
+{
+	constexpr size_t media_count = 3;
+
+	inline uint16_t tid_cat(uint64_t tid) { return (tid >> 32) & 0xFFFF; }
+	inline uint32_t tid_unique(uint64_t tid) { return (tid >> 8) & 0xFFFFFF; }
+	inline bool can_have_missing(uint64_t tid)
+	{
+		uint16_t category = tid_cat(tid);
+		return category == 0x0000 /* normal */ || category == 0x0010 /* system title */ || category == 0x8000 /* DSiWare/TWL */;
+	}
+
+	/* installed versions of all tids on media in one call, ret[i] belongs
+	 * to tids[i], must return a negative value on failure */
+	using batch_func = std::function<int32_t(size_t media, const std::vector<uint64_t>& tids, std::vector<uint16_t>& ret)>;
+	/* installed version of a single tid, must return a negative value on failure */
+	using single_func = std::function<int32_t(size_t media, uint64_t tid, uint16_t& ret)>;
+
+	/* puts the titles in titles whose installed version on media is lower
+	 * than title->version in ret. TTitle must have tid and version members */
+	template <typename TTitle>
+	void filter_outdated(size_t media, const std::vector<const TTitle *>& titles, std::vector<const TTitle *>& ret, batch_func batch, single_func single)
+	{
+		if(titles.size() == 0) return;
+
+		std::vector<uint64_t> tids;
+		tids.reserve(titles.size());
+		for(const TTitle *title : titles)
+			tids.push_back(title->tid);
+
+		std::vector<uint16_t> versions;
+		if(batch(media, tids, versions) < 0)
+		{
+			/* one bad title fails the entire batch, so we retry them one by one */
+			for(const TTitle *title : titles)
+			{
+				uint16_t version;
+				if(single(media, title->tid, version) >= 0 && title->version > version)
+					ret.push_back(title);
+			}
+			return;
+		}
+
+		for(size_t i = 0; i < titles.size(); ++i)
+			/* installed version is lower than version on server */
+			if(titles[i]->version > versions[i])
+				ret.push_back(titles[i]);
+	}
+
+	/* related content per title id, only asks hShop for titles that aren't
+	 * cached yet, that were cached too long ago or of which the installed
+	 * version changed. TRelated is default constructible and movable */
+	template <typename TRelated>
+	class RelatedCache
+	{
+	public:
+		typedef struct Entry
+		{
+			TRelated related;
+			time_t fetched;
+			uint16_t version; /* installed version of the title when fetched */
+		} Entry;
+
+		using map_type = std::unordered_map<uint64_t, TRelated>;
+		/* fetches the related content of tids, titles without any may be left out */
+		using fetch_func = std::function<int32_t(map_type& ret, const std::vector<uint64_t>& tids)>;
+
+		RelatedCache(time_t ttl) : ttl(ttl) { }
+
+		/* puts the related content of tids in ret, versions[i] belongs to tids[i] (0 if
+		 * unknown). *fetched is set to the amount of titles asked from hShop */
+		int32_t get(map_type& ret, const std::vector<uint64_t>& tids, const std::vector<uint16_t>& versions,
+			time_t now, fetch_func fetch, size_t *fetched)
+		{
+			std::vector<uint64_t> query;
+			std::vector<uint16_t> queryVersions;
+			for(size_t i = 0; i < tids.size(); ++i)
+			{
+				typename std::unordered_map<uint64_t, Entry>::iterator it = this->entries.find(tids[i]);
+				if(it == this->entries.end() || it->second.version != versions[i]
+						|| now < it->second.fetched || now - it->second.fetched > this->ttl)
+				{
+					query.push_back(tids[i]);
+					queryVersions.push_back(versions[i]);
+				}
+				else ret[tids[i]] = it->second.related;
+			}
+
+			*fetched = query.size();
+			if(query.size() == 0) return 0;
+
+			map_type fresh;
+			int32_t res;
+			if((res = fetch(fresh, query)) < 0)
+				return res;
+
+			for(size_t i = 0; i < query.size(); ++i)
+			{
+				/* titles without any related content are not in the
+				 * response, but that is worth caching as well */
+				Entry& entry = this->entries[query[i]];
+				entry.related = std::move(fresh[query[i]]);
+				entry.version = queryVersions[i];
+				entry.fetched = now;
+				ret[query[i]] = entry.related;
+			}
+			return res;
+		}
+
+		std::unordered_map<uint64_t, Entry> entries;
+
+
+	private:
+		time_t ttl;
+
+
+	};
+
+	/* what find() needs from AM and hShop */
+	template <typename TTitle, typename TRelated>
+	struct Backend
+	{
+		batch_func versions;
+		single_func version;
+		/* related content of tids, versions[i] is the installed version of tids[i] or 0 */
+		std::function<int32_t(std::unordered_map<uint64_t, TRelated>& ret, const std::vector<uint64_t>& tids,
+			const std::vector<uint16_t>& versions)> related;
+		/* titles that must not be returned, i.e. ones that are already queued */
+		std::function<bool(const TTitle&)> skip;
+	};
+
+	/* installed[i] are the title ids installed on media i. Puts the updates and DLC of
+	 * target (of all installed titles if it is 0) that aren't installed or are newer
+	 * than the installed version in ret, those point into related. TRelated has
+	 * updates and dlc vectors of TTitle, TTitle has tid and version members */
+	template <typename TTitle, typename TRelated>
+	int32_t find(const std::vector<uint64_t> (&installed)[media_count], uint64_t target, const Backend<TTitle, TRelated>& be,
+		std::unordered_map<uint64_t, TRelated>& related, std::vector<const TTitle *>& ret)
+	{
+		/* tid => index in installed it's installed on */
+		std::unordered_map<uint64_t, size_t> media;
+		size_t total = 0;
+		for(size_t i = 0; i < media_count; ++i)
+			total += installed[i].size();
+		media.reserve(total);
+		for(size_t i = 0; i < media_count; ++i)
+			for(uint64_t tid : installed[i])
+				media.emplace(tid, i);
+
+		std::vector<uint64_t> games;
+		/* deduplicate based on unique id */
+		std::unordered_set<uint32_t> dedupe;
+		auto maybe_add = [&games, &dedupe](uint64_t gtid) -> void {
+			if(can_have_missing(gtid) && dedupe.insert(tid_unique(gtid)).second)
+				games.push_back(gtid);
+		};
+		if(target == 0)
+		{
+			games.reserve(total);
+			for(size_t i = 0; i < media_count; ++i)
+				for(uint64_t tid : installed[i])
+					maybe_add(tid);
+		}
+		else maybe_add(target);
+
+		/* the installed versions decide if a cached entry is still usable */
+		std::vector<uint16_t> versions(games.size(), 0);
+		std::vector<size_t> perMedia[media_count]; /* indices in games */
+		for(size_t i = 0; i < games.size(); ++i)
+		{
+			std::unordered_map<uint64_t, size_t>::iterator it = media.find(games[i]);
+			if(it != media.end()) perMedia[it->second].push_back(i);
+		}
+		for(size_t i = 0; i < media_count; ++i)
+		{
+			if(perMedia[i].size() == 0) continue;
+			std::vector<uint64_t> mtids;
+			std::vector<uint16_t> mversions;
+			mtids.reserve(perMedia[i].size());
+			for(size_t j : perMedia[i])
+				mtids.push_back(games[j]);
+			if(be.versions(i, mtids, mversions) >= 0)
+				for(size_t j = 0; j < perMedia[i].size(); ++j)
+					versions[perMedia[i][j]] = mversions[j];
+		}
+
+		int32_t res;
+		if((res = be.related(related, games, versions)) < 0)
+			return res;
+
+		std::vector<const TTitle *> checkVersion[media_count];
+		auto check = [&media, &ret, &checkVersion, &be](const TTitle& title) -> void {
+			/* don't import demo's */
+			if(tid_cat(title.tid) == 0x2 || be.skip(title))
+				return;
+			std::unordered_map<uint64_t, size_t>::iterator it = media.find(title.tid);
+			/* not installed */
+			if(it == media.end())
+				ret.push_back(&title);
+			else checkVersion[it->second].push_back(&title);
+		};
+
+		for(uint64_t game : games)
+		{
+			typename std::unordered_map<uint64_t, TRelated>::iterator rel = related.find(game);
+			if(rel == related.end()) continue;
+			for(const TTitle& title : rel->second.updates) check(title);
+			for(const TTitle& title : rel->second.dlc) check(title);
+		}
+
+		/* one AM call per media type instead of one per title */
+		for(size_t i = 0; i < media_count; ++i)
+			filter_outdated(i, checkVersion[i], ret, be.versions, be.version);
+		return 0;
+	}
+}
+
+#endif
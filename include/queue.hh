@@ -22,14 +22,44 @@
 
 #include "hsapi.hh"
 
-std::vector<hsapi::FullTitle>& queue_get();
+/* NOTE: the queue is indexed by hShop id and title id,
+ *       don't modify the vector directly but use the queue_*() functions.
+ *       A title in the queue is referred to by its hShop id, which is
+ *       unique in the queue and doesn't change when others are removed */
+const std::vector<hsapi::FullTitle>& queue_get();
+/* returns nullptr if id isn't queued, the pointer is
+ * valid until the queue is modified */
+const hsapi::FullTitle *queue_find(hsapi::hid id);
 
-void queue_add(hsapi::hid id, bool disp = true);
-void queue_add(const hsapi::FullTitle& meta);
-void queue_process(size_t index);
-void queue_remove(size_t index);
-void queue_add(hsapi::hid id);
+bool queue_contains_tid(hsapi::htid tid);
+bool queue_contains(hsapi::hid id);
+
+/* returns false if the title was already queued or fetching it failed */
+bool queue_add(hsapi::hid id, bool disp = true);
+bool queue_add(const hsapi::FullTitle& meta);
+void queue_process(hsapi::hid id);
+
+typedef struct QueuePlan
+{
+	struct Rejected
+	{
+		hsapi::hid id;
+		Result res;
+	};
+	std::vector<hsapi::hid> order; /* queued titles in the order they should be installed */
+	std::vector<Rejected> rejected; /* titles that can't be installed */
+	u64 needed[3]; /* indexed by ctr::Destination */
+	u64 free[3]; /* indexed by ctr::Destination */
+} QueuePlan;
+
+/* orders the queue base -> update -> DLC and checks
+ * the total size per medium against the free space */
+void queue_plan(QueuePlan& plan);
+void queue_remove(hsapi::hid id);
+/* hands the queue to the background install service */
 void queue_process_all();
+/* handles the results of the background service once it's done */
+void queue_finish_background();
 void queue_clear();
 void show_queue();
 
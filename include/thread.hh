@@ -18,12 +18,24 @@
 #define inc_thread_hh
 
 #include <functional>
-#include <3ds.h>
-#include "panic.hh"
+
+#ifdef __3DS__
+	#include <3ds.h>
+	#include "panic.hh"
+#else
+	/* host builds (i.e. linux) use the standard library,
+	 * this makes it possible to run the platform independent
+	 * parts of 3hs off-console */
+	#include <condition_variable>
+	#include <atomic>
+	#include <thread>
+	#include <mutex>
+#endif
 
 
 namespace ctr
 {
+#ifdef __3DS__
 	template <typename ... Ts>
 	class thread
 	{
@@ -38,7 +50,8 @@ namespace ctr
 		thread(std::function<void(Ts...)> cb, Ts& ... args)
 		{
 			ThreadFuncParams *params = new ThreadFuncParams;
-			params->func = [&]() -> void { cb(args...); };
+			/* cb must be copied, the thread may outlive this constructor */
+			params->func = [cb, &args...]() -> void { cb(args...); };
 			params->self = this;
 
 			s32 prio = 0;
@@ -89,6 +102,114 @@ namespace ctr
 		bool isFinished;
 
 
+	};
+
+	class mutex
+	{
+	public:
+		mutex() { LightLock_Init(&this->lck); }
+
+		void lock() { LightLock_Lock(&this->lck); }
+		void unlock() { LightLock_Unlock(&this->lck); }
+
+		friend class condvar;
+
+
+	private:
+		LightLock lck;
+
+
+	};
+
+	class condvar
+	{
+	public:
+		condvar() { CondVar_Init(&this->cv); }
+
+		/* mtx must be locked */
+		void wait(mutex& mtx) { CondVar_Wait(&this->cv, &mtx.lck); }
+		void signal() { CondVar_Signal(&this->cv); }
+		void broadcast() { CondVar_Broadcast(&this->cv); }
+
+
+	private:
+		CondVar cv;
+
+
+	};
+#else
+	template <typename ... Ts>
+	class thread
+	{
+	public:
+		/* create a new thread */
+		thread(std::function<void(Ts...)> cb, Ts& ... args)
+			: isFinished(false), th([this, cb, &args...]() -> void { cb(args...); this->isFinished = true; }) { }
+
+		~thread() { this->join(); }
+
+		/* wait for the thread to finish */
+		void join()
+		{
+			if(this->th.joinable())
+				this->th.join();
+		}
+
+		/* returns if the thread is done */
+		bool finished()
+		{
+			return this->isFinished;
+		}
+
+
+	private:
+		std::atomic<bool> isFinished; /* must be set up before th starts */
+		std::thread th;
+
+
+	};
+
+	class mutex
+	{
+	public:
+		void lock() { this->mtx.lock(); }
+		void unlock() { this->mtx.unlock(); }
+
+
+	private:
+		std::mutex mtx;
+
+
+	};
+
+	class condvar
+	{
+	public:
+		/* mtx must be locked */
+		void wait(mutex& mtx) { this->cv.wait(mtx); }
+		void signal() { this->cv.notify_one(); }
+		void broadcast() { this->cv.notify_all(); }
+
+
+	private:
+		std::condition_variable_any cv;
+
+
+	};
+#endif
+
+	/* locks a mutex for the lifetime of this object */
+	class lock_guard
+	{
+	public:
+		lock_guard(mutex& mtx) : mtx(mtx) { this->mtx.lock(); }
+		~lock_guard() { this->mtx.unlock(); }
+
+
+	private:
+		mutex& mtx;
+
+
 	};
 
 	template <typename ... Ts>
@@ -125,4 +246,3 @@ namespace ctr
 }
 
 #endif
-
@@ -28,7 +28,7 @@ namespace ui
 	class SMDHIcon : public ui::BaseWidget
 	{ UI_WIDGET("SMDHIcon")
 	public:
-		void setup(ctr::TitleSMDH *smdh, SMDHIconType type = SMDHIconType::large);
+		void setup(const ctr::TitleSMDHInfo *smdh, SMDHIconType type = SMDHIconType::large);
 		void setup(u64 tid, SMDHIconType type = SMDHIconType::large);
 		void destroy() override;
 
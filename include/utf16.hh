@@ -0,0 +1,94 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef inc_utf16_hh
+#define inc_utf16_hh
+
+/* UTF-16 to UTF-8 conversion without allocations, platform
+ * independent so it can be used off-console as well */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* a single UTF-16 unit never becomes more than 3 UTF-8 bytes,
+ * a surrogate pair (2 units) becomes 4 */
+#define UTF16_MAX_UTF8(units) ((units) * 3)
+
+
+/* UTF-8 length of a UTF-16 unit above 0x7F by its top 5 bits,
+ * 0 for surrogates (0xD800-0xDFFF) which need a closer look */
+static const uint8_t utf16_utf8_len[32] = {
+	2, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 3, 3, 3, 3,
+};
+
+/* converts at most len units of str (stopping at the first NUL) to UTF-8,
+ * out must be able to hold UTF16_MAX_UTF8(len) bytes. Unpaired surrogates
+ * are replaced by U+FFFD. Returns the amount of bytes written, out is not
+ * NUL terminated */
+static inline size_t utf16_to_utf8_n(char *out, const uint16_t *str, size_t len)
+{
+	char *begin = out;
+	size_t i = 0;
+	while(i < len)
+	{
+		uint32_t cp = str[i++];
+		/* fast path, SMDH strings are mostly ASCII and otherwise mostly BMP */
+		if(cp < 0x80)
+		{
+			if(cp == 0) break;
+			*out++ = cp;
+			continue;
+		}
+		switch(utf16_utf8_len[cp >> 11])
+		{
+		case 2:
+			out[0] = 0xC0 | (cp >> 6);
+			out[1] = 0x80 | (cp & 0x3F);
+			out += 2;
+			continue;
+		case 3:
+			out[0] = 0xE0 | (cp >> 12);
+			out[1] = 0x80 | ((cp >> 6) & 0x3F);
+			out[2] = 0x80 | (cp & 0x3F);
+			out += 3;
+			continue;
+		}
+
+		/* high surrogate followed by a low one */
+		if(cp <= 0xDBFF && i < len && str[i] >= 0xDC00 && str[i] <= 0xDFFF)
+		{
+			cp = 0x10000 + ((cp - 0xD800) << 10) + (str[i++] - 0xDC00);
+			out[0] = 0xF0 | (cp >> 18);
+			out[1] = 0x80 | ((cp >> 12) & 0x3F);
+			out[2] = 0x80 | ((cp >> 6) & 0x3F);
+			out[3] = 0x80 | (cp & 0x3F);
+			out += 4;
+		}
+		else
+		{
+			/* U+FFFD */
+			out[0] = (char) 0xEF;
+			out[1] = (char) 0xBF;
+			out[2] = (char) 0xBD;
+			out += 3;
+		}
+	}
+	return out - begin;
+}
+
+#endif
+
@@ -74,6 +74,31 @@ namespace ui
 		u8 level = 0;
 
 
+	};
+
+	/* shows the progress of the background install service */
+	class InstallIndicator : public ui::BaseWidget
+	{ UI_WIDGET("InstallIndicator")
+	public:
+		void setup();
+		bool render(const ui::Keys& keys) override;
+		float height() override { return 0.0f; }
+		float width() override { return 0.0f; }
+		void update();
+
+		/* returns true once after a background batch finished, the caller
+		 * should then run queue_finish_background() outside of a render */
+		static bool batch_finished();
+
+
+	private:
+		ui::ScopedWidget<ui::Text> text;
+		u32 generation;
+		bool wasBusy;
+
+		static bool batchFinished;
+
+
 	};
 
 	class NetIndicator : public ui::BaseWidget
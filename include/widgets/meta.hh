@@ -18,6 +18,7 @@
 #define inc_ui_meta_hh
 
 #include <ui/base.hh>
+#include "library.hh"
 #include "hsapi.hh"
 
 
@@ -84,6 +85,27 @@ namespace ui
 		ui::RenderQueue queue;
 
 
+	};
+
+	class InstalledMeta : public ui::BaseWidget
+	{ UI_WIDGET("InstalledMeta")
+	public:
+		void setup(const library::Title& title);
+
+		void set_title(const library::Title& title);
+
+		float get_x() override;
+		float get_y() override;
+
+		bool render(const ui::Keys& keys) override;
+		float height() override;
+		float width() override;
+
+
+	private:
+		ui::RenderQueue queue;
+
+
 	};
 }
 
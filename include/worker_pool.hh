@@ -0,0 +1,126 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef inc_worker_pool_hh
+#define inc_worker_pool_hh
+
+/* A fixed set of threads that run slow jobs (network requests, etc.)
+ * for a thread that shouldn't block, e.g. an event loop. A job returns
+ * a continuation that is run on the thread that calls collect(), so the
+ * owner never has to share its state with the workers. */
+
+#include <functional>
+#include <vector>
+#include <deque>
+
+#include <stddef.h>
+
+#include "thread.hh"
+
+
+namespace ctr
+{
+	class WorkerPool
+	{
+	public:
+		using done_type = std::function<void()>;
+		using job_type = std::function<done_type()>;
+
+		WorkerPool(size_t threads)
+		{
+			for(size_t i = 0; i < threads; ++i)
+				this->workers.push_back(new ctr::thread<>([this]() -> void { this->run(); }));
+		}
+
+		/* waits for the running jobs to finish, queued jobs and
+		 * continuations that weren't collected are dropped */
+		~WorkerPool()
+		{
+			this->mtx.lock();
+			this->shouldExit = true;
+			this->cv.broadcast();
+			this->mtx.unlock();
+			for(ctr::thread<> *worker : this->workers)
+				delete worker; /* joins */
+		}
+
+		void submit(job_type job)
+		{
+			ctr::lock_guard guard(this->mtx);
+			this->jobs.push_back(job);
+			++this->unfinished;
+			this->cv.signal();
+		}
+
+		/* runs the continuations of all finished jobs,
+		 * returns the amount of jobs that are still unfinished */
+		size_t collect()
+		{
+			std::vector<done_type> done;
+			this->mtx.lock();
+			done.swap(this->done);
+			this->unfinished -= done.size();
+			size_t ret = this->unfinished;
+			this->mtx.unlock();
+
+			for(done_type& cb : done)
+				if(cb) cb();
+			return ret;
+		}
+
+		size_t pending()
+		{
+			ctr::lock_guard guard(this->mtx);
+			return this->unfinished;
+		}
+
+
+	private:
+		std::vector<ctr::thread<> *> workers;
+		std::deque<job_type> jobs;
+		std::vector<done_type> done;
+		size_t unfinished = 0;
+		bool shouldExit = false;
+		ctr::condvar cv;
+		ctr::mutex mtx;
+
+		void run()
+		{
+			this->mtx.lock();
+			while(true)
+			{
+				while(!this->shouldExit && this->jobs.size() == 0)
+					this->cv.wait(this->mtx);
+				if(this->shouldExit) break;
+
+				job_type job = this->jobs.front();
+				this->jobs.pop_front();
+				this->mtx.unlock();
+
+				done_type cb = job();
+
+				this->mtx.lock();
+				this->done.push_back(cb);
+			}
+			this->mtx.unlock();
+		}
+
+
+	};
+}
+
+#endif
+
@@ -15,10 +15,18 @@
  */
 
 #include "install.hh"
+#include "binfile.hh"
+#include "thread.hh"
 #include "error.hh"
 #include "panic.hh"
 #include "ctr.hh"
 
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <list>
+
+#include <sys/stat.h>
 #include <string.h>
 
 #define AEXEFS_SMDH_PATH             { 0x00000000, 0x00000000, 0x00000002, 0x6E6F6369, 0x00000000 }
@@ -34,9 +42,14 @@ static inline FS_Path makebin_(const void *path, u32 size)
 }
 
 ctr::TitleSMDH *ctr::smdh::get(u64 tid)
+{
+	return ctr::smdh::get(tid, ctr::mediatype_of(tid));
+}
+
+ctr::TitleSMDH *ctr::smdh::get(u64 tid, FS_MediaType media)
 {
 	static const u32 smdhPath[5] = AEXEFS_SMDH_PATH;
-	u32 exefsArchivePath[4] = MAKE_EXEFS_APATH(tid, ctr::mediatype_of(tid));
+	u32 exefsArchivePath[4] = MAKE_EXEFS_APATH(tid, media);
 
 	Handle smdhFile;
 	if(R_FAILED(FSUSER_OpenFileDirectly(&smdhFile, ARCHIVE_SAVEDATA_AND_CONTENT,
@@ -58,87 +71,406 @@ finish:
 	return ret;
 }
 
-ctr::TitleSMDHTitle *ctr::smdh::get_native_title(TitleSMDH *smdh)
+/* index in TitleSMDH::titles of the system language, -1 if it is unknown */
+static int syslang_title_index()
 {
-	TitleSMDHTitle *title = nullptr;
 	u8 syslang;
+	if(R_FAILED(CFGU_GetSystemLanguage(&syslang)))
+		return -1;
 
-	if(R_SUCCEEDED(CFGU_GetSystemLanguage(&syslang)))
+	switch(syslang)
 	{
-		switch(syslang)
-		{
-		case CFG_LANGUAGE_JP: title = &smdh->titles[0]; break;
-		case CFG_LANGUAGE_EN: title = &smdh->titles[1]; break;
-		case CFG_LANGUAGE_FR: title = &smdh->titles[2]; break;
-		case CFG_LANGUAGE_DE: title = &smdh->titles[3]; break;
-		case CFG_LANGUAGE_IT: title = &smdh->titles[4]; break;
-		case CFG_LANGUAGE_ES: title = &smdh->titles[5]; break;
-		case CFG_LANGUAGE_ZH: title = &smdh->titles[6]; break;
-		case CFG_LANGUAGE_KO: title = &smdh->titles[7]; break;
-		case CFG_LANGUAGE_NL: title = &smdh->titles[8]; break;
-		case CFG_LANGUAGE_PT: title = &smdh->titles[9]; break;
-		case CFG_LANGUAGE_RU: title = &smdh->titles[10]; break;
-		case CFG_LANGUAGE_TW: title = &smdh->titles[11]; break;
-		}
+	case CFG_LANGUAGE_JP: return 0;
+	case CFG_LANGUAGE_EN: return 1;
+	case CFG_LANGUAGE_FR: return 2;
+	case CFG_LANGUAGE_DE: return 3;
+	case CFG_LANGUAGE_IT: return 4;
+	case CFG_LANGUAGE_ES: return 5;
+	case CFG_LANGUAGE_ZH: return 6;
+	case CFG_LANGUAGE_KO: return 7;
+	case CFG_LANGUAGE_NL: return 8;
+	case CFG_LANGUAGE_PT: return 9;
+	case CFG_LANGUAGE_RU: return 10;
+	case CFG_LANGUAGE_TW: return 11;
 	}
 
-	if(title != nullptr && title->descShort[0] != 0)
-		return title;
+	return -1;
+}
+
+/* returns the title in the system language if it is set,
+ * else the first set title in the lookup order */
+template <typename T>
+static T *pick_native_title(T *titles, bool (*is_set)(const T&))
+{
+	int index = syslang_title_index();
+	if(index != -1 && is_set(titles[index]))
+		return &titles[index];
 
 	// EN, JP, FR, DE, IT, ES, ZH, KO, NL, PT, RU, TW
 	static const u8 lookuporder[] = { 1, 0, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
 	for(u8 i = 0; i < sizeof(lookuporder); ++i)
 	{
-		if(smdh->titles[i].descShort[0] != 0)
-			return &smdh->titles[i];
+		if(is_set(titles[lookuporder[i]]))
+			return &titles[lookuporder[i]];
 	}
 
 	return nullptr;
 }
 
-std::string ctr::smdh::u16conv(u16 *str, size_t size)
+ctr::TitleSMDHTitle *ctr::smdh::get_native_title(TitleSMDH *smdh)
 {
-	u16 *strexpand = (u16 *) malloc(sizeof(u16) * (size + 1));
-	memcpy(strexpand, str, size * sizeof(u16));
-	strexpand[size] = 0; /* all this for a NULL term */
+	return pick_native_title<TitleSMDHTitle>(smdh->titles,
+		[](const TitleSMDHTitle& title) -> bool { return title.descShort[0] != 0; });
+}
+
+const ctr::TitleSMDHInfo::Title *ctr::smdh::get_native_title(const TitleSMDHInfo& info)
+{
+	return pick_native_title<const TitleSMDHInfo::Title>(info.titles,
+		[](const TitleSMDHInfo::Title& title) -> bool { return title.descShort.size() != 0; });
+}
 
-	u8 *buf = (u8 *) malloc(size * 4);
-	ssize_t units = utf16_to_utf8(buf, str, size * 4);
-	if(units == -1 || units > (ssize_t) size * 4)
-		panic("Failed to decode utf16 sequence, units=" + std::to_string(units));
+std::string ctr::smdh::u16conv(const u16 *str, size_t size)
+{
+	std::string ret;
+	ret.resize(UTF16_MAX_UTF8(size));
+	ret.resize(utf16_to_utf8_n(&ret[0], str, size));
+	return ret;
+}
 
-	free((void *) strexpand);
-	std::string ret((char *) buf, units);
-	free((void *) buf);
+static ctr::smdh::DecodedString decode_string(char *& arena, const u16 *str, size_t size)
+{
+	ctr::smdh::DecodedString ret;
+	ret.str = arena;
+	ret.len = utf16_to_utf8_n(arena, str, size);
+	arena += ret.len;
 	return ret;
 }
 
-Result ctr::list_titles_on(FS_MediaType media, std::vector<u64>& ret)
+void ctr::smdh::decode_titles(const TitleSMDH& smdh, char *arena, DecodedTitle ret[0x10])
+{
+	for(size_t i = 0; i < 0x10; ++i)
+	{
+		ret[i].descShort = decode_string(arena, smdh.titles[i].descShort, 0x40);
+		ret[i].descLong = decode_string(arena, smdh.titles[i].descLong, 0x80);
+		ret[i].publisher = decode_string(arena, smdh.titles[i].publisher, 0x40);
+	}
+}
+
+/* {{{ SMDH cache
+everything LE
+
+TitleSMDHInfo {
+	char[4] magic // "3HSI"
+	u16 titleVersion
+	u32 region
+	u32 flags
+	{ dynstr descShort, dynstr descLong, dynstr publisher }[0x10] titles
+	u8[0x480] iconSmall
+	u8[0x1200] iconLarge
+}
+*/
+
+#define SMDH_CACHE_DIR  "/3ds/3hs/smdh/"
+#define SMDH_CACHE_SIZE 16 /* amount of entries kept in memory */
+
+typedef struct SMDHCacheEntry
+{
+	ctr::TitleSMDHInfo info;
+	std::list<u64>::iterator lru;
+} SMDHCacheEntry;
+
+static std::unordered_map<u64, SMDHCacheEntry> g_smdh_cache;
+static std::list<u64> g_smdh_lru; /* most recently used first */
+static ctr::mutex g_smdh_lock; /* hLink looks up SMDHs from its own thread */
+
+static std::string smdh_cache_path(u64 tid)
+{
+	return SMDH_CACHE_DIR + ctr::tid_to_str(tid);
+}
+
+static void parse_smdh(const ctr::TitleSMDH& smdh, u16 version, ctr::TitleSMDHInfo& ret)
+{
+	/* only used with g_smdh_lock locked */
+	static char arena[SMDH_DECODE_ARENA_SIZE];
+	ctr::smdh::DecodedTitle titles[0x10];
+	ctr::smdh::decode_titles(smdh, arena, titles);
+	for(size_t i = 0; i < 0x10; ++i)
+	{
+		ret.titles[i].descShort.assign(titles[i].descShort.str, titles[i].descShort.len);
+		ret.titles[i].descLong.assign(titles[i].descLong.str, titles[i].descLong.len);
+		ret.titles[i].publisher.assign(titles[i].publisher.str, titles[i].publisher.len);
+	}
+	ret.region = smdh.region;
+	ret.flags = smdh.flags;
+	ret.titleVersion = version;
+	memcpy(ret.iconSmall, smdh.iconSmall, sizeof(ret.iconSmall));
+	memcpy(ret.iconLarge, smdh.iconLarge, sizeof(ret.iconLarge));
+}
+
+static bool read_smdh_info(u64 tid, u16 version, ctr::TitleSMDHInfo& ret)
+{
+	std::vector<u8> buf;
+	if(!binary_read_file(smdh_cache_path(tid).c_str(), buf))
+		return false;
+
+	BinaryReader reader(buf.data(), buf.size());
+	char magic[4];
+	if(!reader.read(magic) || memcmp(magic, "3HSI", 4) != 0
+			|| !reader.read(ret.titleVersion) || ret.titleVersion != version
+			|| !reader.read(ret.region) || !reader.read(ret.flags))
+		return false;
+	for(ctr::TitleSMDHInfo::Title& title : ret.titles)
+		if(!reader.read(title.descShort) || !reader.read(title.descLong) || !reader.read(title.publisher))
+			return false;
+	return reader.read(ret.iconSmall) && reader.read(ret.iconLarge);
+}
+
+static void write_smdh_info(u64 tid, const ctr::TitleSMDHInfo& info)
+{
+	std::string buf;
+	buf.append("3HSI", 4);
+	binary_write(buf, info.titleVersion);
+	binary_write(buf, info.region);
+	binary_write(buf, info.flags);
+	for(const ctr::TitleSMDHInfo::Title& title : info.titles)
+	{
+		binary_write(buf, title.descShort);
+		binary_write(buf, title.descLong);
+		binary_write(buf, title.publisher);
+	}
+	binary_write(buf, info.iconSmall);
+	binary_write(buf, info.iconLarge);
+
+	mkdir("/3ds", 0777);
+	mkdir("/3ds/3hs", 0777);
+	mkdir(SMDH_CACHE_DIR, 0777);
+	if(!binary_write_file(smdh_cache_path(tid).c_str(), buf))
+		elog("failed to write SMDH cache for %016llX", tid);
+}
+
+bool ctr::smdh::lookup(u64 tid, TitleSMDHInfo& ret)
+{
+	ctr::lock_guard guard(g_smdh_lock);
+
+	std::unordered_map<u64, SMDHCacheEntry>::iterator it = g_smdh_cache.find(tid);
+	if(it != g_smdh_cache.end())
+	{
+		g_smdh_lru.splice(g_smdh_lru.begin(), g_smdh_lru, it->second.lru);
+		ret = it->second.info;
+		return true;
+	}
+
+	/* the version tells us if the copy on the SD card is still valid */
+	AM_TitleEntry entry;
+	bool haveVersion = R_SUCCEEDED(ctr::get_title_entry(tid, entry));
+	if(!haveVersion || !read_smdh_info(tid, entry.version, ret))
+	{
+		TitleSMDH *smdh = ctr::smdh::get(tid);
+		if(!smdh) return false;
+		parse_smdh(*smdh, haveVersion ? entry.version : 0, ret);
+		delete smdh;
+		/* without a version we can never know if this is outdated */
+		if(!haveVersion) return true;
+		write_smdh_info(tid, ret);
+	}
+
+	if(g_smdh_cache.size() >= SMDH_CACHE_SIZE)
+	{
+		g_smdh_cache.erase(g_smdh_lru.back());
+		g_smdh_lru.pop_back();
+	}
+	g_smdh_lru.push_front(tid);
+	SMDHCacheEntry& nentry = g_smdh_cache[tid];
+	nentry.info = ret;
+	nentry.lru = g_smdh_lru.begin();
+	return true;
+}
+
+void ctr::smdh::invalidate(u64 tid)
+{
+	ctr::lock_guard guard(g_smdh_lock);
+	std::unordered_map<u64, SMDHCacheEntry>::iterator it = g_smdh_cache.find(tid);
+	if(it != g_smdh_cache.end())
+	{
+		g_smdh_lru.erase(it->second.lru);
+		g_smdh_cache.erase(it);
+	}
+	remove(smdh_cache_path(tid).c_str());
+}
+
+/* }}} */
+
+/* {{{ installed title inventory
+ * every media type is only enumerated once, after that
+ * ctr::inventory::* keeps it up-to-date */
+
+typedef struct MediaInventory
+{
+	std::unordered_map<u64, AM_TitleEntry> entries; /* only the ones that were requested */
+	std::unordered_set<u64> set;
+	std::vector<u64> tids; /* in the order AM lists them */
+	bool valid = false;
+} MediaInventory;
+
+static MediaInventory g_inventory[3]; /* indexed by FS_MediaType */
+static ctr::mutex g_inventory_lock; /* background installs update the inventory too */
+
+static Result enumerate_titles(FS_MediaType media, std::vector<u64>& ret)
 {
 	u32 tcount = 0;
 	Result res = AM_GetTitleCount(media, &tcount);
 	if(R_FAILED(res)) return res;
 
 	u32 tread = 0;
-	u64 *tids = new u64[tcount];
-
-	res = AM_GetTitleList(&tread, media, tcount, tids);
-	if(R_FAILED(res)) return res;
+	ret.resize(tcount);
+	if(R_FAILED(res = AM_GetTitleList(&tread, media, tcount, ret.data())))
+	{
+		ret.clear();
+		return res;
+	}
 
 	if(tread != tcount)
 	{
-		delete [] tids;
+		ret.clear();
 		return APPERR_TITLE_MISMATCH;
 	}
 
-	ret.reserve(tcount);
-	for(u32 i = 0; i < tcount; ++i)
-		ret.push_back(tids[i]);
+	return res;
+}
+
+/* g_inventory_lock must be locked */
+static Result get_inventory(FS_MediaType media, MediaInventory **ret)
+{
+	MediaInventory& inv = g_inventory[media];
+	/* the cart can be swapped at any time so we never trust the cache for it */
+	if(!inv.valid || media == MEDIATYPE_GAME_CARD)
+	{
+		inv.entries.clear();
+		inv.valid = false;
+		inv.set.clear();
+		Result res;
+		if(R_FAILED(res = enumerate_titles(media, inv.tids)))
+			return res;
+		inv.set.insert(inv.tids.begin(), inv.tids.end());
+		inv.valid = true;
+	}
+	*ret = &inv;
+	return 0;
+}
+
+void ctr::inventory::installed(u64 tid, FS_MediaType media)
+{
+	/* must be done before locking, ctr::smdh::lookup() locks the other way around */
+	ctr::smdh::invalidate(tid);
+	ctr::lock_guard guard(g_inventory_lock);
+	MediaInventory& inv = g_inventory[media];
+	if(!inv.valid) return;
+	if(inv.set.insert(tid).second)
+		inv.tids.push_back(tid);
+	/* the version may have changed */
+	inv.entries.erase(tid);
+}
+
+void ctr::inventory::removed(u64 tid, FS_MediaType media)
+{
+	ctr::smdh::invalidate(tid);
+	ctr::lock_guard guard(g_inventory_lock);
+	MediaInventory& inv = g_inventory[media];
+	if(!inv.valid || inv.set.erase(tid) == 0) return;
+	inv.tids.erase(std::find(inv.tids.begin(), inv.tids.end(), tid));
+	inv.entries.erase(tid);
+}
+
+void ctr::inventory::reset()
+{
+	ctr::lock_guard guard(g_inventory_lock);
+	for(MediaInventory& inv : g_inventory)
+	{
+		inv.entries.clear();
+		inv.valid = false;
+		inv.tids.clear();
+		inv.set.clear();
+	}
+}
 
-	delete [] tids;
+Result ctr::list_titles_on(FS_MediaType media, std::vector<u64>& ret)
+{
+	ctr::lock_guard guard(g_inventory_lock);
+	MediaInventory *inv;
+	Result res;
+	if(R_FAILED(res = get_inventory(media, &inv)))
+		return res;
+
+	ret.insert(ret.end(), inv->tids.begin(), inv->tids.end());
 	return res;
 }
 
+bool ctr::title_exists(u64 tid, FS_MediaType media)
+{
+	ctr::lock_guard guard(g_inventory_lock);
+	MediaInventory *inv;
+	if(R_FAILED(get_inventory(media, &inv)))
+		return false;
+	return inv->set.count(tid) != 0;
+}
+
+Result ctr::get_title_entry(u64 tid, AM_TitleEntry& entry)
+{
+	FS_MediaType media = ctr::mediatype_of(tid);
+	ctr::lock_guard guard(g_inventory_lock);
+	MediaInventory& inv = g_inventory[media];
+
+	std::unordered_map<u64, AM_TitleEntry>::iterator it = inv.entries.find(tid);
+	if(it != inv.entries.end())
+	{
+		entry = it->second;
+		return 0;
+	}
+
+	Result res = AM_GetTitleInfo(media, 1, &tid, &entry);
+	/* only cache if the titles on this medium are known, else
+	 * we'd never know when this entry needs to be invalidated */
+	if(R_SUCCEEDED(res) && inv.valid)
+		inv.entries[tid] = entry;
+	return res;
+}
+
+Result ctr::get_title_entries(FS_MediaType media, const std::vector<u64>& tids, std::vector<AM_TitleEntry>& ret)
+{
+	ret.resize(tids.size());
+	if(tids.size() == 0) return 0;
+
+	ctr::lock_guard guard(g_inventory_lock);
+	MediaInventory& inv = g_inventory[media];
+
+	std::vector<u64> misses;
+	for(u64 tid : tids)
+		if(inv.entries.count(tid) == 0)
+			misses.push_back(tid);
+
+	if(misses.size() != 0)
+	{
+		std::vector<AM_TitleEntry> fetched(misses.size());
+		Result res = AM_GetTitleInfo(media, misses.size(), misses.data(), fetched.data());
+		if(R_FAILED(res)) return res;
+		/* can't cache these, see get_title_entry(), entries is
+		 * always empty in this case so misses == tids */
+		if(!inv.valid)
+		{
+			ret = std::move(fetched);
+			return res;
+		}
+		for(size_t i = 0; i < misses.size(); ++i)
+			inv.entries[misses[i]] = fetched[i];
+	}
+
+	for(size_t i = 0; i < tids.size(); ++i)
+		ret[i] = inv.entries[tids[i]];
+	return 0;
+}
+
+/* }}} */
+
 Result ctr::get_free_space(Destination media, u64 *size)
 {
 	FS_ArchiveResource resource = { 0, 0, 0, 0 };
@@ -155,11 +487,6 @@ Result ctr::get_free_space(Destination media, u64 *size)
 	return res;
 }
 
-Result ctr::get_title_entry(u64 tid, AM_TitleEntry& entry)
-{
-	return AM_GetTitleInfo(ctr::mediatype_of(tid), 1, &tid, &entry);
-}
-
 u64 ctr::str_to_tid(const std::string& str)
 {
 	return strtoull(str.c_str(), nullptr, 16);
@@ -176,36 +503,12 @@ std::string ctr::tid_to_str(u64 tid)
 	return buf;
 }
 
-bool ctr::title_exists(u64 tid, FS_MediaType media)
-{
-	u32 tcount = 0;
-
-	if(R_FAILED(AM_GetTitleCount(media, &tcount)))
-		return false;
-
-	u64 *tids = new u64[tcount];
-	if(R_FAILED(AM_GetTitleList(&tcount, media, tcount, tids)))
-	{
-		delete [] tids;
-		return false;
-	}
-
-	for(size_t i = 0; i < tcount; ++i)
-		if(tids[i] == tid)
-		{
-			delete [] tids;
-			return true;
-		}
-
-	delete [] tids;
-	return false;
-}
-
 Result ctr::delete_title(u64 tid, FS_MediaType media)
 {
 	Result ret = 0;
 
 	if(R_FAILED(ret = AM_DeleteTitle(media, tid))) return ret;
+	ctr::inventory::removed(tid, media);
 	if(R_FAILED(ret = AM_DeleteTicket(tid))) return ret;
 
 	// Reloads the databases
@@ -246,19 +549,41 @@ u32 ctr::get_tid_unique(u64 tid)
 	return (tid >> 8) & 0xFFFFFF;
 }
 
+/* foreground and background installs both hold the
+ * NDM state, only the first and last one touch it */
+static ctr::mutex g_ndm_lock;
+static size_t g_ndm_holders = 0;
+
 Result ctr::lockNDM()
 {
+	ctr::lock_guard guard(g_ndm_lock);
+	if(g_ndm_holders != 0)
+	{
+		++g_ndm_holders;
+		return 0;
+	}
+
 	/* basically ensures that we can use the network during sleep
 	 * thanks Kartik for the help */
 	aptSetSleepAllowed(false);
 	Result res;
-	if(R_FAILED(res = NDMU_EnterExclusiveState(NDM_EXCLUSIVE_STATE_INFRASTRUCTURE)))
+	if(R_FAILED(res = NDMU_EnterExclusiveState(NDM_EXCLUSIVE_STATE_INFRASTRUCTURE))
+			|| R_FAILED(res = NDMU_LockState()))
+	{
+		/* the caller won't call unlockNDM() */
+		NDMU_LeaveExclusiveState();
+		aptSetSleepAllowed(true);
 		return res;
-	return NDMU_LockState();
+	}
+	++g_ndm_holders;
+	return res;
 }
 
 void ctr::unlockNDM()
 {
+	ctr::lock_guard guard(g_ndm_lock);
+	if(g_ndm_holders == 0 || --g_ndm_holders != 0)
+		return;
 	NDMU_UnlockState();
 	NDMU_LeaveExclusiveState();
 	aptSetSleepAllowed(true);
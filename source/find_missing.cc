@@ -15,6 +15,8 @@
  */
 
 #include "find_missing.hh"
+#include "missing.hh"
+#include "binfile.hh"
 #include "install.hh"
 #include "hsapi.hh"
 #include "queue.hh"
@@ -24,83 +26,214 @@
 
 #include <ui/loading.hh>
 
-#include <unordered_set>
-#include <algorithm>
+#include <sys/stat.h>
+#include <string.h>
+#include <time.h>
 
+#include <unordered_map>
+
+#define RELATED_CACHE_LOCATION "/3ds/3hs/related"
+#define RELATED_CACHE_TTL      (60 * 60 * 24 * 3) /* 3 days */
 
-template <typename T>
-static void vecappend(std::vector<T>& a, const std::vector<T>& b)
-{ a.insert(a.end(), b.begin(), b.end()); }
 
 bool tid_can_have_missing(hsapi::htid tid)
 {
-	u16 category = ctr::get_tid_cat(tid);
-	return category == 0x0000 /* normal */ || category == 0x0010 /* system title */ || category == 0x8000 /* DSiWare/TWL */;
+	return missing::can_have_missing(tid);
+}
+
+/* {{{ related content cache
+everything LE
+
+FullTitle {
+	dynstr subcat
+	dynstr name
+	dynstr cat
+	dynstr prod
+	dynstr desc
+	u64 dlCount
+	u64 size
+	u64 tid
+	s64 id
+	u16 version
+	u32 flags
+}
+
+RelatedEntry {
+	u64 tid
+	u64 fetched // unix timestamp
+	u16 version // installed version of tid when fetched
+	u16 nupdates
+	u16 ndlc
+	FullTitle[nupdates] updates
+	FullTitle[ndlc] dlc
 }
 
+RelatedCache {
+	char[4] magic // "3HRC"
+	u32 count
+	RelatedEntry[count] entries
+}
+*/
+
+typedef missing::RelatedCache<hsapi::Related> RelatedCache;
+static RelatedCache g_related_cache(RELATED_CACHE_TTL);
+static bool g_related_cache_loaded = false;
+
+static bool read_titles(BinaryReader& reader, std::vector<hsapi::FullTitle>& ret, u16 count)
+{
+	ret.resize(count);
+	for(hsapi::FullTitle& title : ret)
+	{
+		if(!reader.read(title.subcat) || !reader.read(title.name) || !reader.read(title.cat)
+				|| !reader.read(title.prod) || !reader.read(title.desc) || !reader.read(title.dlCount)
+				|| !reader.read(title.size) || !reader.read(title.tid) || !reader.read(title.id)
+				|| !reader.read(title.version) || !reader.read(title.flags))
+			return false;
+	}
+	return true;
+}
+
+static void write_titles(std::string& buf, const std::vector<hsapi::FullTitle>& titles)
+{
+	for(const hsapi::FullTitle& title : titles)
+	{
+		binary_write(buf, title.subcat);
+		binary_write(buf, title.name);
+		binary_write(buf, title.cat);
+		binary_write(buf, title.prod);
+		binary_write(buf, title.desc);
+		binary_write(buf, title.dlCount);
+		binary_write(buf, title.size);
+		binary_write(buf, title.tid);
+		binary_write(buf, title.id);
+		binary_write(buf, title.version);
+		binary_write(buf, title.flags);
+	}
+}
+
+static void load_related_cache()
+{
+	if(g_related_cache_loaded) return;
+	g_related_cache_loaded = true;
+
+	std::vector<u8> buf;
+	if(!binary_read_file(RELATED_CACHE_LOCATION, buf)) return;
+
+	BinaryReader reader(buf.data(), buf.size());
+	char magic[4];
+	u32 count;
+	if(!reader.read(magic) || memcmp(magic, "3HRC", 4) != 0 || !reader.read(count))
+	{
+		elog("invalid related content cache, ignoring it");
+		return;
+	}
+
+	for(u32 i = 0; i < count; ++i)
+	{
+		RelatedCache::Entry entry;
+		hsapi::htid tid;
+		u64 fetched;
+		u16 nupdates, ndlc;
+		if(!reader.read(tid) || !reader.read(fetched) || !reader.read(entry.version)
+				|| !reader.read(nupdates) || !reader.read(ndlc)
+				|| !read_titles(reader, entry.related.updates, nupdates)
+				|| !read_titles(reader, entry.related.dlc, ndlc))
+		{
+			/* everything up until the corrupted entry is still fine */
+			elog("related content cache corrupted at entry %lu", i);
+			return;
+		}
+		entry.fetched = fetched;
+		g_related_cache.entries[tid] = std::move(entry);
+	}
+	ilog("loaded %u related content cache entries", g_related_cache.entries.size());
+}
+
+static void write_related_cache()
+{
+	std::string buf;
+	buf.append("3HRC", 4);
+	binary_write(buf, (u32) g_related_cache.entries.size());
+	for(const std::pair<const hsapi::htid, RelatedCache::Entry>& it : g_related_cache.entries)
+	{
+		binary_write(buf, it.first);
+		binary_write(buf, (u64) it.second.fetched);
+		binary_write(buf, it.second.version);
+		binary_write(buf, (u16) it.second.related.updates.size());
+		binary_write(buf, (u16) it.second.related.dlc.size());
+		write_titles(buf, it.second.related.updates);
+		write_titles(buf, it.second.related.dlc);
+	}
+
+	mkdir("/3ds", 0777);
+	mkdir("/3ds/3hs", 0777);
+	if(!binary_write_file(RELATED_CACHE_LOCATION, buf))
+		elog("failed to write related content cache");
+}
+
+/* like hsapi::batch_related() but only asks hShop for titles that
+ * aren't cached yet, that were cached too long ago or of which the
+ * installed version changed. versions[i] belongs to tids[i], 0 if unknown */
+static Result cached_batch_related(hsapi::BatchRelated& ret, const std::vector<hsapi::htid>& tids, const std::vector<hsapi::hiver>& versions)
+{
+	load_related_cache();
+
+	size_t fetched = 0;
+	Result res = g_related_cache.get(ret, tids, versions, time(NULL), hsapi::batch_related, &fetched);
+	ilog("%u/%u related content entries served from cache", tids.size() - fetched, tids.size());
+	if(R_SUCCEEDED(res) && fetched != 0)
+		write_related_cache();
+	return res;
+}
+
+/* }}} */
+
+static const FS_MediaType medias[missing::media_count] = { MEDIATYPE_SD, MEDIATYPE_NAND /* mostly for streetpass dlc */, MEDIATYPE_GAME_CARD };
+
 ssize_t show_find_missing(hsapi::htid tid)
 {
 	ssize_t ret = -1;
 	ui::loading([&tid, &ret]() -> void {
-		std::vector<hsapi::htid> installed;
-		panic_if_err_3ds(ctr::list_titles_on(MEDIATYPE_SD, installed));
-		panic_if_err_3ds(ctr::list_titles_on(MEDIATYPE_NAND, installed)); // mostly for streetpass dlc
-		ctr::list_titles_on(MEDIATYPE_GAME_CARD, installed); // it might error if there is no cart inserted so we don't want to panic if it fails
-
-		std::vector<hsapi::htid> doCheckOn;
-		if(tid == 0) doCheckOn = installed;
-		else doCheckOn.push_back(tid);
-
-		std::vector<hsapi::htid> installedGames;
-		std::copy_if(doCheckOn.begin(), doCheckOn.end(), std::back_inserter(installedGames), tid_can_have_missing);
-		/* deduplicate installedGames based on unique id */
-		std::unordered_set<u32> dedupe;
-		for(size_t i = 0; i < installedGames.size(); ++i)
+		std::vector<hsapi::htid> installed[missing::media_count];
+		for(size_t i = 0; i < missing::media_count; ++i)
 		{
-			u32 unique = ctr::get_tid_unique(installedGames[i]);
-			if(dedupe.find(unique) == dedupe.end())
-				dedupe.insert(unique);
-			else /* duplicate detected */
+			Result res = ctr::list_titles_on(medias[i], installed[i]);
+			/* it might error if there is no cart inserted so we don't want to panic if it fails */
+			if(medias[i] != MEDIATYPE_GAME_CARD) panic_if_err_3ds(res);
+		}
+
+		missing::Backend<hsapi::FullTitle, hsapi::Related> be;
+		/* one AM call per media type instead of one per title */
+		be.versions = [](size_t media, const std::vector<u64>& tids, std::vector<u16>& versions) -> Result {
+			std::vector<AM_TitleEntry> entries;
+			Result res;
+			if(R_FAILED(res = ctr::get_title_entries(medias[media], tids, entries)))
 			{
-				installedGames.erase(installedGames.begin() + i);
-				/* reset i to account for erasure */
-				--i;
+				elog("failed to batch fetch %u title entries: %08lX", tids.size(), res);
+				return res;
 			}
-		}
+			versions.resize(entries.size());
+			for(size_t i = 0; i < entries.size(); ++i)
+				versions[i] = entries[i].version;
+			return res;
+		};
+		be.version = [](size_t media, u64 tid, u16& version) -> Result {
+			AM_TitleEntry te;
+			Result res = AM_GetTitleInfo(medias[media], 1, &tid, &te);
+			if(R_SUCCEEDED(res)) version = te.version;
+			return res;
+		};
+		be.related = cached_batch_related;
+		be.skip = [](const hsapi::FullTitle& title) -> bool { return queue_contains(title.id); };
 
 		hsapi::BatchRelated related;
-		if(R_FAILED(hsapi::batch_related(related, installedGames)))
+		std::vector<const hsapi::FullTitle *> newInstalls;
+		if(R_FAILED(missing::find(installed, tid, be, related, newInstalls)))
 			return;
 
-		std::vector<hsapi::FullTitle> potentialInstalls;
-
-		for(size_t i = 0; i < installedGames.size(); ++i)
-		{
-			vecappend(potentialInstalls, related[installedGames[i]].updates);
-			vecappend(potentialInstalls, related[installedGames[i]].dlc);
-		}
-
-		std::vector<hsapi::FullTitle> newInstalls;
-		std::copy_if(potentialInstalls.begin(), potentialInstalls.end(), std::back_inserter(newInstalls), [installed](const hsapi::FullTitle& title) -> bool {
-			/* don't import demo's */
-			if(ctr::get_tid_cat(title.tid) == 0x2)
-				return false;
-			/* already in queue */
-			if(std::find(queue_get().begin(), queue_get().end(), title) != queue_get().end())
-				return false;
-			/* not installed */
-			if(std::find(installed.begin(), installed.end(), title.tid) == installed.end())
-				return true;
-			AM_TitleEntry te;
-			if(R_FAILED(ctr::get_title_entry(title.tid, te)))
-				return false;
-			/* installed version is lower than version on server*/
-			return title.version > te.version;
-		});
-
-		for(const hsapi::FullTitle& title : newInstalls)
-			queue_add(title);
-		ret = newInstalls.size();
+		ret = 0;
+		for(const hsapi::FullTitle *title : newInstalls)
+			if(queue_add(*title)) ++ret;
 	});
 	return ret;
 }
@@ -0,0 +1,186 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hlink/platform.hh"
+#include "hlink/hlink.hh"
+#include "hlink/conn.hh"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+
+bool hlink::set_nonblocking(int fd, bool nonblocking)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if(flags < 0) return false;
+	flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+	return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+hlink::OutputBuffer::Segment& hlink::OutputBuffer::push()
+{
+	/* sent segments are only removed once everything is sent, unless a
+	 * connection that never catches up (i.e. /events) piles them up */
+	if(this->head >= hlink::output_max_iov)
+	{
+		this->segments.erase(this->segments.begin(), this->segments.begin() + this->head);
+		this->head = 0;
+	}
+	this->segments.emplace_back();
+	return this->segments.back();
+}
+
+std::string& hlink::OutputBuffer::tail()
+{
+	if(this->empty() || this->segments.back().shared != nullptr || this->segments.back().file != -1)
+		this->push().data.swap(this->spare);
+	return this->segments.back().data;
+}
+
+void hlink::OutputBuffer::append(const char *data, size_t len)
+{
+	if(len != 0) this->tail().append(data, len);
+}
+
+void hlink::OutputBuffer::append_shared(std::shared_ptr<const void> owner, const char *data, size_t len)
+{
+	/* a copy is cheaper than a separate iovec for small buffers */
+	if(len < hlink::output_cork_size)
+		return this->append(data, len);
+
+	Segment& seg = this->push();
+	seg.owner = std::move(owner);
+	seg.shared = data;
+	seg.sharedlen = len;
+}
+
+void hlink::OutputBuffer::append_file(int fd, uint64_t offset, uint64_t len)
+{
+	Segment& seg = this->push();
+	seg.file = fd;
+	seg.fileoff = offset;
+	seg.fileend = offset + len;
+}
+
+uint64_t hlink::OutputBuffer::size() const
+{
+	uint64_t ret = 0;
+	for(size_t i = this->head; i < this->segments.size(); ++i)
+	{
+		const Segment& seg = this->segments[i];
+		ret += seg.file != -1 ? seg.fileend - seg.fileoff : seg.len();
+	}
+	return ret - this->headoff;
+}
+
+ssize_t hlink::OutputBuffer::flush(int sock)
+{
+	ssize_t total = 0;
+	while(this->head != this->segments.size())
+	{
+		Segment& first = this->segments[this->head];
+		if(first.file != -1)
+		{
+			if(first.fileoff != first.fileend)
+			{
+				ssize_t sent = hlink::platform::send_file(sock, first.file, first.fileoff, first.fileend - first.fileoff);
+				if(sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? total : -1;
+				/* the file got shorter than the Content-Length we promised */
+				if(sent == 0) return -1;
+				first.fileoff += sent;
+				total += sent;
+				if(first.fileoff != first.fileend) continue;
+			}
+			::close(first.file);
+			first.file = -1;
+			++this->head;
+			continue;
+		}
+
+		/* everything in memory up to the next file goes out at once */
+		struct iovec iov[hlink::output_max_iov];
+		int count = 0;
+		size_t wanted = 0, i = this->head;
+		for(; i < this->segments.size() && count < (int) hlink::output_max_iov && this->segments[i].file == -1; ++i)
+		{
+			size_t off = i == this->head ? this->headoff : 0;
+			if(this->segments[i].len() == off) continue;
+			iov[count].iov_base = (void *) (this->segments[i].ptr() + off);
+			iov[count].iov_len = this->segments[i].len() - off;
+			wanted += iov[count].iov_len;
+			++count;
+		}
+
+		ssize_t sent = 0;
+		if(count != 0)
+		{
+			sent = hlink::platform::send_vec(sock, iov, count, i != this->segments.size());
+			if(sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? total : -1;
+			total += sent;
+		}
+
+		/* skip what was sent, empty segments included */
+		size_t left = sent;
+		while(this->head < i)
+		{
+			Segment& seg = this->segments[this->head];
+			size_t avail = seg.len() - this->headoff;
+			if(left < avail)
+			{
+				this->headoff += left;
+				break;
+			}
+			left -= avail;
+			seg.owner.reset();
+			seg.shared = nullptr;
+			++this->head;
+			this->headoff = 0;
+		}
+		/* the socket is full, trying again would only return EAGAIN */
+		if((size_t) sent < wanted) return total;
+	}
+
+	/* the memory of the largest segment is kept for the next response */
+	for(Segment& seg : this->segments)
+		if(seg.data.capacity() > this->spare.capacity())
+			this->spare.swap(seg.data);
+	this->spare.clear();
+	this->segments.clear();
+	this->head = 0;
+	this->headoff = 0;
+	return total;
+}
+
+void hlink::OutputBuffer::clear()
+{
+	for(size_t i = this->head; i < this->segments.size(); ++i)
+		if(this->segments[i].file != -1)
+			::close(this->segments[i].file);
+	this->segments.clear();
+	this->head = 0;
+	this->headoff = 0;
+}
+
+bool hlink::Connection::flush()
+{
+	ssize_t sent = this->out.flush(this->fd);
+	if(sent > 0) this->lastActive = time(NULL);
+	return sent >= 0;
+}
+
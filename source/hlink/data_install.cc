@@ -0,0 +1,265 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hlink/data_install.hh"
+#include "hlink/hlink.hh"
+#include "log.hh"
+
+#ifdef __3DS__
+	#include "library.hh"
+	#include "install.hh"
+	#include "ctr.hh"
+	#include <3ds.h>
+#else
+	#include <stdlib.h>
+	#include <stdio.h>
+#endif
+
+
+#ifdef __3DS__
+/* installs a CIA, AM parses it while it is written */
+class AMSink : public hlink::InstallSink
+{
+public:
+	AMSink(uint64_t tid) : tid(tid) { }
+	~AMSink() { this->unlock(); }
+
+	int32_t begin(uint64_t size) override
+	{
+		Result res;
+		/* without a title id we can't know where it goes, most titles go to the SD */
+		this->dest = this->tid == 0 ? MEDIATYPE_SD : ctr::mediatype_of(this->tid);
+		/* an installed copy isn't deleted first: AM only replaces it once the whole CIA
+		 * arrived and AM_FinishCiaInstall() accepted it, so a dropped connection or a
+		 * bad CIA leaves it and its data alone */
+		ilog("Installing %llu bytes (tid=%016llX) from hLink", size, this->tid);
+		/* waits for a running foreground or background install, held until finish() or cancel() */
+		install::lock_am();
+		this->locked = true;
+		res = AM_StartCiaInstall(this->dest, &this->cia);
+		ilog("AM_StartCiaInstall(...): 0x%08lX", res);
+		if(R_FAILED(res)) this->unlock();
+		return res;
+	}
+
+	int32_t write(uint64_t offset, const void *data, size_t len) override
+	{
+		u32 written;
+		return FSFILE_Write(this->cia, &written, offset, data, len, 0);
+	}
+
+	int32_t finish() override
+	{
+		Result res = AM_FinishCiaInstall(this->cia);
+		ilog("AM_FinishCiaInstall(...): 0x%08lX", res);
+		svcCloseHandle(this->cia);
+		this->unlock();
+		if(R_SUCCEEDED(res) && this->tid != 0)
+			ctr::inventory::installed(this->tid, this->dest);
+		library::rescan();
+		return res;
+	}
+
+	void cancel() override
+	{
+		AM_CancelCIAInstall(this->cia);
+		svcCloseHandle(this->cia);
+		this->unlock();
+	}
+
+
+private:
+	uint64_t tid;
+	FS_MediaType dest;
+	Handle cia;
+	bool locked = false;
+
+	void unlock()
+	{
+		if(!this->locked) return;
+		this->locked = false;
+		install::unlock_am();
+	}
+
+
+};
+
+hlink::InstallSink *hlink::make_install_sink(uint64_t tid)
+{
+	return new AMSink(tid);
+}
+#else
+/* stands in for AM off-console, writes the data to
+ * $HLINK_FAKE_AM if it is set and discards it otherwise */
+class FakeSink : public hlink::InstallSink
+{
+public:
+	int32_t begin(uint64_t size) override
+	{
+		const char *path = getenv("HLINK_FAKE_AM");
+		ilog("Fake install of %llu bytes to %s", (unsigned long long) size, path ? path : "nowhere");
+		if(path != nullptr && (this->f = fopen(path, "w")) == nullptr)
+			return -1;
+		return 0;
+	}
+
+	int32_t write(uint64_t offset, const void *data, size_t len) override
+	{
+		if(this->f == nullptr) return 0;
+		if(fseek(this->f, offset, SEEK_SET) != 0 || fwrite(data, 1, len, this->f) != len)
+			return -1;
+		return 0;
+	}
+
+	int32_t finish() override
+	{
+		if(this->f == nullptr) return 0;
+		int32_t ret = fclose(this->f) == 0 ? 0 : -1;
+		this->f = nullptr;
+		return ret;
+	}
+
+	void cancel() override
+	{
+		if(this->f != nullptr) fclose(this->f);
+		this->f = nullptr;
+	}
+
+
+private:
+	FILE *f = nullptr;
+
+
+};
+
+hlink::InstallSink *hlink::make_install_sink(uint64_t tid)
+{
+	(void) tid;
+	return new FakeSink;
+}
+#endif
+
+hlink::DataInstall::DataInstall(InstallSink *sink, uint64_t size)
+	: size(size), sink(sink)
+{
+	this->ring = new char[hlink::install_ring_size];
+	this->writer = new ctr::thread<>([this]() -> void { this->run(); });
+}
+
+hlink::DataInstall::~DataInstall()
+{
+	this->cancel();
+	delete this->writer; /* joins */
+	delete [] this->ring;
+	delete this->sink;
+}
+
+size_t hlink::DataInstall::reserve(char **ptr)
+{
+	ctr::lock_guard guard(this->mtx);
+	size_t index = this->head % hlink::install_ring_size;
+	size_t free = hlink::install_ring_size - (this->head - this->tail);
+	size_t contiguous = hlink::install_ring_size - index;
+	*ptr = this->ring + index;
+	return free < contiguous ? free : contiguous;
+}
+
+void hlink::DataInstall::commit(size_t len)
+{
+	ctr::lock_guard guard(this->mtx);
+	this->head += len;
+	this->cv.signal();
+}
+
+void hlink::DataInstall::finish()
+{
+	ctr::lock_guard guard(this->mtx);
+	this->finished = true;
+	this->cv.signal();
+}
+
+void hlink::DataInstall::cancel()
+{
+	ctr::lock_guard guard(this->mtx);
+	this->cancelled = true;
+	this->cv.signal();
+}
+
+uint64_t hlink::DataInstall::written()
+{
+	ctr::lock_guard guard(this->mtx);
+	return this->tail;
+}
+
+bool hlink::DataInstall::done(int32_t *res)
+{
+	ctr::lock_guard guard(this->mtx);
+	*res = this->res;
+	return this->isDone;
+}
+
+void hlink::DataInstall::run()
+{
+	int32_t res = this->sink->begin(this->size);
+	bool started = res >= 0;
+
+	this->mtx.lock();
+	while(res >= 0)
+	{
+		while(!this->cancelled && !this->finished && this->head == this->tail)
+			this->cv.wait(this->mtx);
+		if(this->cancelled)
+		{
+			res = err_cancelled;
+			break;
+		}
+		if(this->head == this->tail) /* finished */
+		{
+			if(this->tail != this->size)
+				res = err_size;
+			break;
+		}
+		if(this->head > this->size)
+		{
+			res = err_size;
+			break;
+		}
+
+		/* the server only touches the free part of the ring, so this can be written unlocked */
+		size_t index = this->tail % hlink::install_ring_size;
+		size_t len = this->head - this->tail;
+		if(len > hlink::install_ring_size - index) len = hlink::install_ring_size - index;
+		if(len > hlink::install_write_size) len = hlink::install_write_size;
+		uint64_t offset = this->tail;
+		this->mtx.unlock();
+
+		res = this->sink->write(offset, this->ring + index, len);
+
+		this->mtx.lock();
+		if(res >= 0) this->tail += len;
+	}
+	this->mtx.unlock();
+
+	if(res >= 0) res = this->sink->finish();
+	else if(started) this->sink->cancel();
+	if(res < 0) elog("Install from hLink failed: %08lX", (unsigned long) res);
+
+	this->mtx.lock();
+	this->res = res;
+	this->isDone = true;
+	this->mtx.unlock();
+}
+
@@ -14,32 +14,36 @@
  * this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "hlink/data_install.hh"
+#include "hlink/platform.hh"
 #include "hlink/hlink.hh"
 #include "hlink/templ.hh"
 #include "hlink/http.hh"
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <poll.h>
 
+/* panic.hh is 3ds only */
+#define JSON_THROW_USER(exception) hlink_panic("Json failure\n" + std::string(exception.what()))
+#include <3rd/json.hh>
 #include <string.h>
-#include <panic.hh>
 #include <errno.h>
 
 #include <unordered_map>
+#include <algorithm>
+#include <vector>
 
-#include "install.hh"
-#include "thread.hh"
-#include "queue.hh"
-#include "hsapi.hh"
-#include "i18n.hh"
-#include "ctr.hh"
+#include "worker_pool.hh"
 #include "log.hh"
 
+namespace platform = hlink::platform;
+
 #define SLEEP_AMOUNT 5
 #define SLEEP_AMOUNT_S "5"
 #define SLEEP_AMOUNT_S_PLUS_ONE "6"
@@ -48,8 +52,8 @@
 	#define TIMER_START(label)
 	#define TIMER_END(label)
 #else
-	#define TIMER_START(label) u64 timer_##label = osGetTime();
-	#define TIMER_END(label) dlog("Completing " #label " took %llums", osGetTime() - timer_##label);
+	#define TIMER_START(label) uint64_t timer_##label = platform::time_ms();
+	#define TIMER_END(label) dlog("Completing " #label " took %llums", (unsigned long long) (platform::time_ms() - timer_##label));
 #endif
 
 // All network byte order (BE)
@@ -68,13 +72,112 @@ typedef struct iTransactionResponse
 	uint32_t size;
 } __attribute__((__packed__)) iTransactionResponse;
 
-static bool g_lock = false; // is a hlink transaction going on?
+/* v2 frames, after a hello transaction a connection only uses these
+ * and may have multiple requests (identified by id) in flight */
+typedef struct iFrameHeader
+{
+	char magic[hlink::transaction_magic_len];
+	uint8_t type; /* hlink::action for requests, hlink::response for responses */
+	uint8_t flags; /* hlink::frame_* */
+	uint32_t id;
+	uint32_t size;
+} __attribute__((__packed__)) iFrameHeader;
 
+typedef struct TransactionContext : public hlink::Connection
+{
+	union {
+		iTransactionHeader v1;
+		iFrameHeader v2;
+	} header;
+	size_t headerlen = 0; /* bytes of header received */
+	uint32_t bodylen = 0; /* size of the current body */
+	uint32_t bodyoff = 0; /* bytes of the current body received */
+	std::string body; /* the current frame, only grows up to max_body_size() */
+	hlink::DataInstall *install = nullptr; /* receives the current body instead of body */
+	std::vector<uint32_t> dropped; /* v2 streams that exceeded their limit */
+	bool discard = false; /* the current body is received but not handled */
+	std::unordered_map<uint32_t, std::string> streams; /* v2 request bodies that aren't complete yet */
+	uint8_t version = 1;
+
+	inline size_t header_size()
+	{ return this->version == 1 ? sizeof(iTransactionHeader) : sizeof(iFrameHeader); }
+} TransactionContext;
+
+/* the progress of a background install job, watch responses are arrays of these */
+typedef struct iJobStatus
+{
+	uint32_t id;
+	uint8_t state; /* install::JobState */
+	int32_t res;
+	uint64_t done; /* bytes */
+	uint64_t total; /* bytes, 0 if unknown */
+	uint32_t speed; /* bytes per second */
+} __attribute__((__packed__)) iJobStatus;
+
+/* a request body, it points into a buffer of the
+ * connection so it is only valid until the handler returns */
+typedef struct BodyView
+{
+	BodyView(const std::string& buf)
+		: ptr(buf.data()), len(buf.size()) { }
+
+	inline const char *data() const { return this->ptr; }
+	inline size_t size() const { return this->len; }
+	inline char operator [] (size_t i) const { return this->ptr[i]; }
+	inline std::string substr(size_t pos) const { return std::string(this->ptr + pos, this->len - pos); }
+
+	const char *ptr;
+	size_t len;
+} BodyView;
+
+/* a request a response can be sent to, the connection may be gone by then */
+typedef struct TransactionRef
+{
+	uint32_t conn; /* hlink::Connection::id */
+	uint32_t id; /* request id, always 0 for v1 */
+} TransactionRef;
+
+using json = nlohmann::json;
 using trust_store_t = std::unordered_map<in_addr_t, bool>;
+using disp_func = std::function<void(const std::string&)>;
 
 static uint64_t ntohll(uint64_t n)
 { return __builtin_bswap64(n); }
 
+/* a big endian uint64_t as response body */
+static std::string u64_body(uint64_t n)
+{
+	n = ntohll(n);
+	return std::string((const char *) &n, sizeof(n));
+}
+
+/* the largest body accepted per action. Bodies are received
+ * whole before they are handled so this bounds memory use */
+static uint32_t max_body_size(hlink::action action)
+{
+	switch(action)
+	{
+	case hlink::action::add_queue:
+	case hlink::action::install_id:
+		return 1024 * sizeof(uint64_t); /* hShop ids */
+	case hlink::action::install_url:
+		return sizeof(uint64_t) + 2048; /* title id and url */
+	case hlink::action::install_data:
+		return hlink::max_frame_size; /* per frame, the data itself goes to the ring */
+	case hlink::action::launch:
+		return sizeof(uint64_t);
+	case hlink::action::hello:
+		return 1;
+	case hlink::action::watch:
+		return 1024 * sizeof(uint32_t); /* job ids */
+	case hlink::action::nothing:
+		return hlink::max_frame_size; /* ignored, lets clients measure throughput */
+	case hlink::action::sleep:
+		break;
+	}
+	return 0;
+}
+
 static const char *action2string(hlink::action action)
 {
 #define MKS(n) case hlink::action::n: return #n
@@ -87,232 +190,1001 @@ static const char *action2string(hlink::action action)
 		MKS(nothing);
 		MKS(launch);
 		MKS(sleep);
-		default: return STRING(invalid);
+		MKS(hello);
+		MKS(watch);
+		default: return "invalid";
 	}
 #undef MKS
 }
 
-static void send_response(int clientfd, hlink::response resp, const std::string& body)
+static const char *job_state_str(install::JobState state)
+{
+	switch(state)
+	{
+	case install::JobState::queued: return "queued";
+	case install::JobState::running: return "running";
+	case install::JobState::done: return "done";
+	case install::JobState::failed: return "failed";
+	case install::JobState::cancelled: return "cancelled";
+	}
+	return "unknown";
+}
+
+static bool job_finished(install::JobState state)
+{
+	return state != install::JobState::queued && state != install::JobState::running;
+}
+
+static std::string sse_event(const char *name, const json& data)
+{
+	return std::string("event: ") + name + "\ndata: " + data.dump() + "\n\n";
+}
+
+static json queue_json()
+{
+	json ret = json::array();
+	for(const platform::Title& meta : platform::queue_get())
+		ret.push_back({ { "id", meta.id }, { "tid", platform::tid_to_str(meta.tid) }, { "name", meta.name } });
+	return ret;
+}
+
+static json job_json(const platform::InstallService::Job& job)
+{
+	return {
+		{ "id", job.id }, { "tid", platform::tid_to_str(job.meta.tid) }, { "name", job.meta.name },
+		{ "state", job_state_str(job.state) }, { "result", job.res },
+		{ "done", job.done }, { "total", job.total },
+	};
+}
+
+static void send_response(hlink::Connection *conn, hlink::response resp, const std::string& body)
 {
 	iTransactionResponse respb;
-	strncpy(respb.magic, hlink::transaction_magic, hlink::transaction_magic_len + 1);
+	memcpy(respb.magic, hlink::transaction_magic, hlink::transaction_magic_len);
 	respb.size = htonl(body.size());
 	respb.resp = resp;
 
-	send(clientfd, &respb, sizeof(iTransactionResponse), 0);
-	send(clientfd, body.c_str(), body.size(), 0);
+	conn->out.append((const char *) &respb, sizeof(iTransactionResponse));
+	conn->out.append(body);
 }
 
-static void send_response(int clientfd, hlink::response resp)
+static void send_response(hlink::Connection *conn, hlink::response resp)
 {
-	iTransactionResponse respb;
-	strncpy(respb.magic, hlink::transaction_magic, hlink::transaction_magic_len + 1);
-	respb.resp = resp;
-	respb.size = 0;
+	send_response(conn, resp, "");
+}
 
-	send(clientfd, &respb, sizeof(iTransactionResponse), 0);
+static void send_frame(hlink::Connection *conn, uint32_t id, hlink::response resp, uint8_t flags, const std::string& body)
+{
+	iFrameHeader frame;
+	memcpy(frame.magic, hlink::frame_magic, hlink::transaction_magic_len);
+	frame.type = (uint8_t) resp;
+	frame.flags = flags;
+	frame.id = htonl(id);
+	frame.size = htonl(body.size());
+
+	conn->out.append((const char *) &frame, sizeof(iFrameHeader));
+	conn->out.append(body);
 }
 
-static int read_whole_body(int clientfd, std::string& ret, iTransactionHeader header)
+static void finish_ctx(hlink::HTTPRequestContext& ctx, hlink::TemplRen& ren, size_t status)
 {
-	ret.reserve(header.size);
+	hlink::TemplRen::result code;
+	std::string res;
 
-	struct pollfd clientpoll;
-	clientpoll.fd = clientfd;
-	clientpoll.events = POLLIN;
+	/* the template is rendered straight from the cache */
+	static const std::string missing;
+	hlink::CachedFilePtr file = ctx.read_path_content();
+	const std::string& src = file ? file->data : missing;
+	if((code = ren.finish(src, res)) != hlink::TemplRen::result::ok)
+	{
+		ctx.respond(500, "<!DOCTYPE html><html><body>Failed to render due to a template error. Code = " + std::to_string((int) code)
+			+ ". If you do not know what this code means <a href=\"/doc/3hs-template-language.html\">try reading the documentation</a>."
+			"<p>If your 3DS showed an ARM11 message/crashed this is a bug.</p>"
+			"<p><a href=\"/index.html\">Back to home</a></p></body></html>",
+			{ { "Content-Type", "text/html" } });
+	}
+	else ctx.respond(status, res, { { "Content-Type", "text/html" } });
+	ctx.finish();
+}
+
+static void make_renderer(hlink::TemplRen& ren, size_t& status)
+{
+	ren.use("is-success?()", [&status](hlink::TemplCtx&, hlink::TemplArgs&) -> bool { return status == 200; });
+	ren.use_default();
+}
 
-	char buf[1024];
-	int seqbad = 0;
+/* Handles all clients of both the hLink transaction server and
+ * the HTTP server on a single thread. Sockets are non-blocking and
+ * every connection is a small state machine driven by poll(), slow
+ * actions run in a worker pool and finish on this thread again. */
+class EventLoop
+{
+public:
+	EventLoop(std::function<bool(const std::string&)> on_requester, disp_func disp_error,
+			disp_func on_server_create, std::function<bool()> on_poll_exit, disp_func disp_req)
+		: pool(hlink::workers), on_requester(on_requester), disp_error(disp_error),
+		  on_server_create(on_server_create), on_poll_exit(on_poll_exit), disp_req(disp_req) { }
 
-	do
+	~EventLoop()
 	{
-		if(seqbad > hlink::max_timeouts) break;
-		if(poll(&clientpoll, 1, hlink::poll_timeout_body) == 0)
-		{
-			++seqbad;
-			continue;
-		}
-		else seqbad = 0;
+		for(ActiveInstall& install : this->installs)
+			delete install.inst; /* cancels */
+		for(hlink::Connection *conn : this->conns)
+			this->destroy(conn);
+		if(this->httpserv.fd != -1) this->httpserv.close();
+		if(this->serverfd != -1) close(this->serverfd);
+	}
 
-		ssize_t recvd = recv(clientfd, buf, 1024, 0);
-		if(recvd < 0) break;
-		ret += std::string(buf, recvd);
-	} while(ret.size() != header.size);
+	bool setup();
+	void run();
 
-	if(ret.size() < header.size) return errno;
-	return 0;
+
+private:
+	typedef struct ActiveInstall
+	{
+		TransactionRef ref;
+		hlink::DataInstall *inst;
+		uint64_t lastAck; /* bytes written at the last progress response */
+	} ActiveInstall;
+
+	typedef struct Watch
+	{
+		TransactionRef ref;
+		std::vector<uint32_t> ids; /* install jobs */
+		std::vector<uint64_t> lastDone; /* bytes done per job at the last response */
+		platform::InstallService::Status status;
+		uint64_t lastSent; /* platform::time_ms() of the last response */
+	} Watch;
+
+	typedef struct EventJob
+	{
+		install::JobState state;
+		uint64_t done;
+	} EventJob;
+
+	std::vector<hlink::Connection *> conns;
+	std::vector<ActiveInstall> installs;
+	std::vector<Watch> watches;
+	std::vector<std::string> bodies; /* body buffers of closed connections */
+	std::unordered_map<uint32_t, EventJob> eventJobs; /* what /events clients last saw of each job */
+	platform::InstallService::Status eventStatus;
+	uint64_t lastEvents = 0; /* platform::time_ms() of the last eventStatus change */
+	uint64_t sleepUntil = 0; /* platform::time_ms() until which no clients are accepted or read from */
+	uint64_t launchBy = 0; /* platform::time_ms() deadline of a pending launch, 0 if there is none */
+	uint64_t launchTid = 0;
+	uint32_t launchConn = 0; /* connection that gets the response to the launch */
+	time_t lastHeartbeat = 0;
+	bool eventsPrimed = false; /* eventJobs is up to date */
+	ctr::WorkerPool pool;
+	trust_store_t truststore;
+	hlink::HTTPServer httpserv;
+	struct sockaddr_in servaddr;
+	uint32_t lastId = 0;
+	int serverfd = -1;
+	bool redraw = true;
+	bool keepOpen = true;
+
+	std::function<bool(const std::string&)> on_requester;
+	disp_func disp_error;
+	disp_func on_server_create;
+	std::function<bool()> on_poll_exit;
+	disp_func disp_req;
+
+	bool is_trusted(struct sockaddr_in clientaddr);
+	hlink::Connection *find(uint32_t id);
+	void destroy(hlink::Connection *conn);
+	void accept_client(int listenfd, hlink::Connection::kind_type kind);
+	bool on_readable(hlink::Connection *conn);
+	void serve_http(hlink::HTTPRequestContext *ctx);
+	void reap();
+
+	bool begin_frame(TransactionContext *ctx);
+	void end_frame(TransactionContext *ctx);
+	void reply(TransactionRef ref, hlink::response resp, const std::string& body = "", bool more = false);
+	void handle_transaction(TransactionRef ref, hlink::action action, const BodyView& body);
+	void handle_hello(TransactionRef ref, const BodyView& body);
+	void handle_add_queue(TransactionRef ref, const BodyView& body);
+	void handle_launch(TransactionRef ref, const BodyView& body);
+	void handle_install_id(TransactionRef ref, const BodyView& body);
+	void handle_install_url(TransactionRef ref, const BodyView& body);
+	void handle_watch(TransactionRef ref, const BodyView& body);
+	bool send_watch(Watch& watch, uint64_t now);
+	void pump_watches();
+	void handle_install_data(TransactionContext *ctx, TransactionRef ref, bool more);
+	hlink::DataInstall *find_install(TransactionRef ref);
+	void pump_installs();
+	void handle_http_request(hlink::HTTPRequestContext *ctx);
+	void open_events(hlink::HTTPRequestContext *ctx);
+	bool has_event_clients();
+	std::string events_status();
+	void broadcast_event(const std::string& event);
+	void pump_events();
+	void launch(hlink::Connection *conn, uint64_t tid);
+	void finish_launch();
+	inline bool launching() { return this->launchBy != 0; }
+	/* stops accepting and reading from clients for SLEEP_AMOUNT seconds, pending output is still sent */
+	void sleep() { this->sleepUntil = platform::time_ms() + SLEEP_AMOUNT * 1000; }
+
+
+};
+
+bool EventLoop::setup()
+{
+	if((this->serverfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+	{
+		this->disp_error("socket(): " + std::string(strerror(errno)));
+		return false;
+	}
+
+	memset(&this->servaddr, 0x0, sizeof(this->servaddr));
+	this->servaddr.sin_family = AF_INET; // IPv4 only (3ds doesn't support IPv6)
+	this->servaddr.sin_addr.s_addr = platform::host_address();
+	this->servaddr.sin_port = htons(hlink::port);
+
+	if(bind(this->serverfd, (struct sockaddr *) &this->servaddr, sizeof(this->servaddr)) < 0)
+	{
+		this->disp_error("bind(): " + std::string(strerror(errno)));
+		return false;
+	}
+
+	if(listen(this->serverfd, hlink::backlog) < 0)
+	{
+		this->disp_error("listen(): " + std::string(strerror(errno)));
+		return false;
+	}
+
+	int res;
+	if((res = this->httpserv.make_fd()) != 0)
+	{
+		this->disp_error("httpserv.make_fd(): " + hlink::HTTPServer::errmsg(res));
+		return false;
+	}
+
+	hlink::set_nonblocking(this->serverfd);
+	hlink::set_nonblocking(this->httpserv.fd);
+	return true;
 }
 
-static void handle_add_queue(int clientfd, iTransactionHeader header)
+bool EventLoop::is_trusted(struct sockaddr_in clientaddr)
 {
-	std::string body;
-	if(read_whole_body(clientfd, body, header) != 0)
+	trust_store_t::iterator it = this->truststore.find(clientaddr.sin_addr.s_addr);
+	if(it != this->truststore.end())
+		return it->second;
+
+	const char *clientipaddr = inet_ntoa(clientaddr.sin_addr);
+	bool trusted = this->on_requester(clientipaddr);
+	this->redraw = true; /* the prompt took over the screen */
+
+	this->truststore[clientaddr.sin_addr.s_addr] = trusted;
+	ilog("Adding %s as %s", clientipaddr, trusted ? "trusted" : "untrusted");
+	return trusted;
+}
+
+hlink::Connection *EventLoop::find(uint32_t id)
+{
+	for(hlink::Connection *conn : this->conns)
+		if(conn->id == id) return conn;
+	return nullptr;
+}
+
+void EventLoop::destroy(hlink::Connection *conn)
+{
+	close(conn->fd);
+	if(conn->kind == hlink::Connection::http)
+		delete (hlink::HTTPRequestContext *) conn;
+	else
+	{
+		TransactionContext *ctx = (TransactionContext *) conn;
+		/* keep the allocation around for the next client */
+		if(this->bodies.size() < hlink::body_pool_size)
+		{
+			ctx->body.clear();
+			this->bodies.push_back(std::move(ctx->body));
+		}
+		delete ctx;
+	}
+}
+
+void EventLoop::accept_client(int listenfd, hlink::Connection::kind_type kind)
+{
+	hlink::Connection *conn;
+	if(kind == hlink::Connection::http)
+	{
+		hlink::HTTPRequestContext *ctx = new hlink::HTTPRequestContext;
+		ctx->server = &this->httpserv;
+		conn = ctx;
+	}
+	else
+	{
+		TransactionContext *ctx = new TransactionContext;
+		if(this->bodies.size() != 0)
+		{
+			ctx->body.swap(this->bodies.back());
+			this->bodies.pop_back();
+		}
+		conn = ctx;
+	}
+	conn->kind = kind;
+
+	socklen_t clientaddrlen = sizeof(conn->clientaddr);
+	memset(&conn->clientaddr, 0x0, sizeof(conn->clientaddr));
+	if((conn->fd = accept(listenfd, (struct sockaddr *) &conn->clientaddr, &clientaddrlen)) < 0)
+	{
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			elog("accept(): %s", strerror(errno));
+		conn->fd = -1;
+		this->destroy(conn);
 		return;
+	}
 
-	if(body.size() % sizeof(u64) != 0)
-		return send_response(clientfd, hlink::response::error, "body.size() % sizeof(u64) != 0");
+	/* the rejections are small enough to just send them blocking */
+	if(this->conns.size() >= hlink::max_clients)
+	{
+		if(kind == hlink::Connection::http)
+			((hlink::HTTPRequestContext *) conn)->serve_path(429, "/busy.html", { });
+		else send_response(conn, hlink::response::busy);
+		conn->flush();
+		this->destroy(conn);
+		return;
+	}
 
-	for(size_t i = 0; i < body.size() / sizeof(hsapi::hid); ++i)
+	if(!this->is_trusted(conn->clientaddr))
 	{
-		hsapi::hid id = ntohll(((const hsapi::hid *) body.data())[i]);
+		if(kind == hlink::Connection::http)
+			((hlink::HTTPRequestContext *) conn)->serve_403();
+		else send_response(conn, hlink::response::untrusted);
+		conn->flush();
+		this->destroy(conn);
+		return;
+	}
 
-		hsapi::FullTitle meta;
-		if(R_FAILED(hsapi::title_meta(meta, id)))
-			continue;
-		queue_add(meta);
+	hlink::set_nonblocking(conn->fd);
+	/* responses are small and already batched in conn->out */
+	int nodelay = 1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	conn->id = ++this->lastId;
+	conn->lastActive = time(NULL);
+	this->conns.push_back(conn);
+}
+
+/* returns false if the connection should be closed */
+bool EventLoop::on_readable(hlink::Connection *conn)
+{
+	conn->lastActive = time(NULL);
+	if(conn->kind == hlink::Connection::http)
+	{
+		hlink::HTTPRequestContext *ctx = (hlink::HTTPRequestContext *) conn;
+		if(ctx->eventStream)
+		{
+			/* nothing is expected anymore, but we do need to see the client leave */
+			ssize_t len = recv(ctx->fd, ctx->buf, sizeof(ctx->buf), 0);
+			return len > 0 || (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+		}
+		ssize_t len = recv(ctx->fd, ctx->buf + ctx->buflen, sizeof(ctx->buf) - ctx->buflen, 0);
+		if(len <= 0) return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+		ctx->buflen += len;
+		this->serve_http(ctx);
+		return true;
+	}
+
+	/* pipelined v2 frames are read until the socket is drained, but
+	 * not too many at once so a single client can't starve the rest.
+	 * Nothing is read after a launch, the server goes away */
+	TransactionContext *ctx = (TransactionContext *) conn;
+	ssize_t len;
+	for(size_t frames = 0; !this->launching() && !ctx->waiting && !ctx->closing && frames < hlink::max_inflight; )
+	{
+		if(ctx->headerlen != ctx->header_size())
+		{
+			len = recv(ctx->fd, ((char *) &ctx->header) + ctx->headerlen, ctx->header_size() - ctx->headerlen, 0);
+			if(len <= 0) return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+			if((ctx->headerlen += len) != ctx->header_size())
+				continue;
+			if(!this->begin_frame(ctx))
+				return true;
+		}
+		else if(ctx->install != nullptr)
+		{
+			/* install data is received straight into the ring */
+			char *ptr;
+			size_t avail = ctx->install->reserve(&ptr);
+			if(avail == 0)
+			{
+				/* pump_installs() resumes reading once the writer caught up */
+				ctx->waiting = true;
+				return true;
+			}
+			size_t left = ctx->bodylen - ctx->bodyoff;
+			len = recv(ctx->fd, ptr, left > avail ? avail : left, 0);
+			if(len <= 0) return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+			ctx->install->commit(len);
+			ctx->bodyoff += len;
+		}
+		else
+		{
+			/* begin_frame() sized the buffer, so the rest of the body can come in one go */
+			len = recv(ctx->fd, &ctx->body[ctx->bodyoff], ctx->bodylen - ctx->bodyoff, 0);
+			if(len <= 0) return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+			ctx->bodyoff += len;
+		}
+
+		if(ctx->bodyoff == ctx->bodylen)
+		{
+			this->end_frame(ctx);
+			++frames;
+		}
 	}
+	return true;
+}
 
-	send_response(clientfd, hlink::response::success);
+/* handles all complete requests in ctx->buf, pipelined requests are
+ * answered in order so a request waiting on a worker blocks the rest */
+void EventLoop::serve_http(hlink::HTTPRequestContext *ctx)
+{
+	while(!ctx->waiting && !ctx->closing && !ctx->eventStream)
+	{
+		int res = this->httpserv.parse_request(*ctx);
+		if(res == 1) break; /* need more data */
+		if(res < 0)
+		{
+			if(res == -2) ctx->serve_431();
+			else if(res == -3) ctx->serve_403();
+			else ctx->serve_400();
+			ctx->close();
+			break;
+		}
+
+		this->handle_http_request(ctx);
+		/* launching a title destroys all connections */
+		if(this->launching()) break;
+	}
 }
 
-static bool handle_launch(int clientfd, int server, hlink::HTTPServer& serv, iTransactionHeader header, std::function<void(const std::string&)> disp_error)
+/* validates a received header, returns false if the connection is unusable */
+bool EventLoop::begin_frame(TransactionContext *ctx)
 {
-	if(header.size != sizeof(uint64_t))
+	const char *magic = ctx->version == 1 ? hlink::transaction_magic : hlink::frame_magic;
+	if(memcmp(ctx->header.v1.magic, magic, hlink::transaction_magic_len) != 0)
 	{
-		send_response(clientfd, hlink::response::error, "body.size() != sizeof(uint64_t)");
+		send_response(ctx, hlink::response::error, "invalid magic");
+		ctx->closing = true;
 		return false;
 	}
 
-	std::string body;
-	if(read_whole_body(clientfd, body, header) != 0)
+	ctx->bodyoff = 0;
+	ctx->install = nullptr;
+	ctx->discard = false;
+	if(ctx->version == 1)
+	{
+		ctx->bodylen = ntohl(ctx->header.v1.size);
+		if(ctx->bodylen > max_body_size(ctx->header.v1.action))
+		{
+			/* there is only one request per connection anyway */
+			send_response(ctx, hlink::response::error, "body too large");
+			ctx->closing = true;
+			return false;
+		}
+		ctx->body.resize(ctx->bodylen);
+		return true;
+	}
+
+	uint32_t id = ntohl(ctx->header.v2.id);
+	hlink::action action = (hlink::action) ctx->header.v2.type;
+	ctx->bodylen = ntohl(ctx->header.v2.size);
+	if(ctx->bodylen > hlink::max_frame_size)
+	{
+		/* too large to skip, so the stream is lost */
+		send_frame(ctx, id, hlink::response::error, 0, "frame too large");
+		ctx->closing = true;
 		return false;
+	}
 
-	uint64_t tid = ntohll(* (uint64_t *) body.data());
-	FS_MediaType media = ctr::mediatype_of(tid);
+	if(action == hlink::action::install_data)
+		ctx->install = this->find_install({ ctx->id, id });
+	if(ctx->install != nullptr)
+		return true;
 
-	if(!ctr::title_exists(tid, media))
+	std::unordered_map<uint32_t, std::string>::iterator it = ctx->streams.find(id);
+	size_t buffered = it == ctx->streams.end() ? 0 : it->second.size();
+	if(std::find(ctx->dropped.begin(), ctx->dropped.end(), id) != ctx->dropped.end())
+		ctx->discard = true;
+	else if(buffered + ctx->bodylen > max_body_size(action))
 	{
-		disp_error(PSTRING(title_doesnt_exist, ctr::tid_to_str(tid)));
-		send_response(clientfd, hlink::response::notfound);
-		return false;
+		/* the frame is small enough to skip, the other requests can continue */
+		send_frame(ctx, id, hlink::response::error, 0, "body too large");
+		if(it != ctx->streams.end()) ctx->streams.erase(it);
+		if(ctx->header.v2.flags & hlink::frame_more)
+			ctx->dropped.push_back(id);
+		ctx->discard = true;
+	}
+	ctx->body.resize(ctx->bodylen);
+	return true;
+}
+
+void EventLoop::end_frame(TransactionContext *ctx)
+{
+	TransactionRef ref = { ctx->id, 0 };
+	ctx->headerlen = 0;
+
+	if(ctx->version == 1)
+	{
+		/* one action per connection */
+		ctx->waiting = true;
+		++ctx->inflight;
+		return this->handle_transaction(ref, ctx->header.v1.action, ctx->body);
 	}
 
-	send_response(clientfd, hlink::response::success);
+	ref.id = ntohl(ctx->header.v2.id);
+	hlink::action action = (hlink::action) ctx->header.v2.type;
+	bool more = ctx->header.v2.flags & hlink::frame_more;
+	if(ctx->discard)
+	{
+		/* the error was already sent in begin_frame() */
+		if(!more) ctx->dropped.erase(std::remove(ctx->dropped.begin(), ctx->dropped.end(), ref.id), ctx->dropped.end());
+		return;
+	}
+	/* install data is never buffered as a whole */
+	if(action == hlink::action::install_data)
+		return this->handle_install_data(ctx, ref, more);
 
-	close(clientfd);
-	close(server);
-	serv.close();
-	g_lock = false;
+	/* a streamed body is only handled once it is complete */
+	std::unordered_map<uint32_t, std::string>::iterator it = ctx->streams.find(ref.id);
+	if(more)
+	{
+		if(it == ctx->streams.end() && ctx->streams.size() + ctx->inflight >= hlink::max_inflight)
+			return send_frame(ctx, ref.id, hlink::response::busy, 0, "");
+		ctx->streams[ref.id] += ctx->body;
+		return;
+	}
 
-	APT_PrepareToDoApplicationJump(0, tid, media);
+	if(ctx->inflight >= hlink::max_inflight)
+	{
+		if(it != ctx->streams.end()) ctx->streams.erase(it);
+		return send_frame(ctx, ref.id, hlink::response::busy, 0, "");
+	}
 
-	u8 parambuf[0x300];
-	u8 hmacbuf[0x20];
-	APT_DoApplicationJump(parambuf, 0x300, hmacbuf);
+	++ctx->inflight;
+	if(it == ctx->streams.end())
+		return this->handle_transaction(ref, action, ctx->body);
 
-	return true; // reachable only if APT_DoApplicationJump fails
+	std::string body;
+	body.swap(it->second);
+	ctx->streams.erase(it);
+	body += ctx->body;
+	this->handle_transaction(ref, action, body);
 }
 
-static bool handle_request(int clientfd, int serverfd, hlink::HTTPServer serv, const char *clientaddr,
-	std::function<void(const std::string&)> disp_req,
-	std::function<void(const std::string&)> disp_error)
+/* sends a response to a request, `more' sends a part of a streamed response */
+void EventLoop::reply(TransactionRef ref, hlink::response resp, const std::string& body, bool more)
 {
-	iTransactionHeader header;
-	ssize_t recvd = recv(clientfd, &header, sizeof(header), 0);
-	if(recvd < 0) // error
-		goto cleanup;
+	TransactionContext *ctx = (TransactionContext *) this->find(ref.conn);
+	if(ctx == nullptr) return;
 
-	header.size = ntohll(header.size);
-	if(memcmp(header.magic, hlink::transaction_magic, hlink::transaction_magic_len) != 0)
+	if(ctx->version == 1)
 	{
-		send_response(clientfd, hlink::response::error, "invalid magic");
-		goto cleanup;
+		/* v1 clients only read the final response */
+		if(more) return;
+		send_response(ctx, resp, body);
+		ctx->waiting = false;
+		ctx->closing = true;
 	}
+	else send_frame(ctx, ref.id, resp, more ? hlink::frame_more : 0, body);
+
+	if(!more) --ctx->inflight;
+}
 
-	disp_req(std::string(clientaddr) + "\n" + action2string(header.action));
+void EventLoop::handle_transaction(TransactionRef ref, hlink::action action, const BodyView& body)
+{
+	hlink::Connection *conn = this->find(ref.conn);
+	this->disp_req(std::string(inet_ntoa(conn->clientaddr.sin_addr)) + "\n" + action2string(action));
+	this->redraw = true;
 
-	switch(header.action)
+	switch(action)
 	{
+	case hlink::action::hello:
+		this->handle_hello(ref, body);
+		break;
 	case hlink::action::add_queue:
-		handle_add_queue(clientfd, header);
+		this->handle_add_queue(ref, body);
 		break;
 	case hlink::action::install_id:
+		this->handle_install_id(ref, body);
+		break;
 	case hlink::action::install_url:
+		this->handle_install_url(ref, body);
+		break;
+	case hlink::action::watch:
+		this->handle_watch(ref, body);
+		break;
 	case hlink::action::install_data:
-		send_response(clientfd, hlink::response::error, "stub");
+		/* v2 handles this in handle_install_data() */
+		this->reply(ref, hlink::response::error, "install_data requires protocol version 2");
 		break;
 	case hlink::action::nothing:
-		send_response(clientfd, hlink::response::accept);
+		this->reply(ref, hlink::response::accept);
 		break;
 	case hlink::action::launch:
-		if(handle_launch(clientfd, serverfd, serv, header, disp_error))
-			return true;
+		this->handle_launch(ref, body);
 		break;
 	case hlink::action::sleep:
-		send_response(clientfd, hlink::response::success);
-		close(clientfd);
-		sleep(SLEEP_AMOUNT);
-		goto no_close;
+		this->reply(ref, hlink::response::success);
+		this->sleep();
+		break;
 	default:
-		send_response(clientfd, hlink::response::error, "invalid action");
+		this->reply(ref, hlink::response::error, "invalid action");
 		break;
 	}
+}
 
-cleanup:
-	close(clientfd);
-no_close:
-	g_lock = false;
-	return false;
+/* the body is the highest version the client speaks, the response body
+ * is the version both speak. Older servers reject the unknown action */
+void EventLoop::handle_hello(TransactionRef ref, const BodyView& body)
+{
+	TransactionContext *ctx = (TransactionContext *) this->find(ref.conn);
+	if(ctx->version != 1 || body.size() != 1 || body[0] == 0)
+		return this->reply(ref, hlink::response::error, "invalid hello");
+
+	uint8_t version = std::min((uint8_t) body[0], hlink::protocol_version);
+	send_response(ctx, hlink::response::accept, std::string(1, (char) version));
+	--ctx->inflight;
+	ctx->waiting = false;
+	ctx->version = version;
+	/* version 1 still means one action per connection */
+	if(version == 1) ctx->closing = true;
 }
 
-static void finish_ctx(hlink::HTTPRequestContext& ctx, hlink::TemplRen& ren, size_t status)
+void EventLoop::handle_add_queue(TransactionRef ref, const BodyView& body)
 {
-	hlink::TemplRen::result code;
-	std::string res;
+	if(body.size() % sizeof(uint64_t) != 0)
+		return this->reply(ref, hlink::response::error, "body.size() % sizeof(uint64_t) != 0");
+
+	std::vector<uint64_t> ids;
+	for(size_t i = 0; i < body.size() / sizeof(uint64_t); ++i)
+		ids.push_back(ntohll(((const uint64_t *) body.data())[i]));
+
+	/* the metadata is fetched by a worker but the queue
+	 * itself may only be touched from this thread */
+	this->pool.submit([this, ref, ids]() -> ctr::WorkerPool::done_type {
+		TIMER_START(add_queue)
+		std::vector<platform::Title> metas;
+		for(uint64_t tid : ids)
+		{
+			platform::Title meta;
+			if(platform::title_meta(meta, tid))
+				metas.push_back(meta);
+		}
+		TIMER_END(add_queue)
+
+		return [this, ref, metas]() -> void {
+			for(const platform::Title& meta : metas)
+				platform::queue_add(meta);
+			this->reply(ref, hlink::response::success);
+			this->broadcast_event(sse_event("queue", { { "queue", queue_json() } }));
+		};
+	});
+}
 
-	std::string src;
-	ctx.read_path_content(src);
-	if((code = ren.finish(src, res)) != hlink::TemplRen::result::ok)
+void EventLoop::handle_launch(TransactionRef ref, const BodyView& body)
+{
+	if(body.size() != sizeof(uint64_t))
+		return this->reply(ref, hlink::response::error, "body.size() != sizeof(uint64_t)");
+
+	uint64_t tid = ntohll(* (uint64_t *) body.data());
+
+	if(!platform::title_exists(tid))
 	{
-		ctx.respond(500, "<!DOCTYPE html><html><body>Failed to render due to a template error. Code = " + std::to_string((int) code)
-			+ ". If you do not know what this code means <a href=\"/doc/3hs-template-language.html\">try reading the documentation</a>."
-			"<p>If your 3DS showed an ARM11 message/crashed this is a bug.</p>"
-			"<p><a href=\"/index.html\">Back to home</a></p></body></html>",
-			{ { "Content-Type", "text/html" } });
+		this->disp_error(platform::title_missing_message(tid));
+		return this->reply(ref, hlink::response::notfound);
 	}
-	else ctx.respond(status, res, { { "Content-Type", "text/html" } });
-	ctx.close();
+
+	this->reply(ref, hlink::response::success);
+	this->launch(this->find(ref.conn), tid);
+}
+
+/* the body has hShop ids like add_queue, but the titles are handed to the
+ * background service right away. The response has a job id per hShop id,
+ * 0 if the title wasn't found */
+void EventLoop::handle_install_id(TransactionRef ref, const BodyView& body)
+{
+	if(body.size() % sizeof(uint64_t) != 0)
+		return this->reply(ref, hlink::response::error, "body.size() % sizeof(uint64_t) != 0");
+
+	std::vector<uint64_t> ids;
+	for(size_t i = 0; i < body.size() / sizeof(uint64_t); ++i)
+		ids.push_back(ntohll(((const uint64_t *) body.data())[i]));
+
+	this->pool.submit([this, ref, ids]() -> ctr::WorkerPool::done_type {
+		std::vector<platform::Title> metas(ids.size());
+		std::vector<bool> found(ids.size());
+		for(size_t i = 0; i < ids.size(); ++i)
+			found[i] = platform::title_meta(metas[i], ids[i]);
+
+		return [this, ref, metas, found]() -> void {
+			platform::InstallService *bg = platform::installer();
+			std::string jobs;
+			for(size_t i = 0; i < metas.size(); ++i)
+			{
+				uint32_t job = htonl(found[i] ? bg->enqueue(metas[i]) : 0);
+				jobs.append((const char *) &job, sizeof(job));
+			}
+			this->reply(ref, hlink::response::success, jobs);
+		};
+	});
+}
+
+/* the body is a title id followed by the url of its CIA,
+ * the response is the id of the background job */
+void EventLoop::handle_install_url(TransactionRef ref, const BodyView& body)
+{
+	if(body.size() <= sizeof(uint64_t))
+		return this->reply(ref, hlink::response::error, "body.size() <= sizeof(uint64_t)");
+
+	platform::InstallTitle meta = platform::InstallTitle();
+	meta.tid = ntohll(* (uint64_t *) body.data());
+	meta.url = body.substr(sizeof(uint64_t));
+	meta.name = meta.url;
+
+	uint32_t job = htonl(platform::installer()->enqueue(meta));
+	this->reply(ref, hlink::response::success, std::string((const char *) &job, sizeof(job)));
+}
+
+/* The body has the job ids to watch, all jobs that are queued or running
+ * if empty. Partial accept responses with an iJobStatus per job are sent
+ * whenever something changes, the final success response once all jobs
+ * finished. Jobs that aren't known (anymore) are left out */
+void EventLoop::handle_watch(TransactionRef ref, const BodyView& body)
+{
+	TransactionContext *ctx = (TransactionContext *) this->find(ref.conn);
+	if(ctx->version == 1)
+		return this->reply(ref, hlink::response::error, "watch requires protocol version 2");
+	if(body.size() % sizeof(uint32_t) != 0)
+		return this->reply(ref, hlink::response::error, "body.size() % sizeof(uint32_t) != 0");
+
+	platform::InstallService *bg = platform::installer(false);
+	/* nothing was ever installed */
+	if(bg == nullptr)
+		return this->reply(ref, hlink::response::success);
+
+	Watch watch;
+	watch.ref = ref;
+	watch.status.generation = 0;
+	bg->snapshot(watch.status);
+
+	for(size_t i = 0; i < body.size() / sizeof(uint32_t); ++i)
+		watch.ids.push_back(ntohl(((const uint32_t *) body.data())[i]));
+	if(watch.ids.size() == 0)
+	{
+		for(platform::InstallService::Job& job : watch.status.jobs)
+			if(job.state == install::JobState::queued || job.state == install::JobState::running)
+				watch.ids.push_back(job.id);
+	}
+
+	watch.lastDone.resize(watch.ids.size(), 0);
+	for(size_t i = 0; i < watch.ids.size(); ++i)
+		for(platform::InstallService::Job& job : watch.status.jobs)
+			if(job.id == watch.ids[i]) watch.lastDone[i] = job.done;
+
+	watch.lastSent = platform::time_ms();
+	if(!this->send_watch(watch, watch.lastSent))
+		this->watches.push_back(watch);
+}
+
+/* sends the status of all jobs in watch, returns true if it was the final response */
+bool EventLoop::send_watch(Watch& watch, uint64_t now)
+{
+	uint64_t elapsed = now - watch.lastSent;
+	bool finished = true;
+	std::string body;
+
+	for(size_t i = 0; i < watch.ids.size(); ++i)
+	{
+		for(platform::InstallService::Job& job : watch.status.jobs)
+		{
+			if(job.id != watch.ids[i]) continue;
+			iJobStatus status;
+			status.id = htonl(job.id);
+			status.state = (uint8_t) job.state;
+			status.res = htonl(job.res);
+			status.done = ntohll(job.done);
+			status.total = ntohll(job.total);
+			status.speed = htonl(elapsed != 0 && job.done > watch.lastDone[i]
+				? (job.done - watch.lastDone[i]) * 1000 / elapsed : 0);
+			body.append((const char *) &status, sizeof(status));
+
+			watch.lastDone[i] = job.done;
+			if(job.state == install::JobState::queued || job.state == install::JobState::running)
+				finished = false;
+			break;
+		}
+	}
+
+	watch.lastSent = now;
+	this->reply(watch.ref, finished ? hlink::response::success : hlink::response::accept, body, !finished);
+	return finished;
+}
+
+/* sends the progress of background installs to watching clients */
+void EventLoop::pump_watches()
+{
+	platform::InstallService *bg = platform::installer(false);
+	uint64_t now = platform::time_ms();
+	for(size_t i = 0; i < this->watches.size(); )
+	{
+		Watch& watch = this->watches[i];
+		hlink::Connection *conn = this->find(watch.ref.conn);
+		if(conn == nullptr || conn->closing)
+		{
+			/* nobody is listening anymore */
+			if(conn != nullptr) --conn->inflight;
+			this->watches.erase(this->watches.begin() + i);
+			continue;
+		}
+
+		uint32_t generation = watch.status.generation;
+		if(now - watch.lastSent >= (uint64_t) hlink::watch_interval)
+		{
+			bg->snapshot(watch.status);
+			if(watch.status.generation != generation && this->send_watch(watch, now))
+			{
+				this->watches.erase(this->watches.begin() + i);
+				continue;
+			}
+		}
+		++i;
+	}
+}
+
+/* The first install_data frame has the size and title id of the CIA, the
+ * data follows in frames with the same id and only the last frame lacks
+ * the more flag. Progress is reported with partial accept responses */
+void EventLoop::handle_install_data(TransactionContext *ctx, TransactionRef ref, bool more)
+{
+	hlink::DataInstall *inst = ctx->install;
+	ctx->install = nullptr;
+	if(inst != nullptr)
+	{
+		/* the data is already in the ring */
+		if(!more) inst->finish();
+		return;
+	}
+
+	if(!more || ctx->body.size() != 2 * sizeof(uint64_t))
+		return send_frame(ctx, ref.id, hlink::response::error, 0, "invalid install_data header");
+	if(this->installs.size() >= hlink::max_installs)
+		return send_frame(ctx, ref.id, hlink::response::busy, 0, "");
+
+	uint64_t size = ntohll(((const uint64_t *) ctx->body.data())[0]);
+	uint64_t tid = ntohll(((const uint64_t *) ctx->body.data())[1]);
+	this->disp_req(std::string(inet_ntoa(ctx->clientaddr.sin_addr)) + "\n" + action2string(hlink::action::install_data));
+	this->redraw = true;
+
+	ActiveInstall install;
+	install.ref = ref;
+	install.inst = new hlink::DataInstall(hlink::make_install_sink(tid), size);
+	install.lastAck = 0;
+	this->installs.push_back(install);
+	++ctx->inflight;
+}
+
+hlink::DataInstall *EventLoop::find_install(TransactionRef ref)
+{
+	for(ActiveInstall& install : this->installs)
+		if(install.ref.conn == ref.conn && install.ref.id == ref.id)
+			return install.inst;
+	return nullptr;
+}
+
+/* resumes stalled streams, reports progress and finishes installs */
+void EventLoop::pump_installs()
+{
+	time_t now = time(NULL);
+	for(size_t i = 0; i < this->installs.size(); )
+	{
+		ActiveInstall& install = this->installs[i];
+		TransactionContext *ctx = (TransactionContext *) this->find(install.ref.conn);
+		/* the client is gone or stopped sending data */
+		if(ctx == nullptr || (!ctx->waiting && install.inst->received() != install.inst->size
+				&& now - ctx->lastActive > hlink::idle_timeout))
+			install.inst->cancel();
+
+		int32_t res;
+		if(install.inst->done(&res))
+		{
+			if(ctx != nullptr && res >= 0)
+				this->reply(install.ref, hlink::response::success, u64_body(install.inst->written()));
+			else if(ctx != nullptr)
+			{
+				char msg[64];
+				snprintf(msg, sizeof(msg), "install failed: %08lX", (unsigned long) res);
+				this->reply(install.ref, hlink::response::error, msg);
+				/* the rest of the stream is useless */
+				if(ctx->install == install.inst) ctx->install = nullptr;
+				ctx->waiting = false;
+				ctx->closing = true;
+			}
+			delete install.inst;
+			this->installs.erase(this->installs.begin() + i);
+			continue;
+		}
+
+		if(ctx != nullptr)
+		{
+			char *ptr;
+			if(ctx->waiting && ctx->install == install.inst && install.inst->reserve(&ptr) != 0)
+				ctx->waiting = false;
+			uint64_t written = install.inst->written();
+			if(written - install.lastAck >= hlink::install_ack_interval)
+			{
+				this->reply(install.ref, hlink::response::accept, u64_body(written), true);
+				install.lastAck = written;
+			}
+		}
+		++i;
+	}
+}
+
+/* jumps to tid once the response on conn is sent, see run() */
+void EventLoop::launch(hlink::Connection *conn, uint64_t tid)
+{
+	/* the first one wins */
+	if(this->launching()) return;
+	this->launchBy = platform::time_ms() + hlink::launch_drain_timeout;
+	this->launchConn = conn->id;
+	this->launchTid = tid;
+}
+
+/* shuts the server down and jumps to launchTid */
+void EventLoop::finish_launch()
+{
+	for(hlink::Connection *c : this->conns)
+		this->destroy(c);
+	this->conns.clear();
+	this->httpserv.close();
+	close(this->serverfd);
+	this->serverfd = -1;
+	/* if the jump fails the server is gone anyway */
+	this->keepOpen = false;
+
+	platform::launch(this->launchTid);
 }
 
-static bool handle_http_request(hlink::HTTPRequestContext ctx, int serverfd, char *clientaddr, std::function<void(const std::string&)> disp_req,
-	std::function<void(const std::string&)> disp_error)
+void EventLoop::handle_http_request(hlink::HTTPRequestContext *ctx)
 {
-	disp_req(std::string(clientaddr) + "\n" + ctx.path);
-	((void) disp_error);
-	((void) serverfd);
+	this->disp_req(std::string(inet_ntoa(ctx->clientaddr.sin_addr)) + "\n" + ctx->path);
+	this->redraw = true;
 
-	/* TODO: Fix concurrency issue: hlink+http blocks? after that segv? */
-	hlink::HTTPRequestContext::serve_type type = ctx.type();
+	if(ctx->path == "/events")
+		return this->open_events(ctx);
+
+	hlink::HTTPRequestContext::serve_type type = ctx->type();
 	switch(type)
 	{
 	case hlink::HTTPRequestContext::notfound:
 		/* 404 not found */
-		ctx.serve_404();
+		ctx->serve_404();
 		break;
 	case hlink::HTTPRequestContext::plain:
 		/* plain serve */
-		ctx.serve_plain();
+		ctx->serve_plain();
 		break;
 	case hlink::HTTPRequestContext::templ:
 	{
 		/* template serve */
 		hlink::TemplRen ren;
 		size_t status = 500;
+		make_renderer(ren, status);
 
-		ren.use("is-success?()", [&status](hlink::TemplCtx&, hlink::TemplArgs&) -> bool { return status == 200; });
-		ren.use_default();
-
-		if(ctx.path == "/add-queue.tpl")
+		if(ctx->path == "/add-queue.tpl")
 		{
-			if(ctx.params.count("id") == 0)
+			if(ctx->params.count("id") == 0)
 			{
 				status = 400;
 				ren.use("error-message", "failed to find an \"id\" parameter");
 				goto begin_render;
 			}
 			char *end;
-			const char *str = ctx.params["id"].c_str();
-			hsapi::hid id = strtoull(str, &end, 10);
+			const char *str = ctx->params["id"].c_str();
+			uint64_t id = strtoull(str, &end, 10);
 			if(str == end) /* failed to parse int */
 			{
 				status = 400;
@@ -320,31 +1192,50 @@ static bool handle_http_request(hlink::HTTPRequestContext ctx, int serverfd, cha
 				goto begin_render;
 			}
 
-			hsapi::FullTitle meta;
-			if(R_FAILED(hsapi::title_meta(meta, id)))
-			{
-				ren.use("error-message", "failed to add title to queue");
-			}
-			else
-			{
-				status = 200;
-				queue_add(meta);
-				ren.use("title-name", meta.name);
-				ren.use("title-hshop-id", std::to_string(meta.id));
-			}
+			uint32_t cid = ctx->id;
+			ctx->waiting = true;
+			this->pool.submit([this, cid, id]() -> ctr::WorkerPool::done_type {
+				platform::Title meta;
+				bool ok = platform::title_meta(meta, id);
+				return [this, cid, ok, meta]() -> void {
+					if(ok)
+					{
+						platform::queue_add(meta);
+						this->broadcast_event(sse_event("queue", { { "queue", queue_json() } }));
+					}
+					hlink::HTTPRequestContext *ctx = (hlink::HTTPRequestContext *) this->find(cid);
+					if(ctx == nullptr) return;
+					ctx->waiting = false;
+
+					hlink::TemplRen ren;
+					size_t status = 500;
+					make_renderer(ren, status);
+					if(!ok)
+						ren.use("error-message", "failed to add title to queue");
+					else
+					{
+						status = 200;
+						ren.use("title-name", meta.name);
+						ren.use("title-hshop-id", std::to_string(meta.id));
+					}
+					finish_ctx(*ctx, ren, status);
+					this->serve_http(ctx);
+				};
+			});
+			return;
 		}
 
-		else if(ctx.path == "/launch.tpl")
+		else if(ctx->path == "/launch.tpl")
 		{
-			if(ctx.params.count("tid") == 0)
+			if(ctx->params.count("tid") == 0)
 			{
 				status = 400;
 				ren.use("error-message", "failed to find an \"tid\" parameter");
 				goto begin_render;
 			}
 			char *end;
-			const char *str = ctx.params["tid"].c_str();
-			hsapi::htid tid = strtoull(str, &end, 16);
+			const char *str = ctx->params["tid"].c_str();
+			uint64_t tid = strtoull(str, &end, 16);
 			if(str == end)
 			{
 				status = 400;
@@ -352,258 +1243,285 @@ static bool handle_http_request(hlink::HTTPRequestContext ctx, int serverfd, cha
 				goto begin_render;
 			}
 
-			FS_MediaType media = ctr::mediatype_of(tid);
-			if(!ctr::title_exists(tid, media))
+			if(!platform::title_exists(tid))
 			{
 				status = 400;
 				ren.use("error-message", "title doesn't exist");
 				goto begin_render;
 			}
 
-			ctr::TitleSMDH *smdh = ctr::smdh::get(tid);
-			if(!smdh)
+			std::string name;
+			if(!platform::title_name(tid, name))
 			{
 				status = 500;
 				ren.use("error-message", "failed to fetch SMDH");
 				goto begin_render;
 			}
-			ren.use("title-name", ctr::smdh::u16conv(
-				ctr::smdh::get_native_title(smdh)->descShort, 0x40));
-			delete smdh;
+			ren.use("title-name", name);
 
 			status = 200;
-			finish_ctx(ctx, ren, status);
-
-			close(serverfd);
-			ctx.server->close();
-			g_lock = false;
-
-			APT_PrepareToDoApplicationJump(0, tid, media);
-
-			u8 parambuf[0x300];
-			u8 hmacbuf[0x20];
-			APT_DoApplicationJump(parambuf, 0x300, hmacbuf);
-
-			// TODO: Fix SEGV
-
-			return true;
+			finish_ctx(*ctx, ren, status);
+			this->launch(ctx, tid);
+			return;
 		}
 
-		else if(ctx.path == "/sleep.tpl")
+		else if(ctx->path == "/sleep.tpl")
 		{
 			status = 200;
 			ren.use("sleep-amount-2", SLEEP_AMOUNT_S_PLUS_ONE);
 			ren.use("sleep-amount", SLEEP_AMOUNT_S);
-			finish_ctx(ctx, ren, status);
-			sleep(SLEEP_AMOUNT);
-			goto end_render_no_close;
+			this->sleep();
 		}
 
 		else
 		{
-			ctx.respond(500, "<!DOCTYPE html><html><body>this shouldn't happen (path=" + ctx.path + ")</body></html>", { { "Content-Type", "text/html" } });
+			ctx->respond(500, "<!DOCTYPE html><html><body>this shouldn't happen (path=" + ctx->path + ")</body></html>", { { "Content-Type", "text/html" } });
 			break;
 		}
 
 begin_render:
-		finish_ctx(ctx, ren, status);
-		goto end_render_no_close;
+		finish_ctx(*ctx, ren, status);
+		return;
 	}
 	}
 
-	ctx.close();
-end_render_no_close:
-	g_lock = false;
-	return false;
+	ctx->finish();
 }
 
-static bool isallowedtrust(struct sockaddr_in clientaddr, trust_store_t& truststore, std::function<bool(const std::string&)> on_requester)
+/* /events is a Server-Sent Events stream of the queue and background
+ * installs. It starts with a status event with everything, after that
+ * queue, progress and complete events follow as things change. Clients
+ * that fall behind don't receive events past events_backlog but get a
+ * new status event once they caught up, so they can't hold up anything */
+void EventLoop::open_events(hlink::HTTPRequestContext *ctx)
 {
-	if(truststore.count(clientaddr.sin_addr.s_addr) != 0 && !truststore[clientaddr.sin_addr.s_addr])
-		return false;
-
-	else if(truststore.count(clientaddr.sin_addr.s_addr) == 0)
-	{
-		const char *clientipaddr = inet_ntoa(clientaddr.sin_addr);
-		bool trusted = on_requester(clientipaddr);
-
-		truststore[clientaddr.sin_addr.s_addr] = trusted;
-		if(!trusted)
-		{
-			ilog("Adding %s as untrusted", clientipaddr);
-			return false;
-		}
-		ilog("Adding %s as trusted", clientipaddr);
-	}
-
-	return true;
+	ctx->keepAlive = false;
+	ctx->respond_chunked(200, { { "Content-Type", "text/event-stream" }, { "Cache-Control", "no-cache" } });
+	/* the stream is the body */
+	if(ctx->is_head())
+		return ctx->finish();
+	ctx->send_chunk("retry: 3000\n\n" + this->events_status());
+	ctx->eventStream = true;
 }
 
-static void handle_http(hlink::HTTPServer& serv, trust_store_t& truststore, int serverfd, ctr::reuse_thread<>& handleThread, bool& keepOpenSignal,
-	std::function<bool(const std::string&)> on_requester, std::function<void(const std::string&)> disp_req, std::function<void(const std::string&)> disp_error)
+bool EventLoop::has_event_clients()
 {
-	hlink::HTTPRequestContext ctx;
-	if(serv.make_reqctx(ctx) != 0)
-		return;
+	for(hlink::Connection *conn : this->conns)
+		if(conn->kind == hlink::Connection::http && ((hlink::HTTPRequestContext *) conn)->eventStream)
+			return true;
+	return false;
+}
 
-	if(g_lock)
+std::string EventLoop::events_status()
+{
+	json jobs = json::array();
+	platform::InstallService *bg = platform::installer(false);
+	if(bg != nullptr)
 	{
-		ctx.serve_path(429, "/busy.html", { });
-		ctx.close();
-		return;
+		platform::InstallService::Status status;
+		status.generation = 0;
+		bg->snapshot(status);
+		for(platform::InstallService::Job& job : status.jobs)
+			jobs.push_back(job_json(job));
 	}
+	return sse_event("status", { { "queue", queue_json() }, { "jobs", jobs } });
+}
 
-	g_lock = true;
-
-	if(!isallowedtrust(ctx.clientaddr, truststore, on_requester))
+void EventLoop::broadcast_event(const std::string& event)
+{
+	for(hlink::Connection *conn : this->conns)
 	{
-		ctx.serve_403();
-		ctx.close();
-		return;
+		if(conn->kind != hlink::Connection::http || conn->closing) continue;
+		hlink::HTTPRequestContext *ctx = (hlink::HTTPRequestContext *) conn;
+		if(!ctx->eventStream || ctx->eventsLagged) continue;
+		if(ctx->out.size() + event.size() > hlink::events_backlog)
+			ctx->eventsLagged = true;
+		else ctx->send_chunk(event);
 	}
-
-	/* we need to make a copy of ctx because else stack corruption */
-	handleThread.run([&ctx, serverfd, disp_req, disp_error, &keepOpenSignal]() -> void {
-		TIMER_START(http_request)
-		if(handle_http_request(ctx, serverfd, inet_ntoa(ctx.clientaddr.sin_addr), disp_req, disp_error))
-			keepOpenSignal = false;
-		TIMER_END(http_request)
-	});
 }
 
-static void handle_hlink(int serverfd, trust_store_t& truststore, hlink::HTTPServer& serv, ctr::reuse_thread<>& handleThread, bool& keepOpenSignal,
-	std::function<void(const std::string&)> disp_error, std::function<void(const std::string&)> disp_req, std::function<bool(const std::string&)> on_requester)
+/* turns changes of the background installs into events */
+void EventLoop::pump_events()
 {
-	struct sockaddr_in clientaddr;
-	socklen_t clientaddrlen = sizeof(clientaddr);
-	memset(&clientaddr, 0x0, sizeof(clientaddr));
-
-	// NOW we need to accept() our connection
-	int clientfd = accept(serverfd, (struct sockaddr *) &clientaddr, &clientaddrlen);
-
-	if(clientfd < 0)
+	if(!this->has_event_clients())
 	{
-		disp_error("accept(): " + std::string(strerror(errno)));
+		this->eventsPrimed = false;
 		return;
 	}
 
-	if(g_lock) // we can't have more than 2 connections, so we just say bAi
+	/* clients that fell behind start over once they caught up */
+	for(hlink::Connection *conn : this->conns)
 	{
-		send_response(clientfd, hlink::response::busy);
-		close(clientfd);
-		return;
+		if(conn->kind != hlink::Connection::http || conn->closing || conn->has_output()) continue;
+		hlink::HTTPRequestContext *ctx = (hlink::HTTPRequestContext *) conn;
+		if(ctx->eventStream && ctx->eventsLagged)
+		{
+			ctx->eventsLagged = false;
+			ctx->send_chunk(this->events_status());
+		}
 	}
 
-	if(!isallowedtrust(clientaddr, truststore, on_requester))
+	time_t t = time(NULL);
+	if(t - this->lastHeartbeat >= hlink::events_heartbeat)
 	{
-		send_response(clientfd, hlink::response::untrusted);
-		close(clientfd);
-		return;
+		this->broadcast_event(": keep-alive\n\n");
+		this->lastHeartbeat = t;
 	}
 
-	g_lock = true;
-	handleThread.run([clientfd, serverfd, &serv, clientaddr, disp_req, disp_error, &keepOpenSignal]() -> void {
-		TIMER_START(hlink_request)
-		if(handle_request(clientfd, serverfd, serv, inet_ntoa(clientaddr.sin_addr), disp_req, disp_error))
-			keepOpenSignal = false;
-		TIMER_END(hlink_request)
-	});
-}
-
-void hlink::create_server(
-		std::function<bool(const std::string&)> on_requester,
-		std::function<void(const std::string&)> disp_error,
-		std::function<void(const std::string&)> on_server_create,
-		std::function<bool()> on_poll_exit,
-		std::function<void(const std::string&)> disp_req
-	)
-{
-	int serverfd = -1;
-	if((serverfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
-	{
-		disp_error("socket(): " + std::string(strerror(errno)));
+	platform::InstallService *bg = platform::installer(false);
+	uint64_t now = platform::time_ms();
+	if(bg == nullptr || (this->eventsPrimed && now - this->lastEvents < (uint64_t) hlink::watch_interval))
 		return;
-	}
 
-	struct sockaddr_in servaddr;
-	memset(&servaddr, 0x0, sizeof(servaddr));
-	servaddr.sin_family = AF_INET; // IPv4 only (3ds doesn't support IPv6)
-	servaddr.sin_addr.s_addr = gethostid();
-	servaddr.sin_port = htons(hlink::port);
-
-	if(bind(serverfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0)
-	{
-		disp_error("bind(): " + std::string(strerror(errno)));
-		close(serverfd);
+	uint32_t generation = this->eventStatus.generation;
+	bg->snapshot(this->eventStatus);
+	if(this->eventsPrimed && generation == this->eventStatus.generation)
 		return;
-	}
 
-	if(listen(serverfd, hlink::backlog) < 0)
+	uint64_t elapsed = now - this->lastEvents;
+	std::unordered_map<uint32_t, EventJob> seen;
+	for(platform::InstallService::Job& job : this->eventStatus.jobs)
 	{
-		disp_error("listen(): " + std::string(strerror(errno)));
-		close(serverfd);
-		return;
-	}
+		seen[job.id] = { job.state, job.done };
+		/* new clients got everything in their status event */
+		if(!this->eventsPrimed) continue;
 
-	hlink::HTTPServer httpserv;
-	int res;
-	if((res = httpserv.make_fd()) != 0)
-	{
-		disp_error("httpserv.make_fd(): " + hlink::HTTPServer::errmsg(res));
-		close(serverfd);
-		return;
+		std::unordered_map<uint32_t, EventJob>::iterator it = this->eventJobs.find(job.id);
+		EventJob last = it == this->eventJobs.end() ? EventJob { install::JobState::queued, 0 } : it->second;
+		if(job_finished(job.state))
+		{
+			if(last.state != job.state)
+				this->broadcast_event(sse_event("complete", job_json(job)));
+		}
+		else if(last.state != job.state || last.done != job.done)
+		{
+			json progress = job_json(job);
+			progress["speed"] = elapsed != 0 && job.done > last.done ? (job.done - last.done) * 1000 / elapsed : 0;
+			this->broadcast_event(sse_event("progress", progress));
+		}
 	}
 
-	// Now we keep polling
-	constexpr size_t polls_len = 2;
-	struct pollfd serverpolls[polls_len];
-	serverpolls[0].fd = serverfd;
-	serverpolls[0].events = POLLIN;
-	serverpolls[1].fd = httpserv.fd;
-	serverpolls[1].events = POLLIN;
-
-	ctr::reuse_thread<> handleThread;
-	bool keepOpenSignal = true;
+	this->eventJobs.swap(seen);
+	this->eventsPrimed = true;
+	this->lastEvents = now;
+}
 
-	trust_store_t truststore;
+/* drops the output of conn and closes it as soon as possible */
+static void broken(hlink::Connection *conn)
+{
+	conn->drop_output();
+	conn->closing = true;
+}
 
-begin_loop:
-	/* if g_lock is set that thread may want to write already */
-	bool haveDispedServ = false;
-	if(!g_lock)
+/* closes connections that are done, broke or timed out */
+void EventLoop::reap()
+{
+	time_t now = time(NULL);
+	std::vector<hlink::Connection *> alive;
+	alive.reserve(this->conns.size());
+	for(hlink::Connection *conn : this->conns)
 	{
-		const char *ipaddr = inet_ntoa(servaddr.sin_addr);
-		on_server_create(ipaddr); // We might need to redraw the screen
-		haveDispedServ = true;
+		if((conn->closing && !conn->has_output() && !conn->busy())
+				|| (!conn->busy() && now - conn->lastActive > hlink::idle_timeout))
+			this->destroy(conn);
+		else alive.push_back(conn);
 	}
+	this->conns.swap(alive);
+}
 
-	while(keepOpenSignal && (g_lock || on_poll_exit()))
+void EventLoop::run()
+{
+	std::vector<struct pollfd> polls;
+	while(this->keepOpen && this->on_poll_exit())
 	{
-		if(!g_lock && !haveDispedServ)
+		if(this->redraw)
+		{
+			this->on_server_create(inet_ntoa(this->servaddr.sin_addr)); // We might need to redraw the screen
+			this->redraw = false;
+		}
+
+		/* a sleeping server only sends what it still has to send, new
+		 * clients wait in the backlog and input in the socket buffers.
+		 * A pending launch does the same until its response is out */
+		uint64_t now = platform::time_ms();
+		uint64_t wakeAt = this->launching() ? this->launchBy : this->sleepUntil;
+		bool sleeping = now < wakeAt;
+		polls.resize(2 + this->conns.size());
+		polls[0].fd = sleeping ? -1 : this->serverfd;
+		polls[0].events = POLLIN;
+		polls[0].revents = 0;
+		polls[1].fd = sleeping ? -1 : this->httpserv.fd;
+		polls[1].events = POLLIN;
+		polls[1].revents = 0;
+		for(size_t i = 0; i < this->conns.size(); ++i)
+		{
+			hlink::Connection *conn = this->conns[i];
+			/* broken but still waiting on a worker, poll() would keep reporting the hangup */
+			polls[i + 2].fd = conn->closing && !conn->has_output() ? -1 : conn->fd;
+			polls[i + 2].events = (conn->has_output() ? POLLOUT : 0)
+				| (conn->waiting || conn->closing || sleeping ? 0 : POLLIN);
+			polls[i + 2].revents = 0;
+		}
+
+		/* finished jobs are only picked up after poll() returns */
+		int timeout = this->installs.size() != 0 ? hlink::poll_timeout_install
+			: this->pool.pending() != 0 || this->watches.size() != 0 || this->eventsPrimed
+			? hlink::poll_timeout_busy : hlink::poll_timeout_idle;
+		if(sleeping && wakeAt - now < (uint64_t) timeout)
+			timeout = wakeAt - now;
+		int res = poll(polls.data(), polls.size(), timeout);
+		this->pool.collect();
+		this->pump_installs();
+		this->pump_watches();
+		this->pump_events();
+		if(!this->keepOpen) break;
+		if(res < 0)
+		{
+			this->disp_error("poll(): " + std::string(strerror(errno)));
+			break;
+		}
+
+		/* connections are only added after this loop so the indices stay valid */
+		size_t nconns = this->conns.size();
+		for(size_t i = 0; i < nconns && this->keepOpen; ++i)
 		{
-			const char *ipaddr = inet_ntoa(servaddr.sin_addr);
-			on_server_create(ipaddr); // We might need to redraw the screen
-			haveDispedServ = true;
+			hlink::Connection *conn = this->conns[i];
+			short revents = polls[i + 2].revents;
+			if(revents & (POLLERR | POLLHUP | POLLNVAL))
+				broken(conn);
+			else if((revents & POLLIN) && !this->on_readable(conn))
+				broken(conn);
+			if(this->keepOpen && conn->has_output() && !conn->flush())
+				broken(conn);
 		}
+		if(!this->keepOpen) break;
+
+		if(polls[0].revents & POLLIN)
+			this->accept_client(this->serverfd, hlink::Connection::transaction);
+		if(polls[1].revents & POLLIN)
+			this->accept_client(this->httpserv.fd, hlink::Connection::http);
+		this->reap();
 
-		if(poll(serverpolls, polls_len, 1000) == 0)
-			continue; // no events; we do nothing
-		haveDispedServ = false;
-		for(size_t i = 0; i < polls_len; ++i)
+		if(this->launching())
 		{
-			if(!(serverpolls[i].revents & POLLIN))
-				continue; /* this one doesn't have anything */
-			if(serverpolls[i].fd == httpserv.fd)
-				handle_http(httpserv, truststore, serverfd, handleThread, keepOpenSignal, on_requester, disp_req, disp_error);
-			else if(serverpolls[i].fd == serverfd)
-				handle_hlink(serverfd, truststore, httpserv, handleThread, keepOpenSignal, disp_error, disp_req, on_requester);
-			goto begin_loop; /* if we made it here we got a poll that needs updating */
+			/* a client that doesn't read its response only holds this up until launchBy */
+			hlink::Connection *conn = this->find(this->launchConn);
+			if(conn == nullptr || !conn->has_output() || platform::time_ms() >= this->launchBy)
+				this->finish_launch();
 		}
 	}
+}
 
-	httpserv.close();
-	close(serverfd);
-	g_lock = false;
-	return;
+void hlink::create_server(
+		std::function<bool(const std::string&)> on_requester,
+		std::function<void(const std::string&)> disp_error,
+		std::function<void(const std::string&)> on_server_create,
+		std::function<bool()> on_poll_exit,
+		std::function<void(const std::string&)> disp_req
+	)
+{
+	EventLoop loop(on_requester, disp_error, on_server_create, on_poll_exit, disp_req);
+	if(loop.setup())
+		loop.run();
 }
 
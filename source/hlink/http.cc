@@ -15,14 +15,18 @@
  * this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include "panic.hh"
 #include "log.hh"
 
+#include "hlink/platform.hh"
 #include "hlink/hlink.hh"
 #include "hlink/http.hh"
 
+#include <list>
+
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
@@ -30,6 +34,13 @@
 #include <fcntl.h>
 #include <poll.h>
 
+#include <ctype.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
 /* {{{1 Default status pages */
 void hlink::HTTPRequestContext::serve_400()
 {
@@ -52,6 +63,26 @@ void hlink::HTTPRequestContext::serve_400()
 	, { });
 }
 
+void hlink::HTTPRequestContext::serve_431()
+{
+	this->respond(431,
+		"<!DOCTYPE html>"
+		"<html>"
+			"<head>"
+				"<meta charset=\"utf-8\"/>"
+				"<title>hLink - Request Header Fields Too Large</title>"
+			"</head>"
+			"<body>"
+				"<center>"
+					"<h1>431 - Request Header Fields Too Large</h1>"
+					"<hr/>"
+					"<p>Your browser (?) sent more headers than the server can handle</p>"
+				"</center>"
+			"</body>"
+		"</html>"
+	, { });
+}
+
 void hlink::HTTPRequestContext::serve_403()
 {
 	this->respond(403,
@@ -116,12 +147,36 @@ void hlink::HTTPRequestContext::serve_500()
 }
 /* 1}}} */
 
-static std::unordered_map<std::string, std::string> file_cache;
+/* files that are read instead of sent straight from the file, the least
+ * recently used ones are dropped once they take up http_cache_size */
+typedef struct FileCacheEntry
+{
+	hlink::CachedFilePtr file;
+	std::list<std::string>::iterator lru;
+} FileCacheEntry;
+
+static std::unordered_map<std::string, FileCacheEntry> file_cache;
+static std::list<std::string> file_cache_lru; /* most recently used first */
+static size_t file_cache_bytes = 0;
+
+/* the part of the response to a static file that only depends on the file */
+typedef struct StaticFile
+{
+	std::string header; /* status line and headers except Connection and Cache-Control */
+	std::string fields; /* the headers of header after Content-Length, also sent with 206 */
+	std::string notmodified; /* the same for 304 Not Modified */
+	std::string etag;
+	std::string modified; /* Last-Modified, empty if the file has no timestamp */
+	uint64_t size;
+	time_t mtime;
+} StaticFile;
+
+static std::unordered_map<std::string, StaticFile> static_files;
 
 
 int hlink::HTTPServer::make_fd()
 {
-	panic_assert(this->fd == -1, "tried to re-create bound socket");
+	hlink_assert(this->fd == -1, "tried to re-create bound socket");
 
 	int serverfd = -1;
 	if((serverfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
@@ -130,7 +185,7 @@ int hlink::HTTPServer::make_fd()
 	struct sockaddr_in servaddr;
 	memset(&servaddr, 0x0, sizeof(servaddr));
 	servaddr.sin_family = AF_INET; // IPv4 only (3ds doesn't support IPv6)
-	servaddr.sin_addr.s_addr = gethostid();
+	servaddr.sin_addr.s_addr = hlink::platform::host_address();
 	servaddr.sin_port = htons(8000); /* can't bind on sub 1000 so no port 80 */
 
 	if(bind(serverfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0)
@@ -145,8 +200,10 @@ int hlink::HTTPServer::make_fd()
 		return errno;
 	}
 
-	this->root = "romfs:/public"; /* default root dir is romfs:/public/ */
+	this->root = hlink::platform::web_root(); /* romfs:/public/ on the 3ds */
 	this->fd = serverfd;
+	if(hlink::http_cache_warmup)
+		this->warm_cache();
 	return 0;
 }
 
@@ -157,18 +214,34 @@ std::string hlink::HTTPServer::errmsg(int code)
 
 void hlink::HTTPServer::close()
 {
-	panic_assert(this->fd != -1, "tried to close unbound socket");
+	hlink_assert(this->fd != -1, "tried to close unbound socket");
 	::close(this->fd);
 	this->fd = -1;
 }
 
 using hlink::HTTPRequestContext;
+using hlink::HTTPView;
 
 void hlink::HTTPRequestContext::close()
 {
-	panic_assert(this->fd != -1, "tried to close unbound context");
-	::close(this->fd);
-	this->fd = -1;
+	this->keepAlive = false;
+	this->closing = true;
+}
+
+void hlink::HTTPRequestContext::finish()
+{
+	if(!this->keepAlive)
+	{
+		this->closing = true;
+		return;
+	}
+
+	/* the rest of buf may already contain the next request */
+	this->headers.clear();
+	this->params.clear();
+	this->method.clear();
+	this->path.clear();
+	this->keepAlive = false;
 }
 
 void hlink::HTTPRequestContext::redirect(const std::string& location)
@@ -191,13 +264,13 @@ void hlink::HTTPRequestContext::respond_chunked(int status, HTTPHeaders headers)
 
 void hlink::HTTPRequestContext::respond(int status, const HTTPHeaders& headers)
 {
-	panic_assert(this->fd != -1, "tried to respond to unbound context");
+	hlink_assert(this->fd != -1, "tried to respond to unbound context");
 	const char *msg = nullptr;
 	switch(status)
 	{
 	case 100: msg = "Continue"; break;
 	case 101: msg = "Switching Protocols"; break;
-	case 102: panic("102 Processing -- is invalid");
+	case 102: hlink_panic("102 Processing -- is invalid");
 	case 103: msg = "Early Hints"; break;
 	case 200: msg = "OK"; break;
 	case 201: msg = "Created"; break;
@@ -206,9 +279,9 @@ void hlink::HTTPRequestContext::respond(int status, const HTTPHeaders& headers)
 	case 204: msg = "No Content"; break;
 	case 205: msg = "Reset Content"; break;
 	case 206: msg = "Partial Content"; break;
-	case 207: panic("207 Multi-Status -- is invalid");
-	case 208: panic("208 Already Reported -- is invalid");
-	case 226: panic("226 IM Used -- is invalid");
+	case 207: hlink_panic("207 Multi-Status -- is invalid");
+	case 208: hlink_panic("208 Already Reported -- is invalid");
+	case 226: hlink_panic("226 IM Used -- is invalid");
 	case 300: msg = "Multiple Choice"; break;
 	case 301: msg = "Moved Permanently"; break;
 	case 302: msg = "Found"; break;
@@ -219,7 +292,7 @@ void hlink::HTTPRequestContext::respond(int status, const HTTPHeaders& headers)
 	case 308: msg = "Permanent Redirect"; break;
 	case 400: msg = "Bad Request"; break;
 	case 401: msg = "Unauthorized"; break;
-	case 402: panic("402 Payment Required -- is invalid");
+	case 402: hlink_panic("402 Payment Required -- is invalid");
 	case 403: msg = "Forbidden"; break;
 	case 404: msg = "Not Found"; break;
 	case 405: msg = "Method Not Allowed"; break;
@@ -237,9 +310,9 @@ void hlink::HTTPRequestContext::respond(int status, const HTTPHeaders& headers)
 	case 417: msg = "Expectation Failed"; break;
 	case 418: msg = "I'm a teapot"; break;
 	case 421: msg = "Misdirected Request"; break;
-	case 422: panic("422 Unprocessable Entity -- is invalid");
-	case 423: panic("423 Locked -- is invalid");
-	case 424: panic("424 Failed Dependency -- is invalid");
+	case 422: hlink_panic("422 Unprocessable Entity -- is invalid");
+	case 423: hlink_panic("423 Locked -- is invalid");
+	case 424: hlink_panic("424 Failed Dependency -- is invalid");
 	case 425: msg = "Too Early"; break;
 	case 426: msg = "Upgrade Required"; break;
 	case 428: msg = "Precondition Required"; break;
@@ -253,113 +326,412 @@ void hlink::HTTPRequestContext::respond(int status, const HTTPHeaders& headers)
 	case 504: msg = "Gateway Timeout"; break;
 	case 505: msg = "HTTP Version Not Supported"; break;
 	case 506: msg = "Variant Also Negotiates"; break;
-	case 507: panic("507 Insufficient Storage -- is invalid");
-	case 508: panic("508 Loop Detected -- is invalid");
+	case 507: hlink_panic("507 Insufficient Storage -- is invalid");
+	case 508: hlink_panic("508 Loop Detected -- is invalid");
 	case 510: msg = "Not Extended"; break;
 	case 511: msg = "Network Authentication Required"; break;
-	default: panic(std::to_string(status) + " (unknown) -- is invalid");
+	default: hlink_panic(std::to_string(status) + " (unknown) -- is invalid");
 	}
 
-	std::string body = "HTTP/1.1 " + std::to_string(status) + " " + msg + "\r\n";
+	/* written straight into the output, the body follows in the same buffer */
+	std::string& out = this->out.tail();
+	out += "HTTP/1.1 ";
+	out += std::to_string(status);
+	out += ' ';
+	out += msg;
+	out += "\r\n";
 	using Iterator = hlink::HTTPHeaders::const_iterator;
 	for(Iterator it = headers.begin(); it != headers.end(); ++it)
-		body += it->first + ": " + it->second + "\r\n";
-	body += "\r\n";
+	{
+		out += it->first;
+		out += ": ";
+		out += it->second;
+		out += "\r\n";
+	}
+	this->end_header(out);
+}
 
-	this->send(body);
+void hlink::HTTPRequestContext::end_header(std::string& header)
+{
+	if(this->keepAlive)
+	{
+		header += "Connection: keep-alive\r\nKeep-Alive: timeout=";
+		header += std::to_string(hlink::idle_timeout);
+		header += ", max=";
+		header += std::to_string(hlink::http_max_requests - this->requests);
+		header += "\r\n";
+	}
+	else header += "Connection: close\r\n";
+	header += "\r\n";
 }
 
 void hlink::HTTPRequestContext::send_chunk(const std::string& data)
 {
-	panic_assert(this->fd != -1, "tried to send chunk to unbound context");
-	char hexbuf[17]; /* max is FFFFFFFFFFFFFFFF which is 16 chars */
-	snprintf(hexbuf, sizeof(hexbuf), "%16X", data.size());
-	std::string rdata = std::string(hexbuf) + "\r\n" + data;
-	this->send(rdata);
+	hlink_assert(this->fd != -1, "tried to send chunk to unbound context");
+	if(this->is_head()) return;
+	char hexbuf[19]; /* max is FFFFFFFFFFFFFFFF\r\n which is 18 chars */
+	int len = snprintf(hexbuf, sizeof(hexbuf), "%zX\r\n", data.size());
+	std::string& out = this->out.tail();
+	out.append(hexbuf, len);
+	out += data;
+	out += "\r\n";
 }
 
 void hlink::HTTPRequestContext::send(const std::string& data)
 {
-	panic_assert(this->fd != -1, "tried to send to unbound context");
-	::send(this->fd, data.c_str(), data.size(), 0);
+	hlink_assert(this->fd != -1, "tried to send to unbound context");
+	if(this->is_head()) return;
+	this->out.append(data);
+}
+
+/* opens a file to serve, serves an error page and returns -1 on failure */
+static int open_served(hlink::HTTPRequestContext& ctx, const std::string& fname, struct stat& st)
+{
+	int file = open(fname.c_str(), O_RDONLY);
+	if(file >= 0 && fstat(file, &st) == 0)
+		return file;
+
+	int err = errno;
+	if(file >= 0) ::close(file);
+	switch(err)
+	{
+	case ENOENT: /* 404 not found */
+		ctx.serve_404(fname);
+		break;
+	default: /* 500 internal server error */
+		elog("Failed to open file %s, errno=%i: %s", fname.c_str(), err, strerror(err));
+		ctx.serve_500();
+		break;
+	}
+	return -1;
 }
 
-void hlink::HTTPRequestContext::serve_file(int status, const std::string& fname, HTTPHeaders headers)
+/* Parses a Range header for a file of size bytes. Returns 1 and sets first and last
+ * (inclusive) for one satisfiable range, -1 if no range is satisfiable and 0 if the
+ * header should be ignored, that is it's invalid or asks for several ranges */
+static int parse_range(const std::string& header, uint64_t size, uint64_t& first, uint64_t& last)
 {
-	FILE *f = fopen(fname.c_str(), "r");
-	if(f == nullptr)
+	if(header.compare(0, 6, "bytes=") != 0 || header.find(',') != std::string::npos)
+		return 0;
+	const char *spec = header.c_str() + 6;
+	while(*spec == ' ' || *spec == '\t') ++spec;
+	if(!isdigit(*spec) && *spec != '-') return 0;
+
+	char *end;
+	if(*spec == '-')
+	{
+		/* bytes=-N is the last N bytes */
+		if(!isdigit(spec[1])) return 0;
+		uint64_t suffix = strtoull(spec + 1, &end, 10);
+		if(suffix == 0 || size == 0) return -1;
+		first = suffix < size ? size - suffix : 0;
+		last = size - 1;
+	}
+	else
 	{
-		switch(errno)
+		first = strtoull(spec, &end, 10);
+		if(*end++ != '-') return 0;
+		if(isdigit(*end))
 		{
-		case ENOENT: /* 404 not found */
-			this->serve_404(fname);
-			return;
-		default: /* 500 internal server error */
-			elog("Failed to open file %s, errno=%i: %s", fname.c_str(), errno, strerror(errno));
-			this->serve_500();
-			return;
+			last = strtoull(end, &end, 10);
+			if(last < first) return 0;
+			if(last >= size) last = size - 1;
 		}
+		else last = size - 1;
+		if(first >= size) return -1;
 	}
+	while(*end == ' ' || *end == '\t') ++end;
+	return *end == '\0' ? 1 : 0;
+}
 
-	size_t total, sent = 0;
+/* appends the status line and Content-Range of a 206 or 416 response to header */
+static void range_header(std::string& header, int res, uint64_t first, uint64_t last, uint64_t size)
+{
+	char buf[128];
+	if(res > 0)
+		snprintf(buf, sizeof(buf), "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %llu-%llu/%llu\r\nContent-Length: %llu\r\n",
+			(unsigned long long) first, (unsigned long long) last, (unsigned long long) size,
+			(unsigned long long) (last - first + 1));
+	else
+		snprintf(buf, sizeof(buf), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%llu\r\nContent-Length: 0\r\n",
+			(unsigned long long) size);
+	header += buf;
+}
 
-	fseek(f, 0, SEEK_END);
-	total = ftell(f);
-	headers["Content-Length"] = std::to_string(total);
-	fseek(f, 0, SEEK_SET);
-	this->respond(status, headers);
+/* strong ETag of the contents of a file, FNV-1a 64 */
+static bool file_etag(int file, uint64_t size, std::string& ret)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	char buf[4096];
+	for(uint64_t off = 0; off < size; )
+	{
+		ssize_t bread = pread(file, buf, sizeof(buf), off);
+		if(bread <= 0) return false;
+		for(ssize_t i = 0; i < bread; ++i)
+			hash = (hash ^ (uint8_t) buf[i]) * 0x100000001B3ULL;
+		off += bread;
+	}
+
+	char etag[24];
+	snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long) hash);
+	ret = etag;
+	return true;
+}
+
+/* returns whether an If-None-Match header lists etag, the
+ * comparison is weak as it should be for If-None-Match */
+static bool etag_matches(const std::string& header, const std::string& etag)
+{
+	size_t pos = 0;
+	while(pos < header.size())
+	{
+		size_t end = header.find(',', pos);
+		if(end == std::string::npos) end = header.size();
+		size_t first = header.find_first_not_of(" \t", pos);
+		size_t last = header.find_last_not_of(" \t", end - 1);
+		pos = end + 1;
+		if(first == std::string::npos || first > last)
+			continue;
+
+		std::string tag = header.substr(first, last - first + 1);
+		if(tag == "*") return true;
+		if(tag.compare(0, 2, "W/") == 0) tag.erase(0, 2);
+		if(tag == etag) return true;
+	}
+	return false;
+}
+
+void hlink::HTTPRequestContext::serve_static(const std::string& fname, const HTTPHeaders& headers)
+{
+	struct stat st;
+	int file = open_served(*this, fname, st);
+	if(file < 0) return;
 
-	char buf[4098];
-	while(sent != total)
+	/* romfs doesn't change while running, so this is hashed once */
+	StaticFile& cached = static_files[fname];
+	if(cached.header.empty() || cached.size != (uint64_t) st.st_size || cached.mtime != st.st_mtime)
 	{
-		size_t toSend = fread(buf, 1, sizeof(buf), f);
-		::send(this->fd, buf, toSend, 0);
-		sent += toSend;
+		if(!file_etag(file, st.st_size, cached.etag))
+		{
+			elog("Failed to read file %s, errno=%i: %s", fname.c_str(), errno, strerror(errno));
+			static_files.erase(fname);
+			::close(file);
+			return this->serve_500();
+		}
+
+		/* 304 only repeats what caches need to update their copy */
+		cached.notmodified = "HTTP/1.1 304 Not Modified\r\nETag: " + cached.etag + "\r\n";
+		cached.fields = "Accept-Ranges: bytes\r\nETag: " + cached.etag + "\r\n";
+		cached.modified.clear();
+		if(st.st_mtime != 0) /* romfs has no timestamps */
+		{
+			char date[64];
+			struct tm tm;
+			strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&st.st_mtime, &tm));
+			cached.modified = date;
+			cached.fields += "Last-Modified: " + cached.modified + "\r\n";
+		}
+		for(const auto& header : headers)
+		{
+			cached.fields += header.first + ": " + header.second + "\r\n";
+			if(header.first == "Vary")
+				cached.notmodified += header.first + ": " + header.second + "\r\n";
+		}
+		cached.header = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(st.st_size)
+			+ "\r\n" + cached.fields;
+		cached.size = st.st_size;
+		cached.mtime = st.st_mtime;
 	}
 
-	fclose(f);
+	const HTTPView *inm = this->headers.get("if-none-match");
+	bool modified = inm == nullptr || !etag_matches(inm->str(), cached.etag);
+	uint64_t first = 0, last = 0;
+	int res = modified && this->is_get() && this->range_applies(cached.etag, cached.modified)
+		? parse_range(this->headers.get("range")->str(), st.st_size, first, last) : 0;
+
+	std::string& header = this->out.tail();
+	if(res != 0)
+	{
+		range_header(header, res, first, last, st.st_size);
+		if(res > 0) header += cached.fields;
+	}
+	else header += modified ? cached.header : cached.notmodified;
+	/* a ?v=... parameter marks a versioned url, its content never changes */
+	header += this->params.count("v")
+		? "Cache-Control: public, max-age=31536000, immutable\r\n"
+		: "Cache-Control: no-cache\r\n";
+	this->end_header(header);
+
+	if(this->is_head()) ::close(file);
+	else if(res > 0) this->out.append_file(file, first, last - first + 1);
+	else if(res == 0 && modified) this->out.append_file(file, 0, st.st_size);
+	else ::close(file);
+}
+
+/* If-Range only lets the range through if the file is still the one the client
+ * has part of, an ETag must match strongly and a date exactly */
+bool hlink::HTTPRequestContext::range_applies(const std::string& etag, const std::string& modified)
+{
+	if(!this->headers.has("range")) return false;
+	const HTTPView *cond = this->headers.get("if-range");
+	if(cond == nullptr) return true;
+	std::string val = cond->str();
+	if(val.size() != 0 && val[0] == '"') return val == etag;
+	return modified.size() != 0 && val == modified;
 }
 
 void hlink::HTTPRequestContext::serve_path(int status, const std::string& path, HTTPHeaders headers)
 {
 	this->path = path; /* sneaky */
-	std::string content;
-	this->read_path_content(content);
-	this->respond(status, content, headers);
+	hlink::CachedFilePtr file = this->read_path_content();
+	if(file == nullptr)
+		return this->respond(status, "", headers);
+
+	headers["Content-Type"] = file->type;
+	headers["Content-Length"] = file->length;
+	this->respond(status, headers);
+	/* the cached buffer is sent as is, it lives until it's sent */
+	if(!this->is_head())
+		this->out.append_shared(file, file->data.data(), file->data.size());
+}
+
+static const char *content_type(const std::string& fname)
+{
+	static const struct { const char *ext; const char *type; } types[] = {
+		{ ".html", "text/html" },
+		{ ".tpl",  "text/html" }, /* only ever sent rendered */
+		{ ".css",  "text/css" },
+		{ ".js",   "application/javascript" },
+		{ ".json", "application/json" },
+		{ ".txt",  "text/plain" },
+		{ ".png",  "image/png" },
+		{ ".svg",  "image/svg+xml" },
+		{ ".ico",  "image/x-icon" },
+	};
+	for(const auto& type : types)
+	{
+		size_t len = strlen(type.ext);
+		if(fname.size() >= len && fname.compare(fname.size() - len, len, type.ext) == 0)
+			return type.type;
+	}
+	return "application/octet-stream";
 }
 
-void hlink::HTTPRequestContext::read_path_content(std::string& buf)
+static hlink::CachedFilePtr read_cached(const std::string& root, const std::string& path)
 {
-	auto it = file_cache.find(this->path);
+	auto it = file_cache.find(path);
 	if(it != file_cache.end())
 	{
-		buf = it->second;
-		return;
+		file_cache_lru.splice(file_cache_lru.begin(), file_cache_lru, it->second.lru);
+		return it->second.file;
 	}
 
-	FILE *f = fopen((this->server->root + this->path).c_str(), "r");
-	if(f == nullptr) return;
+	int fd = open((root + path).c_str(), O_RDONLY);
+	if(fd < 0) return nullptr;
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		return nullptr;
+	}
 
-	size_t total, i = 0;
-	fseek(f, 0, SEEK_END);
-	total = ftell(f);
-	fseek(f, 0, SEEK_SET);
+	std::shared_ptr<hlink::CachedFile> file = std::make_shared<hlink::CachedFile>();
+	file->data.resize(st.st_size);
+	size_t total = 0;
+	ssize_t bread = 0;
+	while(total < file->data.size() && (bread = read(fd, &file->data[total], file->data.size() - total)) > 0)
+		total += bread;
+	::close(fd);
+	if(bread < 0) return nullptr;
+	file->data.resize(total); /* it may have shrunk */
+	file->type = content_type(path);
+	file->length = std::to_string(total);
+
+	/* files larger than the cache are only used once */
+	if(total > hlink::http_cache_size)
+		return file;
+	while(file_cache_bytes + total > hlink::http_cache_size)
+	{
+		auto victim = file_cache.find(file_cache_lru.back());
+		file_cache_bytes -= victim->second.file->data.size();
+		file_cache.erase(victim);
+		file_cache_lru.pop_back();
+	}
+	file_cache_lru.push_front(path);
+	file_cache[path] = { file, file_cache_lru.begin() };
+	file_cache_bytes += total;
+	return file;
+}
 
-	char cbuf[4098];
-	while(i != total)
+hlink::CachedFilePtr hlink::HTTPRequestContext::read_path_content()
+{
+	return read_cached(this->server->root, this->path);
+}
+
+void hlink::HTTPServer::warm_cache()
+{
+	DIR *dir = opendir(this->root.c_str());
+	if(dir == nullptr) return;
+	struct dirent *ent;
+	while((ent = readdir(dir)) != nullptr)
 	{
-		size_t r = fread(cbuf, 1, sizeof(buf), f);
-		buf += std::string(cbuf, r);
-		i += r;
+		std::string name = ent->d_name;
+		if(name == "busy.html" || (name.size() > 4 && name.compare(name.size() - 4, 4, ".tpl") == 0))
+			read_cached(this->root, "/" + name);
 	}
+	closedir(dir);
+	dlog("(HTTP) Cached %zu bytes of %zu files", file_cache_bytes, file_cache.size());
+}
 
-	fclose(f);
-	file_cache[this->path] = buf;
+/* returns whether an Accept-Encoding header allows gzip */
+static bool accepts_gzip(const std::string& accept)
+{
+	bool wildcard = false;
+	size_t pos = 0;
+	while(pos < accept.size())
+	{
+		size_t end = accept.find(',', pos);
+		if(end == std::string::npos) end = accept.size();
+		std::string coding = accept.substr(pos, end - pos);
+		pos = end + 1;
+
+		/* "gzip;q=0" means not gzip */
+		bool allowed = true;
+		size_t params = coding.find(';');
+		if(params != std::string::npos)
+		{
+			size_t q = coding.find("q=", params);
+			if(q != std::string::npos)
+				allowed = strtod(coding.c_str() + q + 2, nullptr) > 0;
+			coding.resize(params);
+		}
+		size_t first = coding.find_first_not_of(" \t");
+		size_t last = coding.find_last_not_of(" \t");
+		coding = first == std::string::npos ? "" : coding.substr(first, last - first + 1);
+
+		if(coding == "gzip" || coding == "x-gzip")
+			return allowed;
+		if(coding == "*")
+			wildcard = allowed;
+	}
+	return wildcard;
 }
 
+/* static pages may have a gzip'd variant next to them that is generated
+ * when building, it's served to clients that accept it */
 void hlink::HTTPRequestContext::serve_plain()
 {
-	this->serve_file(200, this->server->root + this->path, { });
+	std::string fname = this->server->root + this->path;
+	std::string gzname = fname + ".gz";
+	const char *type = content_type(fname);
+	if(access(gzname.c_str(), R_OK) != 0)
+		return this->serve_static(fname, { { "Content-Type", type } });
+
+	const HTTPView *accept = this->headers.get("accept-encoding");
+	if(accept != nullptr && accepts_gzip(accept->str()))
+		this->serve_static(gzname, { { "Content-Type", type }, { "Content-Encoding", "gzip" }, { "Vary", "Accept-Encoding" } });
+	else
+		this->serve_static(fname, { { "Content-Type", type }, { "Vary", "Accept-Encoding" } });
 }
 
 static bool isdir(const std::string& str)
@@ -404,63 +776,26 @@ static void realize_offset(HTTPRequestContext& ctx, size_t offset)
 	ctx.buflen -= offset;
 }
 
-static char *bufstrstr(char *buf, size_t len, const char *str)
+bool hlink::HTTPView::operator == (const char *other) const
 {
-	size_t lstr = strlen(str);
-	if(len >= lstr) len -= lstr - 1;
-	else return nullptr;
-
-	for(size_t i = 0; i < len; ++i)
-	{
-		if(strncmp(buf + i, str, lstr) == 0)
-			return buf + i;
-	}
-
-	return nullptr;
+	return strlen(other) == this->len && memcmp(this->data, other, this->len) == 0;
 }
 
-static char *bufstrchr(char *buf, size_t len, char chr)
+bool hlink::HTTPView::contains(const char *needle) const
 {
-	for(size_t i = 0; i < len; ++i)
-		if(buf[i] == chr) return buf + i;
-	return nullptr;
+	size_t nlen = strlen(needle);
+	for(size_t i = 0; i + nlen <= this->len; ++i)
+		if(strncasecmp(this->data + i, needle, nlen) == 0)
+			return true;
+	return false;
 }
 
-static char *bufstrnl(char *buf, size_t len)
+const hlink::HTTPView *hlink::HTTPRequestHeaders::get(const char *name) const
 {
-	char *ret;
-	if((ret = bufstrstr(buf, len, "\r\n")) != nullptr)
-		return ret;
-	return bufstrchr(buf, len, '\n');
-}
-
-static ssize_t bufstrchrof(char *buf, size_t len, char chr)
-{
-	char *r = bufstrchr(buf, len, chr);
-	if(r == nullptr) return -1;
-	return r - buf;
-}
-
-static ssize_t bufstrnlof(char *buf, size_t len)
-{
-	char *r = bufstrnl(buf, len);
-	if(r == nullptr) return -1;
-	return r - buf;
-}
-
-static int bufnllen(char *buf, size_t len)
-{
-	if(len > 0)
-	{
-		if(len > 1)
-		{
-			// check for \r\n
-			if(*buf == '\r' && *(buf + 1) == '\n')
-				return 2;
-		}
-		return *buf == '\n' ? 1 : 0;
-	}
-	return 0;
+	for(const Header& header : this->headers)
+		if(header.name == name)
+			return &header.value;
+	return nullptr;
 }
 
 static void normalize_path(std::string& path)
@@ -470,36 +805,13 @@ static void normalize_path(std::string& path)
 		path.erase(path.begin() + pos);
 }
 
-/* returns 0 on finish, 1 if we need more data, 2 = parse success, -1 on error */
-static int parse_header(HTTPRequestContext& ctx)
+/* returns whether path has a .. segment, which could escape the web root */
+static bool has_dotdot(const std::string& path)
 {
-	ssize_t of = bufstrnlof(ctx.buf, ctx.buflen);
-	if(of == -1) return 1; /* need more data */
-	if(of == 0) /* we ended on (\r)\n! */
-	{
-		realize_offset(ctx, bufnllen(ctx.buf, ctx.buflen));
-		return 0; /* finished */
-	}
-
-	/* we need to parse an actual header ... */
-	char nlchr = ctx.buf[of + 1];
-	ctx.buf[of + 1] = '\0'; /* override the \r or \n with a \0 to make a real string */
-
-	char *namesep = strstr(ctx.buf, ": ");
-	if(namesep == nullptr) return -1; /* error */
-	size_t len = namesep - ctx.buf;
-	if(len == 0) return -1; /* error: ": \r\n" */
-
-	std::string name  = std::string(ctx.buf, len);
-	std::string value = std::string(ctx.buf + len + 2, of - len - 2);
-	lower(name);
-	ctx.headers[name] = value;
-
-	vlog("(HTTP) Parsed header |%s|: |%s|", name.c_str(), value.c_str());
-
-	ctx.buf[of + 1] = nlchr;
-	realize_offset(ctx, of + bufnllen(ctx.buf + of, ctx.buflen - of));
-	return 2; /* success! */
+	for(size_t pos = 0; (pos = path.find("..", pos)) != std::string::npos; pos += 2)
+		if((pos == 0 || path[pos - 1] == '/') && (pos + 2 == path.size() || path[pos + 2] == '/'))
+			return true;
+	return false;
 }
 
 static inline void between(std::string& dst, const std::string& src,
@@ -533,66 +845,159 @@ static void parse_url_params(std::string& path, hlink::HTTPParameters& params)
 	path.erase(question, std::string::npos);
 }
 
-int hlink::HTTPServer::make_reqctx(HTTPRequestContext& ctx)
+enum parse_state
 {
-	panic_assert(this->fd != -1, "Tried to make a request on an unbound context");
-	ctx.server = this;
-	ctx.iseof = false;
-	ctx.buflen = 0;
-
-	ssize_t len;
-	memset(&ctx.clientaddr, 0x0, sizeof(ctx.clientaddr));
-	socklen_t clientaddr_len = sizeof(ctx.clientaddr);
-	if((ctx.fd = accept(this->fd, (struct sockaddr *) &ctx.clientaddr, &clientaddr_len)) < 0)
-		return errno;
-
-	if((len = recv(ctx.fd, ctx.buf, sizeof(ctx.buf), 0)) < 0)
-	{ ctx.serve_400(); ctx.close(); return errno; }
-	ctx.buflen = len;
-
-	ssize_t of;
-	if((of = bufstrchrof(ctx.buf, ctx.buflen, ' ')) < 1)
-	{ ctx.serve_400(); ctx.close(); return -1; }
+	ps_start,        /* empty lines before the request line are skipped */
+	ps_method,
+	ps_target,
+	ps_version,
+	ps_line_lf,      /* \r at the end of a line */
+	ps_header_start, /* a header name or the empty line that ends the request */
+	ps_name,
+	ps_value_ws,     /* whitespace before the value */
+	ps_value,
+	ps_end_lf,       /* \r of the empty line */
+	ps_done,
+};
 
-	ctx.method = std::string(ctx.buf, of);
-	realize_offset(ctx, of + 1);
-	lower(ctx.method);
-
-	if((of = bufstrchrof(ctx.buf, ctx.buflen, ' ')) < 1)
-	{ ctx.serve_400(); ctx.close(); return -1; }
-
-	ctx.path = std::string(ctx.buf, of);
-	realize_offset(ctx, of + 1);
-	normalize_path(ctx.path);
-	parse_url_params(ctx.path, ctx.params);
-
-	if((of = bufstrnlof(ctx.buf, ctx.buflen)) < 1)
-	{ ctx.serve_400(); ctx.close(); return -1; }
-	/* we don't care about the version */
-	realize_offset(ctx, of + bufnllen(ctx.buf + of, ctx.buflen - of));
+/* characters allowed in methods and header names (RFC 9110 tchar) */
+static inline bool is_tchar(uint8_t c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+		|| (c != 0 && strchr("!#$%&'*+-.^_`|~", c) != nullptr);
+}
 
-	vlog("(HTTP) Parsed request line; method=%s,path=%s", ctx.method.c_str(), ctx.path.c_str());
+int hlink::HTTPServer::parse_request(HTTPRequestContext& ctx)
+{
+	hlink_assert(this->fd != -1, "Tried to make a request on an unbound context");
+	ctx.server = this;
 
-	/* parse headers */
-	int res;
-	while(true)
+	/* the previous request was kept until now because its headers point into buf */
+	if(ctx.pstate == ps_done)
 	{
-		while((res = parse_header(ctx)) == 2) continue; /* while parse_success */
-		if(ctx.iseof) res = -1;
-		if(res != 1) break; /* if not need_more_data */ 
-
-		/* refill buffer */
-		if((len = recv(ctx.fd, ctx.buf + ctx.buflen, sizeof(ctx.buf) - ctx.buflen, 0)) < 0)
-		{ ctx.serve_400(); ctx.close(); return errno; }
-		ctx.iseof = len == 0;
-		ctx.buflen += len;
+		realize_offset(ctx, ctx.pscan);
+		ctx.headers.clear();
+		ctx.pstate = ps_start;
+		ctx.pscan = 0;
 	}
 
-	if(res != 0)
+	char *buf = ctx.buf;
+	int state = ctx.pstate;
+	size_t i = ctx.pscan;
+	for(; i < ctx.buflen && state != ps_done; ++i)
 	{
-		ctx.serve_400();
-		ctx.close();
+		uint8_t c = buf[i];
+		switch(state)
+		{
+		case ps_start:
+			if(c == '\r' || c == '\n') break;
+			if(!is_tchar(c)) return -1;
+			ctx.ptoken = i;
+			state = ps_method;
+			break;
+		case ps_method:
+			if(c == ' ')
+			{
+				ctx.method.assign(buf + ctx.ptoken, i - ctx.ptoken);
+				hlink::platform::lower(ctx.method);
+				ctx.ptoken = i + 1;
+				state = ps_target;
+			}
+			else if(!is_tchar(c)) return -1;
+			break;
+		case ps_target:
+			if(c == ' ')
+			{
+				if(i == ctx.ptoken) return -1;
+				ctx.path.assign(buf + ctx.ptoken, i - ctx.ptoken);
+				ctx.ptoken = i + 1;
+				state = ps_version;
+			}
+			else if(c <= ' ' || c == 0x7F) return -1;
+			break;
+		case ps_version:
+			if(c == '\r' || c == '\n')
+			{
+				ctx.pversion = { buf + ctx.ptoken, i - ctx.ptoken };
+				if(ctx.pversion.len != 8 || memcmp(ctx.pversion.data, "HTTP/1.", 7) != 0)
+					return -1;
+				state = c == '\r' ? ps_line_lf : ps_header_start;
+			}
+			else if(c <= ' ' || c == 0x7F) return -1;
+			break;
+		case ps_line_lf:
+			if(c != '\n') return -1;
+			state = ps_header_start;
+			break;
+		case ps_header_start:
+			if(c == '\r') state = ps_end_lf;
+			else if(c == '\n') state = ps_done;
+			else if(is_tchar(c))
+			{
+				/* lowercased in place so the headers don't need copies */
+				if(c >= 'A' && c <= 'Z') buf[i] = c | 0x20;
+				ctx.ptoken = i;
+				state = ps_name;
+			}
+			else return -1; /* this includes obsolete line folding */
+			break;
+		case ps_name:
+			if(c == ':')
+			{
+				if(ctx.headers.size() == hlink::http_max_headers)
+					return -2;
+				ctx.pname = { buf + ctx.ptoken, i - ctx.ptoken };
+				state = ps_value_ws;
+			}
+			else if(c >= 'A' && c <= 'Z') buf[i] = c | 0x20;
+			else if(!is_tchar(c)) return -1;
+			break;
+		case ps_value_ws:
+			if(c == ' ' || c == '\t') break;
+			ctx.ptoken = i;
+			state = ps_value;
+			/* fallthrough */
+		case ps_value:
+			if(c == '\r' || c == '\n')
+			{
+				size_t end = i;
+				while(end > ctx.ptoken && (buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+					--end;
+				ctx.headers.add(ctx.pname, { buf + ctx.ptoken, end - ctx.ptoken });
+				vlog("(HTTP) Parsed header |%.*s|: |%.*s|", (int) ctx.pname.len, ctx.pname.data,
+					(int) (end - ctx.ptoken), buf + ctx.ptoken);
+				state = c == '\r' ? ps_line_lf : ps_header_start;
+			}
+			else if((c < ' ' && c != '\t') || c == 0x7F) return -1;
+			break;
+		case ps_end_lf:
+			if(c != '\n') return -1;
+			state = ps_done;
+			break;
+		}
 	}
-	return res; /* eof before parse_header() = bad */
-}
 
+	ctx.pstate = state;
+	ctx.pscan = i;
+	if(state != ps_done)
+		return ctx.buflen == sizeof(ctx.buf) ? -2 : 1;
+
+	normalize_path(ctx.path);
+	parse_url_params(ctx.path, ctx.params);
+	vlog("(HTTP) Parsed request; method=%s,path=%s", ctx.method.c_str(), ctx.path.c_str());
+	if(has_dotdot(ctx.path))
+		return -3;
+
+	/* HTTP/1.1 connections are persistent unless the client says otherwise,
+	 * HTTP/1.0 clients have to ask for it. Request bodies are never read so
+	 * a request with a body can't be followed by another one */
+	const HTTPView *connection = ctx.headers.get("connection");
+	const HTTPView *length = ctx.headers.get("content-length");
+	/* the value is followed by the line ending, so strtoull() stops there */
+	bool hasBody = length != nullptr && strtoull(length->data, nullptr, 10) != 0;
+	ctx.keepAlive = ++ctx.requests < hlink::http_max_requests && !hasBody
+		&& !ctx.headers.has("transfer-encoding")
+		&& (ctx.pversion == "HTTP/1.1" ? connection == nullptr || !connection->contains("close")
+			: connection != nullptr && connection->contains("keep-alive"));
+	return 0;
+}
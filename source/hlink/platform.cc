@@ -0,0 +1,348 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hlink/platform.hh"
+#include "log.hh"
+
+#ifdef __3DS__
+	#include "hlink/hlink.hh"
+	#include "queue.hh"
+	#include "panic.hh"
+	#include "i18n.hh"
+	#include "util.hh"
+	#include "ctr.hh"
+	#include <sys/socket.h>
+	#include <unistd.h>
+	#include <string.h>
+	#include <3ds.h>
+#else
+	#include "hlink/hlink.hh"
+	#include <sys/sendfile.h>
+	#include <sys/socket.h>
+	#include <arpa/inet.h>
+	#include <unistd.h>
+	#include <signal.h>
+	#include <stdarg.h>
+	#include <stdlib.h>
+	#include <string.h>
+	#include <stdio.h>
+	#include <time.h>
+	#include <ctype.h>
+#endif
+
+
+#ifdef __3DS__
+uint64_t hlink::platform::time_ms()
+{
+	return osGetTime();
+}
+
+uint32_t hlink::platform::host_address()
+{
+	return gethostid();
+}
+
+std::string hlink::platform::web_root()
+{
+	return "romfs:/public";
+}
+
+ssize_t hlink::platform::send_file(int sock, int fd, uint64_t offset, size_t len)
+{
+	/* there is no sendfile(), the server is single threaded so one buffer does */
+	static char buf[hlink::file_chunk_size];
+	if(len > sizeof(buf)) len = sizeof(buf);
+	if(lseek(fd, offset, SEEK_SET) < 0)
+		return -1;
+	ssize_t bread = read(fd, buf, len);
+	if(bread <= 0) return bread;
+	return ::send(sock, buf, bread, 0);
+}
+
+ssize_t hlink::platform::send_vec(int sock, const struct iovec *iov, int count, bool more)
+{
+	(void) more;
+	/* there is no sendmsg() either, small buffers are gathered so it's still one send */
+	static char buf[hlink::file_chunk_size];
+	if(count == 1 || iov[0].iov_len >= sizeof(buf))
+		return ::send(sock, iov[0].iov_base, iov[0].iov_len, 0);
+	size_t len = 0;
+	for(int i = 0; i < count && len < sizeof(buf); ++i)
+	{
+		size_t n = iov[i].iov_len < sizeof(buf) - len ? iov[i].iov_len : sizeof(buf) - len;
+		memcpy(buf + len, iov[i].iov_base, n);
+		len += n;
+	}
+	return ::send(sock, buf, len, 0);
+}
+
+bool hlink::platform::title_meta(Title& ret, uint64_t id)
+{
+	return R_SUCCEEDED(hsapi::title_meta(ret, id));
+}
+
+const std::vector<hlink::platform::Title>& hlink::platform::queue_get()
+{
+	return ::queue_get();
+}
+
+void hlink::platform::queue_add(const Title& meta)
+{
+	::queue_add(meta);
+}
+
+hlink::platform::InstallService *hlink::platform::installer(bool start)
+{
+	return install::background(start);
+}
+
+std::string hlink::platform::tid_to_str(uint64_t tid)
+{
+	return ctr::tid_to_str(tid);
+}
+
+bool hlink::platform::title_exists(uint64_t tid)
+{
+	return ctr::title_exists(tid, ctr::mediatype_of(tid));
+}
+
+bool hlink::platform::title_name(uint64_t tid, std::string& ret)
+{
+	ctr::TitleSMDHInfo smdh;
+	const ctr::TitleSMDHInfo::Title *title;
+	if(!ctr::smdh::lookup(tid, smdh) || !(title = ctr::smdh::get_native_title(smdh)))
+		return false;
+	ret = title->descShort;
+	return true;
+}
+
+std::string hlink::platform::title_missing_message(uint64_t tid)
+{
+	return PSTRING(title_doesnt_exist, ctr::tid_to_str(tid));
+}
+
+void hlink::platform::launch(uint64_t tid)
+{
+	APT_PrepareToDoApplicationJump(0, tid, ctr::mediatype_of(tid));
+
+	u8 parambuf[0x300];
+	u8 hmacbuf[0x20];
+	APT_DoApplicationJump(parambuf, 0x300, hmacbuf);
+}
+
+void hlink::platform::fatal(const std::string& caller, const std::string& msg)
+{
+	panic_impl(caller, msg);
+}
+
+void hlink::platform::lower(std::string& s)
+{
+	::lower(s);
+}
+#else
+/* Stub backends for host builds, everything lives in memory:
+ *  - every hShop id but 0 is a title called "Title <id>" with
+ *    tid 0004000000<id>, fetching it takes $HLINK_FAKE_LATENCY ms
+ *  - every title id but 0 is installed
+ *  - background installs take 2 seconds, titles whose
+ *    tid ends in DEAD fail
+ *  - launching a title stops the server */
+
+static uint64_t env_num(const char *name, uint64_t def)
+{
+	const char *val = getenv(name);
+	return val ? strtoull(val, nullptr, 10) : def;
+}
+
+uint64_t hlink::platform::time_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* every client is trusted, so only local ones can connect
+ * unless $HLINK_ADDR says otherwise (i.e. 0.0.0.0) */
+uint32_t hlink::platform::host_address()
+{
+	const char *addr = getenv("HLINK_ADDR");
+	struct in_addr ret;
+	if(addr == nullptr || inet_aton(addr, &ret) == 0)
+		return htonl(INADDR_LOOPBACK);
+	return ret.s_addr;
+}
+
+std::string hlink::platform::web_root()
+{
+	const char *root = getenv("HLINK_ROOT");
+	return root ? root : "romfs/public";
+}
+
+ssize_t hlink::platform::send_file(int sock, int fd, uint64_t offset, size_t len)
+{
+	off_t off = offset;
+	return sendfile(sock, fd, &off, len);
+}
+
+ssize_t hlink::platform::send_vec(int sock, const struct iovec *iov, int count, bool more)
+{
+	if(count == 1)
+		return ::send(sock, iov[0].iov_base, iov[0].iov_len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = count;
+	return sendmsg(sock, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+}
+
+bool hlink::platform::title_meta(Title& ret, uint64_t id)
+{
+	usleep(env_num("HLINK_FAKE_LATENCY", 0) * 1000);
+	if(id == 0) return false;
+	ret.id = id;
+	ret.tid = 0x0004000000000000ULL | (id & 0xFFFFFFFFFFULL);
+	ret.name = "Title " + std::to_string(id);
+	return true;
+}
+
+static std::vector<hlink::platform::Title> g_queue;
+
+const std::vector<hlink::platform::Title>& hlink::platform::queue_get()
+{
+	return g_queue;
+}
+
+void hlink::platform::queue_add(const Title& meta)
+{
+	for(const Title& queued : g_queue)
+		if(queued.id == meta.id) return;
+	g_queue.push_back(meta);
+}
+
+static int32_t fake_install(const hlink::platform::InstallTitle& meta,
+	hlink::platform::InstallService::prog_type prog, const volatile bool *cancel)
+{
+	constexpr uint64_t total = 16 * 1024 * 1024;
+	constexpr int steps = 20;
+	ilog("Fake background install of %s", meta.url.size() ? meta.url.c_str() : meta.name.c_str());
+	for(int i = 1; i <= steps; ++i)
+	{
+		if(*cancel) return -1;
+		if((meta.tid & 0xFFFF) == 0xDEAD && i == steps / 2)
+			return -2;
+		usleep(2000000 / steps);
+		prog(total / steps * i, total);
+	}
+	return 0;
+}
+
+hlink::platform::InstallService *hlink::platform::installer(bool start)
+{
+	static InstallService *service = nullptr;
+	if(service == nullptr && start)
+	{
+		service = new InstallService(fake_install);
+		service->start();
+	}
+	return service;
+}
+
+std::string hlink::platform::tid_to_str(uint64_t tid)
+{
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llX", (unsigned long long) tid);
+	return buf;
+}
+
+bool hlink::platform::title_exists(uint64_t tid)
+{
+	return tid != 0;
+}
+
+bool hlink::platform::title_name(uint64_t tid, std::string& ret)
+{
+	ret = "Title " + tid_to_str(tid);
+	return true;
+}
+
+std::string hlink::platform::title_missing_message(uint64_t tid)
+{
+	return "Title " + tid_to_str(tid) + " doesn't exist";
+}
+
+void hlink::platform::launch(uint64_t tid)
+{
+	ilog("Launching %016llX", (unsigned long long) tid);
+}
+
+void hlink::platform::fatal(const std::string& caller, const std::string& msg)
+{
+	fprintf(stderr, "panic in %s: %s\n", caller.c_str(), msg.c_str());
+	abort();
+}
+
+void hlink::platform::lower(std::string& s)
+{
+	for(size_t i = 0; i < s.size(); ++i)
+		s[i] = tolower(s[i]);
+}
+
+/* log.cc isn't part of host builds, logs go to stderr. $HLINK_LOG
+ * is the highest level that is printed, info by default */
+void _logf(const char *fnname, const char *filen,
+	size_t line, LogLevel lvl, const char *fmt, ...)
+{
+	static const char *names[] = { "FATAL", "ERROR", "WARNING", "INFO", "DEBUG", "VERBOSE" };
+	if((uint64_t) lvl > env_num("HLINK_LOG", (uint64_t) LogLevel::info))
+		return;
+
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "[%s] %s:%s@%zu: ", names[(int) lvl], filen ? filen : "", fnname, line);
+	vfprintf(stderr, fmt, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_signal(int)
+{
+	g_stop = 1;
+}
+
+/* runs the server until it's interrupted, all clients are trusted */
+int main()
+{
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	hlink::create_server(
+		[](const std::string& addr) -> bool { ilog("Trusting %s", addr.c_str()); return true; },
+		[](const std::string& msg) -> void { fprintf(stderr, "error: %s\n", msg.c_str()); },
+		[](const std::string& addr) -> void {
+			/* called again whenever the screen should be redrawn */
+			static bool shown = false;
+			if(!shown) fprintf(stderr, "hLink server on %s:%d, http on port 8000\n", addr.c_str(), hlink::port);
+			shown = true;
+		},
+		[]() -> bool { return !g_stop; },
+		[](const std::string& req) -> void { dlog("Request: %s", req.c_str()); });
+	return 0;
+}
+#endif
+
@@ -68,9 +68,8 @@ static std::string xref_impl(hlink::TemplCtx& ctx, const TemplArgs& args)
 
 static std::string get_user_agent(hlink::TemplRen *ren)
 {
-	if(ren->headers().count("user-agent") == 0)
-		return "";
-	return ren->headers()["user-agent"];
+	const hlink::HTTPView *agent = ren->headers().get("user-agent");
+	return agent ? agent->str() : "";
 }
 
 void hlink::TemplCtx::abort() { this->ren->abortBit = true; }
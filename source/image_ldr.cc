@@ -38,20 +38,20 @@ static u32 next_pow2(u32 i)
 	return i;
 }
 
-void load_smdh_icon(C2D_Image *ret, const ctr::TitleSMDH& smdh, SMDHIconType type,
+void load_smdh_icon(C2D_Image *ret, const ctr::TitleSMDHInfo& smdh, SMDHIconType type,
 	unsigned int *chosenDimensions)
 {
 	unsigned int dim; // x = y
-	u16 *src;
+	const u16 *src;
 
 	switch(type)
 	{
 	case SMDHIconType::large:
-		src = (u16 *) smdh.iconLarge;
+		src = (const u16 *) smdh.iconLarge;
 		dim = 48;
 		break;
 	case SMDHIconType::small:
-		src = (u16 *) smdh.iconSmall;
+		src = (const u16 *) smdh.iconSmall;
 		dim = 24;
 		break;
 
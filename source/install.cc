@@ -16,6 +16,7 @@
 
 #include "settings.hh"
 #include "install.hh"
+#include "seed.hh"
 #include "thread.hh"
 #include "update.hh" /* includes net constants */
 #include "error.hh"
@@ -27,6 +28,9 @@
 #include <3ds.h>
 
 #define BUFSIZE 0x80000
+#define SVC_TIMEOUT 0x09401BFE
+/* how many times a headless install reconnects before giving up */
+#define HEADLESS_MAX_RETRIES 3
 
 enum class ITC // inter thread communication
 {
@@ -242,9 +246,9 @@ static void i_install_loop_thread_cb(Result& res, get_url_func get_url, cia_net_
 			svcSignalEvent(data.eventHandle);
 			/* other thread wakes up */
 			svcWaitSynchronization(data.eventHandle, U64_MAX);
-			data.itc = ITC::normal;
-			if(res == APPERR_CANCELLED)
+			if(res == APPERR_CANCELLED || data.itc == ITC::exit)
 				break; /* finished */
+			data.itc = ITC::normal;
 			continue;
 		}
 
@@ -256,7 +260,9 @@ out:
 	svcSignalEvent(data.eventHandle);
 }
 
-static Result i_install_resume_loop(get_url_func get_url, prog_func prog, cia_net_data *data)
+/* if cancel is not nullptr the install runs headless: no HID or
+ * timeout screen, instead *cancel is polled */
+static Result i_install_resume_loop(get_url_func get_url, prog_func prog, cia_net_data *data, const volatile bool *cancel)
 {
 	Result res;
 	data->buffer = new u8[BUFSIZE];
@@ -275,9 +281,38 @@ static Result i_install_resume_loop(get_url_func get_url, prog_func prog, cia_ne
 	extern Handle hidEvents[5];
 	memcpy(&handles[1], hidEvents, sizeof(hidEvents));
 	s32 outhandle;
+	Result giveup = 0;
+	int retries = 0;
+
+	// Headless loop
+	while(cancel != nullptr && data->itc != ITC::exit)
+	{
+		Result wres = svcWaitSynchronization(data->eventHandle, 250000000LL /* 250ms */);
+		/* the other thread waits for an answer here, so this goes first */
+		if(data->itc == ITC::timeoutscr)
+		{
+			/* nobody to ask, so just retry a few times after a while */
+			if(++retries > HEADLESS_MAX_RETRIES) giveup = res;
+			for(int i = 0; i < 20 && giveup == 0 && !*cancel; ++i)
+				svcSleepThread(250000000LL /* 250ms, 5s in total */);
+			if(giveup != 0 || *cancel) res = APPERR_CANCELLED;
+			svcSignalEvent(data->eventHandle);
+			if(res == APPERR_CANCELLED) break;
+		}
+		if(*cancel)
+		{
+			res = APPERR_CANCELLED;
+			break;
+		}
+		if(wres == (Result) SVC_TIMEOUT)
+			continue;
+		if(data->itc == ITC::exit)
+			break;
+		prog(data->index, data->totalSize);
+	}
 
 	// UI Loop
-	while(data->itc != ITC::exit)
+	while(cancel == nullptr && data->itc != ITC::exit)
 	{
 		svcWaitSynchronizationN(&outhandle, handles, 6, false, U64_MAX);
 		/* other thread signals state update */
@@ -312,8 +347,12 @@ static Result i_install_resume_loop(get_url_func get_url, prog_func prog, cia_ne
 		}
 	}
 
+	/* wakes the other thread up if it still waits for a timeout answer */
 	data->itc = ITC::exit;
+	svcSignalEvent(data->eventHandle);
 	th.join();
+	/* report why we gave up instead of APPERR_CANCELLED */
+	if(giveup != 0) res = giveup;
 
 	svcCloseHandle(data->eventHandle);
 	delete [] data->buffer;
@@ -331,7 +370,7 @@ static const char *dest2str(FS_MediaType dest)
 	return "INVALID VALUE";
 }
 
-static Result net_cia_impl(get_url_func get_url, hsapi::htid tid, bool reinstallable, prog_func prog, cia_net_data *data)
+static Result net_cia_impl(get_url_func get_url, hsapi::htid tid, bool reinstallable, prog_func prog, cia_net_data *data, const volatile bool *cancel)
 {
 	FS_MediaType dest = ctr::mediatype_of(tid);
 	Result ret;
@@ -365,11 +404,16 @@ static Result net_cia_impl(get_url_func get_url, hsapi::htid tid, bool reinstall
 		if(R_FAILED(ret)) return ret;
 	}
 
-	aptSetHomeAllowed(false);
-	float oldrate = C3D_FrameRate(2.0f);
-	ret = i_install_resume_loop(get_url, prog, data);
-	C3D_FrameRate(oldrate);
-	aptSetHomeAllowed(true);
+	if(cancel == nullptr)
+	{
+		aptSetHomeAllowed(false);
+		float oldrate = C3D_FrameRate(2.0f);
+		ret = i_install_resume_loop(get_url, prog, data, cancel);
+		C3D_FrameRate(oldrate);
+		aptSetHomeAllowed(true);
+	}
+	/* the UI isn't ours in headless mode */
+	else ret = i_install_resume_loop(get_url, prog, data, cancel);
 
 	if(data->type == ActionType::install)
 	{
@@ -383,13 +427,14 @@ static Result net_cia_impl(get_url_func get_url, hsapi::htid tid, bool reinstall
 		ilog("Done writing all data to CIA handle, finishing up");
 		ret = AM_FinishCiaInstall(data->cia);
 		ilog("AM_FinishCiaInstall(...): 0x%08lX", ret);
+		if(R_SUCCEEDED(ret)) ctr::inventory::installed(tid, dest);
 		svcCloseHandle(data->cia);
 	}
 
 	return ret;
 }
 
-static Result i_install_hs_cia(const hsapi::FullTitle& meta, prog_func prog, bool reinstallable, cia_net_data *data, bool isKtrHint = false)
+static Result i_install_hs_cia(const hsapi::FullTitle& meta, prog_func prog, bool reinstallable, cia_net_data *data, const volatile bool *cancel, bool isKtrHint = false)
 {
 	ctr::Destination media = ctr::detect_dest(meta.tid);
 	u64 freeSpace = 0;
@@ -414,17 +459,17 @@ static Result i_install_hs_cia(const hsapi::FullTitle& meta, prog_func prog, boo
 		if(R_FAILED(res = hsapi::get_download_link(ret, meta)))
 			return "";
 		return ret;
-	}, meta.tid, reinstallable, prog, data);
+	}, meta.tid, reinstallable, prog, data, cancel);
 }
 
 Result install::net_cia(get_url_func get_url, u64 tid, prog_func prog, bool reinstallable)
 {
 	cia_net_data data;
 	data.type = ActionType::install;
-	return net_cia_impl(get_url, tid, reinstallable, prog, &data);
+	return net_cia_impl(get_url, tid, reinstallable, prog, &data, nullptr);
 }
 
-Result install::hs_cia(const hsapi::FullTitle& meta, prog_func prog, bool reinstallable)
+static Result hs_cia_impl(const hsapi::FullTitle& meta, prog_func prog, bool reinstallable, const volatile bool *cancel)
 {
 	cia_net_data data;
 	/* we instead want to use the theme installer installation method */
@@ -435,14 +480,97 @@ Result install::hs_cia(const hsapi::FullTitle& meta, prog_func prog, bool reinst
 		data.content = &content;
 		data.type = ActionType::download;
 		Result res;
-		if(R_FAILED(res = i_install_hs_cia(meta, prog, reinstallable, &data)))
+		if(R_FAILED(res = i_install_hs_cia(meta, prog, reinstallable, &data, cancel)))
 			return res;
 		/* trust me this'll be fine */
 		return install_forwarder((u8 *) content.c_str(), content.size());
 	}
 	ilog("installing normal content");
 	data.type = ActionType::install;
-	return i_install_hs_cia(meta, prog, reinstallable, &data, meta.flags & hsapi::TitleFlag::is_ktr);
+	return i_install_hs_cia(meta, prog, reinstallable, &data, cancel, meta.flags & hsapi::TitleFlag::is_ktr);
+}
+
+Result install::hs_cia(const hsapi::FullTitle& meta, prog_func prog, bool reinstallable)
+{
+	return hs_cia_impl(meta, prog, reinstallable, nullptr);
+}
+
+Result install::hs_cia_headless(const hsapi::FullTitle& meta, prog_func prog, const volatile bool *cancel)
+{
+	return hs_cia_impl(meta, prog, false, cancel);
+}
+
+Result install::net_cia_headless(get_url_func get_url, u64 tid, prog_func prog, const volatile bool *cancel)
+{
+	cia_net_data data;
+	data.type = ActionType::install;
+	return net_cia_impl(get_url, tid, false, prog, &data, cancel);
+}
+
+/* ctr::mutex has no try_lock() so the lock is a flag guarded by one */
+static ctr::mutex g_am_mtx;
+static ctr::condvar g_am_cv;
+static bool g_am_busy = false;
+
+void install::lock_am()
+{
+	ctr::lock_guard guard(g_am_mtx);
+	while(g_am_busy)
+		g_am_cv.wait(g_am_mtx);
+	g_am_busy = true;
+}
+
+bool install::try_lock_am()
+{
+	ctr::lock_guard guard(g_am_mtx);
+	if(g_am_busy) return false;
+	g_am_busy = true;
+	return true;
+}
+
+void install::unlock_am()
+{
+	ctr::lock_guard guard(g_am_mtx);
+	g_am_busy = false;
+	g_am_cv.signal();
+}
+
+static Result background_install(const install::BackgroundTitle& meta, install::BackgroundService::prog_type prog, const volatile bool *cancel)
+{
+	Result res = ctr::lockNDM();
+	bool hasLock = R_SUCCEEDED(res);
+	if(!hasLock) elog("failed to acquire NDM lock: %08lX", res);
+
+	prog_func wrapped = [&prog](u64 done, u64 total) -> void { prog(done, total); };
+	install::lock_am();
+	if(meta.url.size() != 0)
+	{
+		ilog("Processing %s (tid=%016llX) in the background", meta.url.c_str(), meta.tid);
+		res = install::net_cia_headless(makeurlwrap(meta.url), meta.tid, wrapped, cancel);
+	}
+	else
+	{
+		ilog("Processing title with id=%llu in the background", meta.id);
+		res = install::hs_cia_headless(meta, wrapped, cancel);
+	}
+	install::unlock_am();
+	if(R_SUCCEEDED(res)) res = add_seed(meta.tid);
+	ilog("Finished processing in the background, res=%016lX", res);
+
+	if(hasLock) ctr::unlockNDM();
+	return res;
+}
+
+install::BackgroundService *install::background(bool start)
+{
+	static install::BackgroundService *service = nullptr;
+	if(service == nullptr && start)
+	{
+		static install::BackgroundService serv(background_install);
+		serv.start();
+		service = &serv;
+	}
+	return service;
 }
 
 // HTTPC
@@ -17,12 +17,14 @@
 #include "installgui.hh"
 
 #include <ui/progress_bar.hh>
+#include <ui/loading.hh>
 #include <ui/base.hh>
 
 #include "widgets/indicators.hh"
 #include "find_missing.hh"
 #include "lumalocale.hh"
 #include "settings.hh"
+#include "library.hh"
 #include "panic.hh"
 #include "util.hh"
 #include "seed.hh"
@@ -56,6 +58,7 @@ static bool ask_reinstall(bool interactive)
 static void finalize_install(u64 tid, bool interactive)
 {
 	ui::RenderQueue::global()->find_tag<ui::FreeSpaceIndicator>(ui::tag::free_indicator)->update();
+	library::rescan();
 
 	// Prompt to ask for extra content
 	if(interactive && tid_can_have_missing(tid) && ISET_SEARCH_ECONTENT)
@@ -69,6 +72,13 @@ static void finalize_install(u64 tid, bool interactive)
 		luma::maybe_set_gamepatching();
 }
 
+/* waits for background and hLink installs to get out of the way */
+static void lock_am()
+{
+	if(!install::try_lock_am())
+		ui::loading([]() -> void { install::lock_am(); });
+}
+
 /* returns if the user wants to continue */
 static bool maybe_warn_already_installed(u64 tid, bool interactive)
 {
@@ -94,6 +104,7 @@ Result install::gui::net_cia(const std::string& url, u64 tid, bool interactive,
 	bool shouldReinstall = defaultReinstallable;
 	Result res = 0;
 
+	lock_am();
 start_install:
 	res = install::net_cia(makeurlwrap(url), tid, [&queue, &bar](u64 now, u64 total) -> void {
 		bar->update(now, total);
@@ -106,6 +117,7 @@ start_install:
 		if((shouldReinstall = ask_reinstall(interactive)))
 			goto start_install;
 	}
+	install::unlock_am();
 
 	if(R_SUCCEEDED(res)) res = add_seed(tid);
 	if(R_FAILED(res))
@@ -134,8 +146,10 @@ Result install::gui::hs_cia(const hsapi::FullTitle& meta, bool interactive, bool
 	bool shouldReinstall = defaultReinstallable;
 	Result res = 0;
 
-	if(interactive && R_FAILED(res = ctr::lockNDM()))
+	bool hasNDM = interactive && R_SUCCEEDED(res = ctr::lockNDM());
+	if(interactive && !hasNDM)
 		elog("failed to lock NDM: %08lX", res);
+	lock_am();
 
 start_install:
 	res = install::hs_cia(meta, [&queue, &bar](u64 now, u64 total) -> void {
@@ -149,6 +163,7 @@ start_install:
 		if((shouldReinstall = ask_reinstall(interactive)))
 			goto start_install;
 	}
+	install::unlock_am();
 
 	if(R_SUCCEEDED(res))
 	{
@@ -171,8 +186,8 @@ start_install:
 		if(interactive) handle_error(err);
 	}
 
-	if(interactive) ctr::unlockNDM();
-	else            ui::LED::SetTimeout(time(NULL) + 2);
+	if(hasNDM) ctr::unlockNDM();
+	if(!interactive) ui::LED::SetTimeout(time(NULL) + 2);
 
 	set_focus(focus);
 	return res;
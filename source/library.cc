@@ -0,0 +1,257 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "library.hh"
+#include "binfile.hh"
+#include "thread.hh"
+#include "ctr.hh"
+#include "log.hh"
+
+#include <unordered_map>
+#include <sys/stat.h>
+#include <string.h>
+
+#define LIBRARY_LOCATION "/3ds/3hs/library"
+#define SCANNER_PRIORITY 0x3F /* lowest possible */
+
+/*
+everything LE
+
+Title {
+	u64 tid
+	u16 version
+	u8 media
+	u8 hasSMDH
+	u32 region
+	dynstr name
+	dynstr publisher
+	u8[0x480] icon
+}
+
+Library {
+	char[4] magic // "3HLB"
+	u32 count
+	Title[count] titles
+}
+*/
+
+static std::vector<library::Title> g_titles;
+static ctr::thread<> *g_scanner = nullptr;
+static u32 g_generation = 1;
+static ctr::condvar g_cv;
+static ctr::mutex g_lock;
+static bool g_shouldScan = false;
+static volatile bool g_shouldExit = false;
+static bool g_scanning = false;
+
+
+static void load_library()
+{
+	std::vector<u8> buf;
+	if(!binary_read_file(LIBRARY_LOCATION, buf)) return;
+
+	BinaryReader reader(buf.data(), buf.size());
+	char magic[4];
+	u32 count;
+	if(!reader.read(magic) || memcmp(magic, "3HLB", 4) != 0 || !reader.read(count))
+	{
+		elog("invalid library database, ignoring it");
+		return;
+	}
+
+	/* the scanner isn't running yet so we don't need to lock */
+	g_titles.reserve(count);
+	for(u32 i = 0; i < count; ++i)
+	{
+		library::Title title;
+		if(!reader.read(title.tid) || !reader.read(title.version) || !reader.read(title.media)
+				|| !reader.read(title.hasSMDH) || !reader.read(title.region) || !reader.read(title.name)
+				|| !reader.read(title.publisher) || !reader.read(title.icon))
+		{
+			elog("library database corrupted at entry %lu", i);
+			break;
+		}
+		g_titles.push_back(std::move(title));
+	}
+	ilog("loaded %u titles from the library database", g_titles.size());
+}
+
+static void write_library(const std::vector<library::Title>& titles)
+{
+	std::string buf;
+	buf.append("3HLB", 4);
+	binary_write(buf, (u32) titles.size());
+	for(const library::Title& title : titles)
+	{
+		binary_write(buf, title.tid);
+		binary_write(buf, title.version);
+		binary_write(buf, title.media);
+		binary_write(buf, title.hasSMDH);
+		binary_write(buf, title.region);
+		binary_write(buf, title.name);
+		binary_write(buf, title.publisher);
+		binary_write(buf, title.icon);
+	}
+
+	mkdir("/3ds", 0777);
+	mkdir("/3ds/3hs", 0777);
+	if(!binary_write_file(LIBRARY_LOCATION, buf))
+		elog("failed to write library database");
+}
+
+static void read_title(library::Title& title)
+{
+	ctr::TitleSMDH *smdh = ctr::smdh::get(title.tid, (FS_MediaType) title.media);
+	ctr::TitleSMDHTitle *native;
+	/* updates, DLC, system data, etc. don't have an SMDH */
+	if(smdh == nullptr || (native = ctr::smdh::get_native_title(smdh)) == nullptr)
+	{
+		title.hasSMDH = false;
+		title.region = 0;
+		memset(title.icon, 0, sizeof(title.icon));
+		delete smdh;
+		return;
+	}
+
+	title.hasSMDH = true;
+	title.name = ctr::smdh::u16conv(native->descShort, 0x40);
+	title.publisher = ctr::smdh::u16conv(native->publisher, 0x40);
+	title.region = smdh->region;
+	memcpy(title.icon, smdh->iconSmall, sizeof(title.icon));
+	delete smdh;
+}
+
+/* returns false if the scan was aborted */
+static bool scan()
+{
+	/* tid => index in old */
+	std::unordered_map<u64, size_t> index;
+	std::vector<library::Title> old;
+	g_lock.lock();
+	old = g_titles;
+	g_lock.unlock();
+	for(size_t i = 0; i < old.size(); ++i)
+		index.emplace(old[i].tid, i);
+
+	static const FS_MediaType medias[] = { MEDIATYPE_SD, MEDIATYPE_NAND, MEDIATYPE_GAME_CARD };
+	std::vector<library::Title> titles;
+	size_t reused = 0;
+	for(FS_MediaType media : medias)
+	{
+		std::vector<u64> tids;
+		/* no cart inserted, etc. */
+		if(R_FAILED(ctr::list_titles_on(media, tids)))
+			continue;
+		std::vector<AM_TitleEntry> entries;
+		bool haveVersions = R_SUCCEEDED(ctr::get_title_entries(media, tids, entries));
+
+		for(size_t i = 0; i < tids.size(); ++i)
+		{
+			if(g_shouldExit) return false;
+
+			library::Title title;
+			title.tid = tids[i];
+			title.version = haveVersions ? entries[i].version : 0;
+			title.media = media;
+
+			std::unordered_map<u64, size_t>::iterator it = index.find(title.tid);
+			if(it != index.end() && old[it->second].media == title.media && old[it->second].version == title.version)
+			{
+				titles.push_back(std::move(old[it->second]));
+				++reused;
+				continue;
+			}
+
+			read_title(title);
+			titles.push_back(std::move(title));
+		}
+	}
+
+	/* nothing new, nothing removed */
+	if(reused == titles.size() && reused == old.size())
+	{
+		vlog("library is up-to-date (%u titles)", titles.size());
+		return true;
+	}
+
+	ilog("library scanned, %u titles of which %u new or changed", titles.size(), titles.size() - reused);
+	write_library(titles);
+	ctr::lock_guard guard(g_lock);
+	g_titles.swap(titles);
+	++g_generation;
+	return true;
+}
+
+static void run()
+{
+	svcSetThreadPriority(CUR_THREAD_HANDLE, SCANNER_PRIORITY);
+
+	g_lock.lock();
+	while(true)
+	{
+		while(!g_shouldExit && !g_shouldScan)
+			g_cv.wait(g_lock);
+		if(g_shouldExit) break;
+		g_shouldScan = false;
+		g_scanning = true;
+		g_lock.unlock();
+
+		bool finished = scan();
+
+		g_lock.lock();
+		g_scanning = false;
+		if(!finished) break;
+	}
+	g_lock.unlock();
+}
+
+void library::start()
+{
+	if(g_scanner != nullptr) return;
+	load_library();
+	g_shouldExit = false;
+	g_shouldScan = true;
+	g_scanner = new ctr::thread<>(run);
+}
+
+void library::stop()
+{
+	if(g_scanner == nullptr) return;
+	g_lock.lock();
+	g_shouldExit = true;
+	g_cv.broadcast();
+	g_lock.unlock();
+	delete g_scanner; /* joins */
+	g_scanner = nullptr;
+}
+
+void library::rescan()
+{
+	ctr::lock_guard guard(g_lock);
+	g_shouldScan = true;
+	g_cv.broadcast();
+}
+
+void library::snapshot(library::Snapshot& ret)
+{
+	ctr::lock_guard guard(g_lock);
+	ret.scanning = g_scanning || g_shouldScan;
+	if(ret.generation == g_generation)
+		return;
+	ret.generation = g_generation;
+	ret.titles = g_titles;
+}
+
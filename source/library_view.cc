@@ -0,0 +1,83 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "library_view.hh"
+#include "library.hh"
+#include "util.hh"
+#include "i18n.hh"
+
+#include <widgets/meta.hh>
+#include <ui/loading.hh>
+#include <ui/list.hh>
+#include <ui/base.hh>
+
+#include <algorithm>
+
+
+/* lists the installed titles from the library database,
+ * nothing has to be read from the titles themselves */
+void show_library()
+{
+	using list_t = ui::List<library::Title>;
+	bool focus = set_focus(true);
+
+	library::Snapshot snapshot;
+	library::snapshot(snapshot);
+	/* the first scan may still be running */
+	if(snapshot.titles.size() == 0 && snapshot.scanning)
+	{
+		ui::loading([&snapshot]() -> void {
+			do {
+				svcSleepThread(100000000LL /* 100ms */);
+				library::snapshot(snapshot);
+			} while(snapshot.scanning);
+		});
+	}
+
+	/* updates, DLC and system data don't have a name to show */
+	std::vector<library::Title> titles;
+	for(library::Title& title : snapshot.titles)
+		if(title.hasSMDH) titles.push_back(std::move(title));
+	std::sort(titles.begin(), titles.end(), [](const library::Title& a, const library::Title& b) -> bool {
+		return a.name < b.name;
+	});
+
+	if(titles.size() == 0)
+	{
+		ui::notice(STRING(no_installed_titles));
+		set_focus(focus);
+		return;
+	}
+
+	ui::RenderQueue queue;
+
+	ui::InstalledMeta *meta;
+
+	ui::builder<ui::InstalledMeta>(ui::Screen::bottom, titles[0])
+		.add_to(&meta, queue);
+
+	ui::builder<list_t>(ui::Screen::top, &titles)
+		.connect(list_t::to_string, [](const library::Title& title) -> std::string { return title.name; })
+		.connect(list_t::change, [meta](list_t *self, size_t i) -> void {
+			meta->set_title(self->at(i));
+		})
+		.x(5.0f).y(25.0f)
+		.add_to(queue);
+
+	queue.render_finite_button(KEY_B);
+	set_focus(focus);
+}
+
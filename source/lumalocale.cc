@@ -30,36 +30,36 @@
 #include <unistd.h>
 
 
-static bool has_region(ctr::TitleSMDH *smdh, ctr::Region region)
+static bool has_region(const ctr::TitleSMDHInfo& smdh, ctr::Region region)
 {
 	// This is a mess
 	return
-		(smdh->region & (u32) ctr::RegionLockout::JPN && region == ctr::Region::JPN) ||
-		(smdh->region & (u32) ctr::RegionLockout::USA && region == ctr::Region::USA) ||
-		(smdh->region & (u32) ctr::RegionLockout::EUR && region == ctr::Region::EUR) ||
-		(smdh->region & (u32) ctr::RegionLockout::AUS && region == ctr::Region::EUR) ||
-		(smdh->region & (u32) ctr::RegionLockout::CHN && region == ctr::Region::CHN) ||
-		(smdh->region & (u32) ctr::RegionLockout::KOR && region == ctr::Region::KOR) ||
-		(smdh->region & (u32) ctr::RegionLockout::TWN && region == ctr::Region::TWN);
+		(smdh.region & (u32) ctr::RegionLockout::JPN && region == ctr::Region::JPN) ||
+		(smdh.region & (u32) ctr::RegionLockout::USA && region == ctr::Region::USA) ||
+		(smdh.region & (u32) ctr::RegionLockout::EUR && region == ctr::Region::EUR) ||
+		(smdh.region & (u32) ctr::RegionLockout::AUS && region == ctr::Region::EUR) ||
+		(smdh.region & (u32) ctr::RegionLockout::CHN && region == ctr::Region::CHN) ||
+		(smdh.region & (u32) ctr::RegionLockout::KOR && region == ctr::Region::KOR) ||
+		(smdh.region & (u32) ctr::RegionLockout::TWN && region == ctr::Region::TWN);
 }
 
-static const char *get_auto_lang_str(ctr::TitleSMDH *smdh)
+static const char *get_auto_lang_str(const ctr::TitleSMDHInfo& smdh)
 {
-	if(smdh->region & (u32) ctr::RegionLockout::JPN) return "JP";
-	if(smdh->region & (u32) ctr::RegionLockout::USA) return "EN";
-	if(smdh->region & (u32) ctr::RegionLockout::EUR) return "EN";
-	if(smdh->region & (u32) ctr::RegionLockout::AUS) return "EN";
-	if(smdh->region & (u32) ctr::RegionLockout::CHN) return "ZH";
-	if(smdh->region & (u32) ctr::RegionLockout::KOR) return "KR";
-	if(smdh->region & (u32) ctr::RegionLockout::TWN) return "TW";
+	if(smdh.region & (u32) ctr::RegionLockout::JPN) return "JP";
+	if(smdh.region & (u32) ctr::RegionLockout::USA) return "EN";
+	if(smdh.region & (u32) ctr::RegionLockout::EUR) return "EN";
+	if(smdh.region & (u32) ctr::RegionLockout::AUS) return "EN";
+	if(smdh.region & (u32) ctr::RegionLockout::CHN) return "ZH";
+	if(smdh.region & (u32) ctr::RegionLockout::KOR) return "KR";
+	if(smdh.region & (u32) ctr::RegionLockout::TWN) return "TW";
 	// Fail
 	return nullptr;
 }
 
 #define LANG_INVALID 12
-static const char *get_manual_lang_str(ctr::TitleSMDH *smdh)
+static const char *get_manual_lang_str(const ctr::TitleSMDHInfo& smdh)
 {
-	ctr::TitleSMDHTitle *title = ctr::smdh::get_native_title(smdh);
+	const ctr::TitleSMDHInfo::Title *title = ctr::smdh::get_native_title(smdh);
 	bool focus = set_focus(true);
 	ui::RenderQueue queue;
 
@@ -68,14 +68,13 @@ static const char *get_manual_lang_str(ctr::TitleSMDH *smdh)
 	static const std::vector<std::string> langlut = { "EN", "JP", "FR", "DE", "IT", "ES", "ZH", "KO", "NL", "PT", "RU", "TW" };
 	static const std::vector<u8> enumVals = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
 
-	ui::builder<ui::SMDHIcon>(ui::Screen::top, smdh, SMDHIconType::large)
+	ui::builder<ui::SMDHIcon>(ui::Screen::top, &smdh, SMDHIconType::large)
 		.x(ui::dimensions::width_top / 2 - 30)
 		.y(ui::dimensions::height / 2 - 64)
 		.border()
 		.add_to(queue);
 	ui::builder<ui::Text>(ui::Screen::top,
-			ctr::smdh::u16conv(title->descShort, 0x40) + "\n" +
-			ctr::smdh::u16conv(title->descLong, 0x80))
+			title->descShort + "\n" + title->descLong)
 		.x(ui::layout::center_x)
 		.under(queue.back())
 		.wrap()
@@ -91,15 +90,15 @@ static const char *get_manual_lang_str(ctr::TitleSMDH *smdh)
 }
 #undef LANG_INVALID
 
-static const char *get_region_str(ctr::TitleSMDH *smdh)
+static const char *get_region_str(const ctr::TitleSMDHInfo& smdh)
 {
-	if(smdh->region & (u32) ctr::RegionLockout::JPN) return "JPN";
-	if(smdh->region & (u32) ctr::RegionLockout::USA) return "USA";
-	if(smdh->region & (u32) ctr::RegionLockout::EUR) return "EUR";
-	if(smdh->region & (u32) ctr::RegionLockout::AUS) return "EUR";
-	if(smdh->region & (u32) ctr::RegionLockout::CHN) return "CHN";
-	if(smdh->region & (u32) ctr::RegionLockout::KOR) return "KOR";
-	if(smdh->region & (u32) ctr::RegionLockout::TWN) return "TWN";
+	if(smdh.region & (u32) ctr::RegionLockout::JPN) return "JPN";
+	if(smdh.region & (u32) ctr::RegionLockout::USA) return "USA";
+	if(smdh.region & (u32) ctr::RegionLockout::EUR) return "EUR";
+	if(smdh.region & (u32) ctr::RegionLockout::AUS) return "EUR";
+	if(smdh.region & (u32) ctr::RegionLockout::CHN) return "CHN";
+	if(smdh.region & (u32) ctr::RegionLockout::KOR) return "KOR";
+	if(smdh.region & (u32) ctr::RegionLockout::TWN) return "TWN";
 	// Fail
 	return nullptr;
 }
@@ -204,21 +203,20 @@ bool luma::set_locale(u64 tid)
 	if(mode == LumaLocaleMode::disabled)
 		return false;
 
-	ctr::TitleSMDH *smdh = ctr::smdh::get(tid);
+	ctr::TitleSMDHInfo smdh;
 	ctr::Region region = ctr::Region::WORLD;
 	const char *langstr = nullptr;
 	const char *regstr = nullptr;
 
-	if(smdh == nullptr) return false;
-	bool ret = false;
+	if(!ctr::smdh::lookup(tid, smdh)) return false;
 
 	// We don't need to do anything
-	if(smdh->region == (u32) ctr::RegionLockout::WORLD)
-		goto del_smdh;
+	if(smdh.region == (u32) ctr::RegionLockout::WORLD)
+		return false;
 
 	u8 sysregion;
 	if(R_FAILED(CFGU_SecureInfoGetRegion(&sysregion)))
-		goto del_smdh;
+		return false;
 
 	// Convert to Region
 	switch(sysregion)
@@ -229,32 +227,28 @@ bool luma::set_locale(u64 tid)
 		case CFG_REGION_KOR: region = ctr::Region::KOR; break;
 		case CFG_REGION_TWN: region = ctr::Region::TWN; break;
 		case CFG_REGION_USA: region = ctr::Region::USA; break;
-		default: goto del_smdh; // invalid region
+		default: return false; // invalid region
 	}
 
 	// If we have our own region we don't need to do anything
-	if(has_region(smdh, region)) goto del_smdh;
+	if(has_region(smdh, region)) return false;
 	regstr = get_region_str(smdh);
 
 	if(mode == LumaLocaleMode::automatic)
 	{
 		langstr = get_auto_lang_str(smdh);
-		if(!langstr) goto del_smdh; /* shouldn't happen */
+		if(!langstr) return false; /* shouldn't happen */
 		ilog("(lumalocale) Automatically deduced %s %s", regstr, langstr);
 	}
 	else if(mode == LumaLocaleMode::manual)
 	{
 		langstr = get_manual_lang_str(smdh);
 		/* cancelled the selection */
-		if(!langstr) goto del_smdh;
+		if(!langstr) return false;
 		ilog("(lumalocale) Manually selected %s %s", regstr, langstr);
 	}
 
 	write_file(tid, regstr, langstr);
-	ret = true;
-
-del_smdh:
-	delete smdh;
-	return ret;
+	return true;
 }
 
@@ -26,6 +26,7 @@
 #include "lumalocale.hh"
 #include "installgui.hh"
 #include "settings.hh"
+#include "library.hh"
 #include "log_view.hh"
 #include "extmeta.hh"
 #include "update.hh"
@@ -105,6 +106,26 @@ private:
 
 #include <ui/checkbox.hh>
 
+/* titles may have been installed or deleted outside of 3hs (FBI, System
+ * Settings, another cart) while it was suspended, so the inventory that
+ * ctr:: keeps is rebuilt on the next lookup and the library is rescanned */
+/* reports the results of a finished background batch, this shows
+ * notices so it may not run from within a render */
+static void maybe_finish_background()
+{
+	if(ui::InstallIndicator::batch_finished())
+		queue_finish_background();
+}
+
+static void resume_hook(APT_HookType hook, void *)
+{
+	if(hook == APTHOOK_ONRESTORE || hook == APTHOOK_ONWAKEUP)
+	{
+		ctr::inventory::reset();
+		library::rescan();
+	}
+}
+
 int main(int argc, char* argv[])
 {
 	((void) argc);
@@ -168,6 +189,12 @@ int main(int argc, char* argv[])
 
 	osSetSpeedupEnable(true); // speedup for n3dses
 
+	static aptHookCookie resumeCookie;
+	aptHook(&resumeCookie, resume_hook, nullptr);
+
+	library::start();
+	atexit(library::stop);
+
 	/* new ui setup */
 	ui::builder<ui::Text>(ui::Screen::top) /* text is not immediately set */
 		.x(ui::layout::center_x)
@@ -270,6 +297,9 @@ int main(int argc, char* argv[])
 	ui::builder<ui::NetIndicator>(ui::Screen::top)
 		.add_to(ui::RenderQueue::global());
 
+	ui::builder<ui::InstallIndicator>(ui::Screen::top)
+		.add_to(ui::RenderQueue::global());
+
 	// DRM Check
 #ifdef DEVICE_ID
 	u32 devid = 0;
@@ -316,12 +346,14 @@ int main(int argc, char* argv[])
 	while(aptMainLoop())
 	{
 cat:
+		maybe_finish_background();
 		const std::string *cat = next::sel_cat(&catptr);
 		// User wants to exit app
 		if(cat == next_cat_exit) break;
 		ilog("NEXT(c): %s", cat->c_str());
 
 sub:
+		maybe_finish_background();
 		if(associatedcat != cat) subptr = 0;
 		associatedcat = cat;
 
@@ -340,6 +372,7 @@ sub:
 		}
 
 gam:
+		maybe_finish_background();
 		hsapi::hid id = next::sel_gam(titles, &gamptr);
 		if(id == next_gam_back) goto sub;
 		if(id == next_gam_exit) break;
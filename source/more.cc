@@ -19,6 +19,7 @@
 #include "hlink/hlink_view.hh"
 
 #include "find_missing.hh"
+#include "library_view.hh"
 #include "log_view.hh"
 #include "settings.hh"
 #include "hsapi.hh"
@@ -36,6 +37,7 @@
 enum MoreInds {
 	IND_ABOUT = 0,
 	IND_FIND_MISSING,
+	IND_LIBRARY,
 	IND_LOG,
 #ifndef RELEASE
 	IND_HLINK,
@@ -52,6 +54,7 @@ void show_more()
 	ui::builder<ui::MenuSelect>(ui::Screen::bottom)
 		.connect(ui::MenuSelect::add, STRING(about_app), []() -> bool { show_about(); return true; })
 		.connect(ui::MenuSelect::add, STRING(find_missing_content), []() -> bool { show_find_missing_all(); return true; })
+		.connect(ui::MenuSelect::add, STRING(installed_titles), []() -> bool { show_library(); return true; })
 		.connect(ui::MenuSelect::add, STRING(log), []() -> bool { show_logs_menu(); return true; })
 		.connect(ui::MenuSelect::add, STRING(themes), []() -> bool { show_theme_menu(); return true; })
 #ifndef RELEASE
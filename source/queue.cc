@@ -23,10 +23,14 @@
 
 #include <widgets/meta.hh>
 
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 #include <vector>
 
 #include "lumalocale.hh"
 #include "installgui.hh"
+#include "library.hh"
 #include "install.hh"
 #include "panic.hh"
 #include "error.hh"
@@ -35,106 +39,272 @@
 #include "ctr.hh"
 #include "log.hh"
 
+/* g_queue keeps insertion order, the two indices
+ * make membership checks O(1) and are kept in sync
+ * by the functions below */
 static std::vector<hsapi::FullTitle> g_queue;
-std::vector<hsapi::FullTitle>& queue_get() { return g_queue; }
+static std::unordered_map<hsapi::hid, hsapi::htid> g_queue_ids;
+static std::unordered_set<hsapi::htid> g_queue_tids;
+const std::vector<hsapi::FullTitle>& queue_get() { return g_queue; }
 
-void queue_add(const hsapi::FullTitle& meta)
+bool queue_contains(hsapi::hid id)
 {
+	return g_queue_ids.count(id) != 0;
+}
+
+bool queue_contains_tid(hsapi::htid tid)
+{
+	return g_queue_tids.count(tid) != 0;
+}
+
+bool queue_add(const hsapi::FullTitle& meta)
+{
+	/* the same title (or a different hShop entry for the
+	 * same title id) would just be installed twice */
+	if(queue_contains(meta.id) || queue_contains_tid(meta.tid))
+	{
+		vlog("not queueing duplicate title id=%lld, tid=%016llX", meta.id, meta.tid);
+		return false;
+	}
+	g_queue_ids[meta.id] = meta.tid;
+	g_queue_tids.insert(meta.tid);
 	g_queue.push_back(meta);
+	return true;
 }
 
-void queue_add(hsapi::hid id, bool disp)
+bool queue_add(hsapi::hid id, bool disp)
 {
+	/* saves us a title_meta call */
+	if(queue_contains(id)) return false;
 	hsapi::FullTitle meta;
 	Result res = disp ? hsapi::call(hsapi::title_meta, meta, std::move(id))
 		: hsapi::scall(hsapi::title_meta, meta, std::move(id));
-	if(R_FAILED(res)) return;
-	queue_add(meta);
+	if(R_FAILED(res)) return false;
+	return queue_add(meta);
+}
+
+static std::vector<hsapi::FullTitle>::iterator queue_iter(hsapi::hid id)
+{
+	/* saves the scan for titles that aren't queued */
+	if(!queue_contains(id)) return g_queue.end();
+	return std::find_if(g_queue.begin(), g_queue.end(),
+		[id](const hsapi::FullTitle& meta) -> bool { return meta.id == id; });
 }
 
-void queue_remove(size_t index)
+const hsapi::FullTitle *queue_find(hsapi::hid id)
 {
-	g_queue.erase(g_queue.begin() + index);
+	std::vector<hsapi::FullTitle>::iterator it = queue_iter(id);
+	return it == g_queue.end() ? nullptr : &*it;
+}
+
+void queue_remove(hsapi::hid id)
+{
+	std::vector<hsapi::FullTitle>::iterator it = queue_iter(id);
+	if(it == g_queue.end()) return;
+	g_queue_tids.erase(it->tid);
+	g_queue_ids.erase(it->id);
+	g_queue.erase(it);
 }
 
 void queue_clear()
 {
+	g_queue_tids.clear();
+	g_queue_ids.clear();
 	g_queue.clear();
 }
 
-void queue_process(size_t index)
+void queue_process(hsapi::hid id)
 {
-	if(R_SUCCEEDED(install::gui::hs_cia(g_queue[index])))
-		queue_remove(index);
+	const hsapi::FullTitle *meta = queue_find(id);
+	/* hs_cia() may add to the queue through find-missing, so no reference */
+	if(meta != nullptr && R_SUCCEEDED(install::gui::hs_cia(hsapi::FullTitle(*meta))))
+		queue_remove(id);
 }
 
-void queue_process_all()
+/* base games first so updates and DLC never get installed
+ * without their base, then updates, then DLC (and everything else) */
+static int plan_rank(hsapi::htid tid)
 {
-	Result res = ctr::lockNDM();
-	bool hasLock = R_SUCCEEDED(res);
-	if(!hasLock) elog("failed to acquire NDM lock: %08lX", res);
+	if(ctr::is_base_tid(tid)) return 0;
+	return ctr::get_tid_cat(tid) == 0x000E ? 1 : 2;
+}
+
+void queue_plan(QueuePlan& plan)
+{
+	plan.rejected.clear();
+	plan.order.clear();
 
-	struct errvec {
+	for(size_t i = 0; i < 3; ++i)
+	{
 		Result res;
-		hsapi::FullTitle *meta;
-	};
-	std::vector<errvec> errs;
+		plan.needed[i] = 0;
+		if(R_FAILED(res = ctr::get_free_space((ctr::Destination) i, &plan.free[i])))
+		{
+			/* we'll let the installer find out if it fits */
+			elog("failed to get free space for destination %u: %08lX", i, res);
+			plan.free[i] = U64_MAX;
+		}
+	}
+
+	bool isNew = false;
+	if(R_FAILED(APT_CheckNew3DS(&isNew)))
+		isNew = true; /* the installer checks again anyway */
+
+	std::vector<size_t> order(g_queue.size());
+	for(size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [](size_t a, size_t b) -> bool {
+		int ra = plan_rank(g_queue[a].tid), rb = plan_rank(g_queue[b].tid);
+		if(ra != rb) return ra < rb;
+		return ctr::detect_dest(g_queue[a].tid) < ctr::detect_dest(g_queue[b].tid);
+	});
+
+	/* base tid => why it was rejected */
+	std::unordered_map<hsapi::htid, Result> rejectedBases;
+	for(size_t i : order)
+	{
+		const hsapi::FullTitle& meta = g_queue[i];
+		ctr::Destination dest = ctr::detect_dest(meta.tid);
+		Result res = 0;
+
+		if(!isNew && ((meta.flags & hsapi::TitleFlag::is_ktr) || meta.prod.rfind("KTR-", 0) == 0))
+			res = APPERR_NOSUPPORT;
+		else if(!ctr::is_base_tid(meta.tid))
+		{
+			/* the base game is queued but won't be installed so this can't be either */
+			std::unordered_map<hsapi::htid, Result>::iterator it = rejectedBases.find(ctr::get_base_tid(meta.tid));
+			if(it != rejectedBases.end()) res = it->second;
+		}
+		if(R_SUCCEEDED(res) && plan.needed[dest] + meta.size > plan.free[dest])
+			res = APPERR_NOSPACE;
+
+		if(R_FAILED(res))
+		{
+			ilog("rejecting title with id=%llu in plan: %08lX", meta.id, res);
+			plan.rejected.push_back({ meta.id, res });
+			if(ctr::is_base_tid(meta.tid))
+				rejectedBases[meta.tid] = res;
+			continue;
+		}
+
+		plan.needed[dest] += meta.size;
+		plan.order.push_back(meta.id);
+	}
+}
+
+static bool confirm_plan(const QueuePlan& plan)
+{
+	static const char *destnames[] = { "CTRNand", "TWLNand", "SD" };
+	std::string media;
+	for(size_t i = 0; i < 3; ++i)
+	{
+		if(plan.needed[i] == 0) continue;
+		if(media.size()) media += "\n";
+		media += plan.free[i] == U64_MAX
+			? std::string(destnames[i]) + ": " + ui::human_readable_size_block<u64>(plan.needed[i])
+			: PSTRING(queue_plan_medium, std::string(destnames[i]), ui::human_readable_size_block<u64>(plan.needed[i]),
+				ui::human_readable_size_block<u64>(plan.free[i]));
+	}
+
+	return ui::Confirm::exec(PSTRING(queue_plan, plan.order.size(), plan.rejected.size()), media, true);
+}
+
+void queue_process_all()
+{
+	QueuePlan plan;
+	queue_plan(plan);
+	/* if nothing can be installed we go straight to replaying the errors */
+	if(plan.order.size() != 0 && !confirm_plan(plan))
+		return;
+
+	/* the actual installing happens in the background,
+	 * queue_finish_background() picks up the results */
+	install::BackgroundService *bg = install::background();
+	for(hsapi::hid id : plan.order)
+		bg->enqueue(*queue_find(id));
+
+	if(plan.rejected.size() != 0)
+	{
+		ui::notice(STRING(replaying_errors));
+		for(const QueuePlan::Rejected& rej : plan.rejected)
+		{
+			error_container err = get_error(rej.res);
+			handle_error(err, &queue_find(rej.id)->name);
+		}
+	}
+
+	queue_clear();
+}
+
+void queue_finish_background()
+{
+	install::BackgroundService *bg = install::background(false);
+	/* we only want to handle complete batches */
+	if(bg == nullptr || !bg->idle()) return;
+
+	install::BackgroundService::Status status;
+	status.generation = 0;
+	bg->snapshot(status);
+	bg->clear_finished();
+	if(status.jobs.size() == 0) return;
+
 	enum PostProcFlag {
 		NONE       = 0,
 		WARN_THEME = 1,
 		WARN_FILE  = 2,
 		SET_PATCH  = 4,
 	}; int procflag = NONE;
-	for(hsapi::FullTitle& meta : g_queue)
+	std::vector<install::BackgroundService::Job *> errs;
+	for(install::BackgroundService::Job& job : status.jobs)
 	{
-		ilog("Processing title with id=%llu", meta.id);
-		res = install::gui::hs_cia(meta, false);
-		ilog("Finished processing, res=%016lX", res);
-		if(R_FAILED(res))
-		{
-			errvec ev;
-			ev.res = res; ev.meta = &meta;
-			errs.push_back(ev);
-			if(res == APPERR_CANCELLED)
-				break; /* finished */
-		}
-		else
+		if(job.state == install::JobState::failed)
+			errs.push_back(&job);
+		else if(job.state == install::JobState::done)
 		{
-			if(luma::set_locale(meta.tid))
+			if(luma::set_locale(job.meta.tid))
 				procflag |= SET_PATCH;
-			if(meta.cat == THEMES_CATEGORY)
+			if(job.meta.cat == THEMES_CATEGORY)
 				procflag |= WARN_THEME;
-			else if(meta.flags & hsapi::TitleFlag::installer)
+			else if(job.meta.flags & hsapi::TitleFlag::installer)
 				procflag |= WARN_FILE;
 		}
 	}
 
+	ui::RenderQueue::global()->find_tag<ui::FreeSpaceIndicator>(ui::tag::free_indicator)->update();
+	library::rescan();
 	if(procflag & SET_PATCH) luma::maybe_set_gamepatching();
 	if(procflag & WARN_THEME) ui::notice(STRING(theme_installed));
 	if(procflag & WARN_FILE) ui::notice(STRING(file_installed));
 
 	if(errs.size() != 0)
 	{
-		ui::LED::ClearTimeout();
-		install::gui::ErrorLED();
-		if(hasLock) ctr::unlockNDM();
-
 		ui::notice(STRING(replaying_errors));
-		for(errvec& ev : errs)
+		for(install::BackgroundService::Job *job : errs)
 		{
-			error_container err = get_error(ev.res);
-			handle_error(err, &ev.meta->name);
+			error_container err = get_error(job->res);
+			handle_error(err, &job->meta.name);
 		}
 	}
-	else
-	{
-		ui::LED::ClearTimeout();
-		install::gui::SuccessLED();
-		if(hasLock) ctr::unlockNDM();
-	}
+}
 
-	/* TODO: Only clear successful installs */
-	queue_clear();
+static void show_background_status()
+{
+	ui::RenderQueue queue;
+
+	ui::builder<ui::Text>(ui::Screen::top, STRING(installing_background))
+		.x(ui::layout::center_x)
+		.y(ui::layout::center_y)
+		.wrap()
+		.add_to(queue);
+
+	ui::builder<ui::ButtonCallback>(ui::Screen::top, KEY_X)
+		.connect(ui::ButtonCallback::kdown, [](u32) -> bool {
+			install::background()->cancel_all();
+			return false;
+		})
+		.add_to(queue);
+
+	queue.render_finite_button(KEY_A | KEY_B);
 }
 
 static void queue_is_empty()
@@ -155,10 +325,15 @@ void show_queue()
 	using list_t = ui::List<hsapi::FullTitle>;
 	bool focus = set_focus(true);
 
+	queue_finish_background();
+	install::BackgroundService *bg = install::background(false);
+
 	// Queue is empty :craig:
 	if(g_queue.size() == 0)
 	{
-		queue_is_empty();
+		if(bg != nullptr && !bg->idle())
+			show_background_status();
+		else queue_is_empty();
 		set_focus(focus);
 		return;
 	}
@@ -177,10 +352,11 @@ void show_queue()
 			((void) i);
 			ui::RenderQueue::global()->render_and_then((std::function<bool()>) [self, meta, kDown]() -> bool {
 				size_t i = self->get_pos(); /* for some reason the i param corrupted (?) */
+				hsapi::hid id = self->at(i).id;
 				if(kDown & KEY_X)
-					queue_remove(i);
+					queue_remove(id);
 				else if(kDown & KEY_A)
-					queue_process(i);
+					queue_process(id);
 
 				if(g_queue.size() == 0)
 					return false; /* we're done */
@@ -207,7 +383,7 @@ void show_queue()
 	ui::builder<ui::Button>(ui::Screen::bottom, STRING(install_all))
 		.connect(ui::Button::click, []() -> bool {
 			ui::RenderQueue::global()->render_and_then(queue_process_all);
-			/* the queue will always be empty after this */
+			/* the queue is handed to the background service, or the user backed out */
 			return false;
 		})
 		.wrap()
@@ -23,7 +23,7 @@
 UI_CTHEME_GETTER(color_border, ui::theme::smdh_icon_border_color)
 UI_SLOTS(ui::SMDHIcon_color, color_border)
 
-void ui::SMDHIcon::setup(ctr::TitleSMDH *smdh, SMDHIconType type)
+void ui::SMDHIcon::setup(const ctr::TitleSMDHInfo *smdh, SMDHIconType type)
 {
 	unsigned int dim;
 	load_smdh_icon(&this->img, *smdh, type, &dim);
@@ -36,12 +36,11 @@ void ui::SMDHIcon::setup(ctr::TitleSMDH *smdh, SMDHIconType type)
 
 void ui::SMDHIcon::setup(u64 tid, SMDHIconType type)
 {
-	ctr::TitleSMDH *smdh = ctr::smdh::get(tid);
-	if(smdh == nullptr) panic("Failed to load smdh.");
+	ctr::TitleSMDHInfo smdh;
+	if(!ctr::smdh::lookup(tid, smdh)) panic("Failed to load smdh.");
 
 	unsigned int dim;
-	load_smdh_icon(&this->img, *smdh, type, &dim);
-	delete smdh;
+	load_smdh_icon(&this->img, smdh, type, &dim);
 
 	this->params.pos.h = this->params.pos.w = dim;
 	this->params.depth = this->z;
@@ -19,7 +19,9 @@
 #include <time.h>
 #include <3ds.h>
 
+#include "installgui.hh"
 #include "settings.hh"
+#include "install.hh"
 #include "panic.hh"
 #include "ctr.hh"
 
@@ -251,6 +253,80 @@ bool ui::BatteryIndicator::render(const ui::Keys& keys)
 	return true;
 }
 
+/* InstallIndicator */
+
+void ui::InstallIndicator::setup()
+{
+	this->text.setup(this->screen);
+	this->text->resize(0.4f, 0.4f);
+	this->text->set_y(ui::screen_height() - 22.0f);
+
+	this->generation = 0;
+	this->wasBusy = false;
+}
+
+bool ui::InstallIndicator::render(const ui::Keys& keys)
+{
+	this->update();
+	return this->wasBusy ? this->text->render(keys) : true;
+}
+
+bool ui::InstallIndicator::batchFinished = false;
+
+bool ui::InstallIndicator::batch_finished()
+{
+	bool ret = batchFinished;
+	batchFinished = false;
+	return ret;
+}
+
+void ui::InstallIndicator::update()
+{
+	install::BackgroundService *bg = install::background(false);
+	/* don't snapshot if nothing changed */
+	if(bg == nullptr || bg->get_generation() == this->generation)
+		return;
+
+	install::BackgroundService::Status status;
+	status.generation = 0;
+	bg->snapshot(status);
+	this->generation = status.generation;
+
+	size_t total = 0, finished = 0;
+	install::BackgroundService::Job *running = nullptr;
+	bool hasError = false;
+	for(install::BackgroundService::Job& job : status.jobs)
+	{
+		switch(job.state)
+		{
+		case install::JobState::running: running = &job; /* fallthrough */
+		case install::JobState::queued: ++total; break;
+		case install::JobState::failed: hasError = true; /* fallthrough */
+		case install::JobState::done: ++total; ++finished; break;
+		case install::JobState::cancelled: break;
+		}
+	}
+
+	bool busy = finished != total;
+	if(this->wasBusy && !busy)
+	{
+		/* batch is done */
+		ui::LED::ClearTimeout();
+		if(hasError) install::gui::ErrorLED();
+		else install::gui::SuccessLED();
+		batchFinished = true;
+	}
+	this->wasBusy = busy;
+	if(!busy) return;
+
+	std::string perc = running != nullptr && running->total != 0
+		? std::to_string(running->done * 100 / running->total) + "%" : "0%";
+	this->text->set_text(PSTRING(background_progress, finished + 1, total, perc));
+	this->text->set_x(ui::screen_width(this->screen) - this->text->width() - 5.0f);
+}
+
+/* NetIndicator */
+
 void ui::NetIndicator::setup()
 {
 	this->sprite.setup(ui::Screen::top, ui::Sprite::spritesheet, (u32) ui::sprite::net_discon);
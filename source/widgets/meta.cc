@@ -191,3 +191,46 @@ float ui::TitleMeta::get_y()
 float ui::TitleMeta::get_x()
 { return 10.0f; }
 
+/* InstalledMeta */
+
+void ui::InstalledMeta::setup(const library::Title& title)
+{ this->set_title(title); }
+
+void ui::InstalledMeta::set_title(const library::Title& title)
+{
+	this->queue.clear();
+
+	ui::builder<ui::Text>(this->screen, title.name)
+		.x(this->get_x())
+		.y(this->get_y())
+		.scroll()
+		.add_to(this->queue);
+	ui::builder<ui::Text>(this->screen, STRING(name))
+		.size(0.45f)
+		.x(this->get_x())
+		.under(this->queue.back(), -1.0f)
+		.add_to(this->queue);
+
+	PAIR(title.publisher, STRING(publisher));
+	PAIR(ctr::tid_to_str(title.tid), STRING(tid));
+	PAIR(hsapi::parse_vstring(title.version), STRING(version));
+	clip_q(this->queue, this->get_y());
+}
+
+bool ui::InstalledMeta::render(const ui::Keys& keys)
+{
+	return this->queue.render_screen(keys, this->screen);
+}
+
+float ui::InstalledMeta::width()
+{ return 0.0f; } /* fullscreen */
+
+float ui::InstalledMeta::height()
+{ return 0.0f; } /* fullscreen */
+
+float ui::InstalledMeta::get_y()
+{ return 10.0f; }
+
+float ui::InstalledMeta::get_x()
+{ return 10.0f; }
+
@@ -0,0 +1,308 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The find-missing pass from include/missing.hh against a fake AM and
+ * hShop, and a benchmark of the whole pass against the per-title
+ * version of find-missing it replaced */
+
+#include "missing.hh"
+#include "test.hh"
+
+#include <algorithm>
+#include <iterator>
+
+typedef struct Title
+{
+	uint64_t tid;
+	int64_t id;
+	uint16_t version;
+} Title;
+
+typedef struct Related
+{
+	std::vector<Title> updates;
+	std::vector<Title> dlc;
+} Related;
+
+typedef std::unordered_map<uint64_t, Related> related_map;
+
+/* every call to AM is an IPC round trip to the AM sysmodule and every
+ * batch_related() an HTTPS request, these are stand-ins for those costs.
+ * The amount of calls is printed as well so the result doesn't depend
+ * on these numbers */
+#define FAKE_IPC_COST_US  50
+#define FAKE_HTTP_COST_US 20000
+
+static void busy_wait(int us)
+{
+	auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+	while(std::chrono::steady_clock::now() < end)
+		;
+}
+
+/* 1000 installed games on the SD and NAND with an update and DLC each
+ * on hShop, some of those installed and some of those outdated. The
+ * game card holds copies of a few games under a different title id */
+class World
+{
+public:
+	std::unordered_map<uint64_t, uint16_t> am[missing::media_count]; /* tid => installed version */
+	std::vector<uint64_t> installed[missing::media_count];
+	related_map hshop;
+	std::unordered_set<int64_t> queued;
+	uint64_t bad = 0; /* AM fails on this tid */
+	size_t amCalls = 0, hshopCalls = 0;
+
+	World()
+	{
+		int64_t id = 1;
+		for(uint64_t k = 0; k < 1000; ++k)
+		{
+			size_t media = k < 900 ? 0 : 1;
+			uint64_t unique = (0x1000 + k) << 8;
+			uint64_t base = 0x0004000000000000ULL | unique;
+			this->install(media, base, 0);
+
+			Related& rel = this->hshop[base];
+			rel.updates.push_back({ 0x0004000E00000000ULL | unique, id++, 1040 });
+			rel.dlc.push_back({ 0x0004008C00000000ULL | unique, id++, 16 });
+			if(k % 10 == 0) /* demo, never added */
+				rel.dlc.push_back({ 0x0004000200000000ULL | unique, id++, 0 });
+			if(k % 2 == 0) /* half of them is outdated */
+				this->install(media, rel.updates[0].tid, k % 4 == 0 ? 1024 : 1040);
+			if(k % 3 == 0)
+				this->install(media, rel.dlc[0].tid, 16);
+			if(k % 50 == 0)
+				this->queued.insert(rel.dlc[0].id);
+			if(k < 20)
+				this->install(2, unique | 0x0004000000000001ULL, 0);
+		}
+	}
+
+	int32_t get(size_t media, const uint64_t *tids, size_t count, uint16_t *ret)
+	{
+		++this->amCalls;
+		busy_wait(FAKE_IPC_COST_US);
+		for(size_t i = 0; i < count; ++i)
+		{
+			std::unordered_map<uint64_t, uint16_t>::iterator it = this->am[media].find(tids[i]);
+			if(it == this->am[media].end() || tids[i] == this->bad)
+				return -1;
+			ret[i] = it->second;
+		}
+		return 0;
+	}
+
+	int32_t batch_related(related_map& ret, const std::vector<uint64_t>& tids)
+	{
+		++this->hshopCalls;
+		busy_wait(FAKE_HTTP_COST_US);
+		for(uint64_t tid : tids)
+		{
+			related_map::iterator it = this->hshop.find(tid);
+			if(it != this->hshop.end()) ret[tid] = it->second;
+		}
+		return 0;
+	}
+
+	missing::Backend<Title, Related> backend(missing::RelatedCache<Related> *cache)
+	{
+		missing::Backend<Title, Related> be;
+		be.versions = [this](size_t media, const std::vector<uint64_t>& tids, std::vector<uint16_t>& ret) -> int32_t {
+			ret.resize(tids.size());
+			return this->get(media, tids.data(), tids.size(), ret.data());
+		};
+		be.version = [this](size_t media, uint64_t tid, uint16_t& ret) -> int32_t {
+			return this->get(media, &tid, 1, &ret);
+		};
+		be.related = [this, cache](related_map& ret, const std::vector<uint64_t>& tids, const std::vector<uint16_t>& versions) -> int32_t {
+			size_t fetched;
+			return cache->get(ret, tids, versions, 1000, [this](related_map& ret, const std::vector<uint64_t>& tids) -> int32_t {
+				return this->batch_related(ret, tids);
+			}, &fetched);
+		};
+		be.skip = [this](const Title& title) -> bool { return this->queued.count(title.id) != 0; };
+		return be;
+	}
+
+
+private:
+	void install(size_t media, uint64_t tid, uint16_t version)
+	{
+		this->am[media][tid] = version;
+		this->installed[media].push_back(tid);
+	}
+
+
+};
+
+/* what find-missing did before: linear scans, erasing duplicates from the middle
+ * of a vector, no related content cache and one AM call per installed title */
+static void old_find_missing(World& world, std::vector<Title>& ret)
+{
+	std::vector<uint64_t> installed;
+	for(size_t i = 0; i < missing::media_count; ++i)
+		installed.insert(installed.end(), world.installed[i].begin(), world.installed[i].end());
+
+	std::vector<uint64_t> games;
+	std::copy_if(installed.begin(), installed.end(), std::back_inserter(games), missing::can_have_missing);
+	std::unordered_set<uint32_t> dedupe;
+	for(size_t i = 0; i < games.size(); ++i)
+	{
+		uint32_t unique = missing::tid_unique(games[i]);
+		if(dedupe.find(unique) == dedupe.end())
+			dedupe.insert(unique);
+		else
+		{
+			games.erase(games.begin() + i);
+			--i;
+		}
+	}
+
+	related_map related;
+	world.batch_related(related, games);
+
+	std::vector<Title> potential;
+	for(uint64_t game : games)
+	{
+		potential.insert(potential.end(), related[game].updates.begin(), related[game].updates.end());
+		potential.insert(potential.end(), related[game].dlc.begin(), related[game].dlc.end());
+	}
+
+	std::copy_if(potential.begin(), potential.end(), std::back_inserter(ret), [&world, &installed](const Title& title) -> bool {
+		if(missing::tid_cat(title.tid) == 0x2)
+			return false;
+		if(world.queued.count(title.id) != 0)
+			return false;
+		if(std::find(installed.begin(), installed.end(), title.tid) == installed.end())
+			return true;
+		/* ctr::mediatype_of() */
+		size_t media = 0;
+		while(world.am[media].count(title.tid) == 0) ++media;
+		uint16_t version;
+		if(world.get(media, &title.tid, 1, &version) < 0)
+			return false;
+		return title.version > version;
+	});
+}
+
+static std::vector<uint64_t> tids_of(const std::vector<const Title *>& titles)
+{
+	std::vector<uint64_t> ret;
+	for(const Title *title : titles) ret.push_back(title->tid);
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+static std::vector<uint64_t> tids_of(const std::vector<Title>& titles)
+{
+	std::vector<uint64_t> ret;
+	for(const Title& title : titles) ret.push_back(title.tid);
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+static void test_find()
+{
+	World world;
+	missing::RelatedCache<Related> cache(60);
+	missing::Backend<Title, Related> be = world.backend(&cache);
+
+	std::vector<Title> old;
+	old_find_missing(world, old);
+	/* 500 updates that aren't installed and 250 outdated ones, 666
+	 * DLC that isn't installed minus the 13 of those that are queued */
+	CHECK(old.size() == 500 + 250 + 666 - 13);
+
+	related_map related;
+	std::vector<const Title *> found;
+	world.amCalls = world.hshopCalls = 0;
+	CHECK(missing::find(world.installed, 0, be, related, found) == 0);
+	CHECK(tids_of(found) == tids_of(old));
+	/* installed versions and outdated titles, per media */
+	CHECK(world.amCalls <= 2 * missing::media_count);
+	CHECK(world.hshopCalls == 1);
+
+	/* served from the cache the second time */
+	related.clear(); found.clear();
+	world.hshopCalls = 0;
+	CHECK(missing::find(world.installed, 0, be, related, found) == 0);
+	CHECK(tids_of(found) == tids_of(old));
+	CHECK(world.hshopCalls == 0);
+
+	/* a changed installed version refetches */
+	world.am[0][world.installed[0][0]] = 1;
+	size_t fetched = 0;
+	related.clear();
+	std::vector<uint16_t> versions(1, 1);
+	cache.get(related, std::vector<uint64_t>(1, world.installed[0][0]), versions, 1000,
+		[&world](related_map& ret, const std::vector<uint64_t>& tids) -> int32_t { return world.batch_related(ret, tids); }, &fetched);
+	CHECK(fetched == 1);
+	/* too old */
+	cache.get(related, std::vector<uint64_t>(1, world.installed[0][0]), versions, 1061,
+		[&world](related_map& ret, const std::vector<uint64_t>& tids) -> int32_t { return world.batch_related(ret, tids); }, &fetched);
+	CHECK(fetched == 1);
+
+	/* a single title */
+	related.clear(); found.clear();
+	CHECK(missing::find(world.installed, world.installed[0][0], be, related, found) == 0);
+	CHECK(found.size() == 1); /* the update, the DLC is installed */
+
+	/* a bad title fails the batch, the rest is still checked one by one */
+	uint64_t outdated = world.hshop[world.installed[0][0]].updates[0].tid;
+	world.bad = outdated;
+	related.clear(); found.clear();
+	world.amCalls = 0;
+	CHECK(missing::find(world.installed, 0, be, related, found) == 0);
+	CHECK(found.size() == old.size() - 1);
+	CHECK(world.amCalls > 2 * missing::media_count);
+}
+
+static void bench_find()
+{
+	World world;
+	std::vector<Title> old;
+	world.amCalls = world.hshopCalls = 0;
+	double told = bench_ms([&]() -> void { old.clear(); old_find_missing(world, old); }, 1);
+	size_t oldAm = world.amCalls, oldHshop = world.hshopCalls;
+
+	missing::RelatedCache<Related> cache(60);
+	missing::Backend<Title, Related> be = world.backend(&cache);
+	related_map related;
+	std::vector<const Title *> found;
+	size_t am[2], hshop[2];
+	double tnew[2];
+	for(size_t i = 0; i < 2; ++i)
+	{
+		world.amCalls = world.hshopCalls = 0;
+		related.clear(); found.clear();
+		tnew[i] = bench_ms([&]() -> void { missing::find(world.installed, 0, be, related, found); }, 1);
+		am[i] = world.amCalls;
+		hshop[i] = world.hshopCalls;
+	}
+
+	printf("1000 titles: old %zu AM + %zu hShop calls %.1f ms, new %zu AM + %zu hShop calls %.1f ms (%.0fx), "
+		"cached %zu AM + %zu hShop calls %.1f ms (%.0fx)\n", oldAm, oldHshop, told, am[0], hshop[0], tnew[0],
+		told / tnew[0], am[1], hshop[1], tnew[1], told / tnew[1]);
+	CHECK(tnew[0] < told && tnew[1] < tnew[0]);
+}
+
+int main()
+{
+	test_find();
+	bench_find();
+	return TEST_RESULT();
+}
@@ -0,0 +1,161 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* install::Service driven by a fake backend, see include/install_service.hh */
+
+#include "install_service.hh"
+#include "test.hh"
+
+#include <atomic>
+#include <string>
+
+typedef install::Service<std::string> service_type;
+
+/* installs "titles" in 4 steps of 100 bytes, a title named "fail" fails
+ * and the backend blocks between steps while gate is closed */
+static std::atomic<bool> gate(true);
+static std::atomic<int> started(0);
+
+static int32_t fake_backend(const std::string& meta, service_type::prog_type prog, const volatile bool *cancel)
+{
+	++started;
+	for(uint64_t i = 1; i <= 4; ++i)
+	{
+		while(!gate && !*cancel)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		if(*cancel) return -2;
+		prog(i * 100, 400);
+	}
+	return meta == "fail" ? -1 : 0;
+}
+
+static install::JobState state_of(service_type& svc, uint32_t id)
+{
+	service_type::Status status;
+	status.generation = 0;
+	svc.snapshot(status);
+	for(service_type::Job& job : status.jobs)
+		if(job.id == id) return job.state;
+	return (install::JobState) 0xFF;
+}
+
+static void test_runs_in_order()
+{
+	service_type svc(fake_backend);
+	uint32_t a = svc.enqueue("a");
+	uint32_t b = svc.enqueue("fail");
+	uint32_t c = svc.enqueue("c");
+	svc.start();
+	CHECK(wait_until([&]() -> bool { return svc.idle(); }));
+
+	service_type::Status status;
+	status.generation = 0;
+	svc.snapshot(status);
+	CHECK(status.jobs.size() == 3);
+	CHECK(status.jobs[0].id == a && status.jobs[0].state == install::JobState::done);
+	CHECK(status.jobs[0].done == 400 && status.jobs[0].total == 400);
+	CHECK(status.jobs[1].id == b && status.jobs[1].state == install::JobState::failed);
+	CHECK(status.jobs[1].res == -1);
+	CHECK(status.jobs[2].id == c && status.jobs[2].state == install::JobState::done);
+
+	/* nothing changed, the jobs aren't copied again */
+	uint32_t gen = status.generation;
+	status.jobs.resize(1);
+	svc.snapshot(status);
+	CHECK(status.generation == gen && status.jobs.size() == 1);
+
+	svc.clear_finished();
+	status.generation = 0;
+	svc.snapshot(status);
+	CHECK(status.jobs.size() == 0);
+}
+
+static void test_cancel()
+{
+	gate = false;
+	started = 0;
+	service_type svc(fake_backend);
+	uint32_t a = svc.enqueue("a");
+	uint32_t b = svc.enqueue("b");
+	uint32_t c = svc.enqueue("c");
+	svc.start();
+	CHECK(wait_until([&]() -> bool { return state_of(svc, a) == install::JobState::running; }));
+
+	/* queued job, never reaches the backend */
+	CHECK(svc.cancel(b));
+	CHECK(state_of(svc, b) == install::JobState::cancelled);
+	/* running job, through the cancel flag */
+	CHECK(svc.cancel(a));
+	CHECK(wait_until([&]() -> bool { return state_of(svc, a) == install::JobState::cancelled; }));
+	CHECK(!svc.cancel(a));
+
+	gate = true;
+	CHECK(wait_until([&]() -> bool { return svc.idle(); }));
+	CHECK(state_of(svc, c) == install::JobState::done);
+	CHECK(started == 2);
+}
+
+static void test_pause_and_stop()
+{
+	service_type svc(fake_backend);
+	svc.pause(true);
+	svc.start();
+	uint32_t a = svc.enqueue("a");
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	CHECK(state_of(svc, a) == install::JobState::queued);
+
+	svc.pause(false);
+	CHECK(wait_until([&]() -> bool { return state_of(svc, a) == install::JobState::done; }));
+
+	/* stop() keeps queued jobs around for the next start() */
+	svc.pause(true);
+	uint32_t b = svc.enqueue("b");
+	svc.stop();
+	CHECK(state_of(svc, b) == install::JobState::queued);
+	svc.pause(false);
+	svc.start();
+	CHECK(wait_until([&]() -> bool { return state_of(svc, b) == install::JobState::done; }));
+
+	/* stop() while a job is running cancels it and doesn't hang */
+	gate = false;
+	uint32_t c = svc.enqueue("c");
+	CHECK(wait_until([&]() -> bool { return state_of(svc, c) == install::JobState::running; }));
+	svc.stop();
+	CHECK(state_of(svc, c) == install::JobState::cancelled);
+	gate = true;
+}
+
+static void test_thread_finished()
+{
+	std::atomic<bool> release(false);
+	ctr::thread<> th([&release]() -> void {
+		while(!release) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	});
+	/* must not report a running thread as finished before it's joined */
+	CHECK(!th.finished());
+	release = true;
+	CHECK(wait_until([&]() -> bool { return th.finished(); }));
+	th.join();
+}
+
+int main()
+{
+	test_runs_in_order();
+	test_cancel();
+	test_pause_and_stop();
+	test_thread_finished();
+	return TEST_RESULT();
+}
@@ -0,0 +1,62 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef inc_test_hh
+#define inc_test_hh
+
+/* Minimal helpers for the host tests in test/, every test is
+ * a standalone program that exits with 1 if a check failed */
+
+#include <functional>
+#include <chrono>
+#include <thread>
+
+#include <stdio.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond) \
+	do { if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		++test_failures; \
+	} } while(0)
+
+#define TEST_RESULT() \
+	(test_failures == 0 ? (puts("ok"), 0) : (fprintf(stderr, "%d check(s) failed\n", test_failures), 1))
+
+/* polls pred until it returns true or timeout_ms passed */
+static inline bool wait_until(std::function<bool()> pred, int timeout_ms = 2000)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	while(!pred())
+	{
+		if(std::chrono::steady_clock::now() > deadline)
+			return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+/* milliseconds spent running cb iters times */
+static inline double bench_ms(std::function<void()> cb, int iters)
+{
+	auto begin = std::chrono::steady_clock::now();
+	for(int i = 0; i < iters; ++i)
+		cb();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+#endif
@@ -0,0 +1,203 @@
+/* This file is part of 3hs
+ * Copyright (C) 2021-2022 hShop developer team
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* utf16_to_utf8_n() from include/utf16.hh, and a benchmark
+ * against the conversion ctr::utf16conv used to do */
+
+#include "utf16.hh"
+#include "test.hh"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+static std::string conv(const uint16_t *str, size_t len)
+{
+	std::string ret;
+	ret.resize(UTF16_MAX_UTF8(len));
+	ret.resize(utf16_to_utf8_n(&ret[0], str, len));
+	return ret;
+}
+
+static void test_conversion()
+{
+	/* ASCII, 2 and 3 byte sequences */
+	const uint16_t mixed[] = { 'a', 0xE9, 0x20AC, 0x7FF, 0x800, 0xFFFF };
+	CHECK(conv(mixed, 6) == "a\xC3\xA9\xE2\x82\xAC\xDF\xBF\xE0\xA0\x80\xEF\xBF\xBF");
+
+	/* surrogate pairs, U+1F600 and U+10FFFF */
+	const uint16_t pairs[] = { 0xD83D, 0xDE00, 0xDBFF, 0xDFFF };
+	CHECK(conv(pairs, 4) == "\xF0\x9F\x98\x80\xF4\x8F\xBF\xBF");
+
+	/* unpaired surrogates become U+FFFD */
+	const uint16_t lone_low[] = { 'a', 0xDC00, 'b' };
+	CHECK(conv(lone_low, 3) == "a\xEF\xBF\xBD" "b");
+	const uint16_t lone_high[] = { 0xD800, 'b' };
+	CHECK(conv(lone_high, 2) == "\xEF\xBF\xBD" "b");
+	const uint16_t two_high[] = { 0xD800, 0xD800, 0xDC00 };
+	CHECK(conv(two_high, 3) == "\xEF\xBF\xBD\xF0\x90\x80\x80");
+
+	/* truncated input, a high surrogate as the last unit */
+	CHECK(conv(pairs, 1) == "\xEF\xBF\xBD");
+	CHECK(conv(pairs, 3) == "\xF0\x9F\x98\x80\xEF\xBF\xBD");
+
+	/* stops at len or at the first NUL, whichever comes first */
+	const uint16_t nul[] = { 'a', 'b', 0, 'c' };
+	CHECK(conv(nul, 4) == "ab");
+	CHECK(conv(nul, 1) == "a");
+	CHECK(conv(nul, 0) == "");
+
+	/* the worst case fits in UTF16_MAX_UTF8() */
+	uint16_t worst[64];
+	for(size_t i = 0; i < 64; ++i) worst[i] = 0xD800;
+	char out[UTF16_MAX_UTF8(64) + 1];
+	out[UTF16_MAX_UTF8(64)] = 0x55;
+	CHECK(utf16_to_utf8_n(out, worst, 64) == UTF16_MAX_UTF8(64));
+	CHECK(out[UTF16_MAX_UTF8(64)] == 0x55);
+	for(size_t i = 0; i < 64; i += 2) { worst[i] = 0xD83D; worst[i + 1] = 0xDE00; }
+	CHECK(utf16_to_utf8_n(out, worst, 64) == 32 * 4);
+
+	/* every BMP code point that isn't a surrogate round trips through
+	 * the table the same way the plain range checks would encode it */
+	bool ok = true;
+	for(uint32_t cp = 1; cp < 0x10000 && ok; ++cp)
+	{
+		if(cp >= 0xD800 && cp <= 0xDFFF) continue;
+		uint16_t unit = cp;
+		char buf[3];
+		size_t len = utf16_to_utf8_n(buf, &unit, 1);
+		size_t want = cp < 0x80 ? 1 : cp < 0x800 ? 2 : 3;
+		ok = len == want && (len != 1 || buf[0] == (char) cp)
+			&& (len != 2 || (((buf[0] & 0x1F) << 6) | (buf[1] & 0x3F)) == (int) cp)
+			&& (len != 3 || (((buf[0] & 0x0F) << 12) | ((buf[1] & 0x3F) << 6) | (buf[2] & 0x3F)) == (int) cp);
+	}
+	CHECK(ok);
+}
+
+/* what ctr::utf16conv did before, with libctru's utf16_to_utf8()
+ * copied in since it isn't available off-console */
+static ssize_t libctru_utf16_to_utf8(uint8_t *out, const uint16_t *in, size_t len)
+{
+	ssize_t rc = 0;
+	uint32_t code;
+	do
+	{
+		uint16_t code1 = *in++;
+		ssize_t units;
+		if(code1 >= 0xD800 && code1 < 0xDC00)
+		{
+			uint16_t code2 = *in++;
+			if(code2 < 0xDC00 || code2 >= 0xE000) return -1;
+			code = (code1 << 10) + code2 - 0x35FDC00;
+		}
+		else code = code1;
+		if(code == 0) break;
+
+		uint8_t encoded[4];
+		if(code < 0x80) { encoded[0] = code; units = 1; }
+		else if(code < 0x800)
+		{
+			encoded[0] = 0xC0 | (code >> 6);
+			encoded[1] = 0x80 | (code & 0x3F);
+			units = 2;
+		}
+		else if(code < 0x10000)
+		{
+			encoded[0] = 0xE0 | (code >> 12);
+			encoded[1] = 0x80 | ((code >> 6) & 0x3F);
+			encoded[2] = 0x80 | (code & 0x3F);
+			units = 3;
+		}
+		else
+		{
+			encoded[0] = 0xF0 | (code >> 18);
+			encoded[1] = 0x80 | ((code >> 12) & 0x3F);
+			encoded[2] = 0x80 | ((code >> 6) & 0x3F);
+			encoded[3] = 0x80 | (code & 0x3F);
+			units = 4;
+		}
+		if(rc + units <= (ssize_t) len)
+			for(ssize_t i = 0; i < units; ++i)
+				*out++ = encoded[i];
+		rc += units;
+	} while(code > 0);
+	return rc;
+}
+
+static std::string old_u16conv(const uint16_t *str, size_t size)
+{
+	uint16_t *strexpand = (uint16_t *) malloc((size + 1) * sizeof(uint16_t));
+	memcpy(strexpand, str, size * sizeof(uint16_t));
+	strexpand[size] = 0;
+
+	uint8_t *buf = (uint8_t *) malloc(size * 4);
+	memset(buf, 0, size * 4);
+	ssize_t len = libctru_utf16_to_utf8(buf, strexpand, size * 4);
+	std::string ret = len < 0 ? std::string() : std::string((char *) buf, len);
+
+	free(strexpand);
+	free(buf);
+	return ret;
+}
+
+static void bench_conversion()
+{
+	/* a full SMDH worth of titles: 16 languages of
+	 * short (0x40), long (0x80) and publisher (0x40) */
+	static const char *ascii = "Super Mario 3D Land - Nintendo of America";
+	static const uint16_t japanese[] = { 0x30B9, 0x30FC, 0x30D1, 0x30FC, 0x30DE, 0x30EA, 0x30AA, 0x0020, 0x0033, 0x0044, 0x30E9, 0x30F3, 0x30C9 };
+	uint16_t smdh[16][3][0x80];
+	memset(smdh, 0, sizeof(smdh));
+	for(size_t lang = 0; lang < 16; ++lang)
+		for(size_t field = 0; field < 3; ++field)
+		{
+			size_t max = field == 1 ? 0x80 : 0x40;
+			for(size_t i = 0; i < max - 1; ++i)
+				smdh[lang][field][i] = lang == 0 || lang == 1 ? japanese[i % 13] : ascii[i % strlen(ascii)];
+		}
+
+	size_t sink = 0;
+	for(size_t lang = 0; lang < 16; ++lang)
+		for(size_t field = 0; field < 3; ++field)
+		{
+			size_t max = field == 1 ? 0x80 : 0x40;
+			CHECK(conv(smdh[lang][field], max) == old_u16conv(smdh[lang][field], max));
+		}
+
+	const int iters = 20000;
+	double told = bench_ms([&]() -> void {
+		for(size_t lang = 0; lang < 16; ++lang)
+			for(size_t field = 0; field < 3; ++field)
+				sink += old_u16conv(smdh[lang][field], field == 1 ? 0x80 : 0x40).size();
+	}, iters);
+	char arena[UTF16_MAX_UTF8(0x80)];
+	double tnew = bench_ms([&]() -> void {
+		for(size_t lang = 0; lang < 16; ++lang)
+			for(size_t field = 0; field < 3; ++field)
+				sink += utf16_to_utf8_n(arena, smdh[lang][field], field == 1 ? 0x80 : 0x40);
+	}, iters);
+
+	printf("%d SMDHs: old u16conv %.1f ms, utf16_to_utf8_n %.1f ms (%.1fx) [%zu]\n",
+		iters, told, tnew, told / tnew, sink);
+}
+
+int main()
+{
+	test_conversion();
+	bench_conversion();
+	return TEST_RESULT();
+}